@@ -0,0 +1,41 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+#ifndef __BUILTIN_H__
+#define __BUILTIN_H__
+
+#include "metric.h"
+
+/*
+ * Open the files read by the built-in collectors.
+ */
+int builtin_init(void);
+
+/*
+ * Close the files read by the built-in collectors.
+ */
+void builtin_fini(void);
+
+/*
+ * Find the built-in collector 'name' for context ctx.  The VU_STATS_*
+ * groups the collector reads are returned in stats.
+ * Returns NULL if there is no such collector, or if it reads values
+ * that only describe dom0 on a Xen host.
+ */
+metric_func builtin_lookup(const char *name, metric_context ctx,
+                           unsigned int *stats);
+
+#endif                          /* __BUILTIN_H__ */
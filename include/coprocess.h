@@ -0,0 +1,52 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+#ifndef __COPROCESS_H__
+#define __COPROCESS_H__
+
+#include <stddef.h>
+
+typedef struct _coprocess coprocess;
+
+/*
+ * Create a co-process running the shell command cmd.  The command
+ * is started on the first request.
+ */
+coprocess *coprocess_new(const char *cmd);
+
+/* Returned by coprocess_request() if the co-process did not reply in time */
+#define COPROCESS_TIMEOUT -2
+
+/*
+ * Send the request line req to the co-process and read one reply line
+ * into reply, without the line feed.  A co-process that has exited is
+ * restarted, one that does not reply within timeout milliseconds is
+ * killed.  Returns 0 on success, COPROCESS_TIMEOUT or -1 on failure.
+ */
+int coprocess_request(coprocess *cp, const char *req, char *reply, size_t len,
+                      int timeout);
+
+/*
+ * Stop the co-process and free it.  No request may be running.
+ */
+void coprocess_free(coprocess *cp);
+
+/*
+ * Stop all co-processes.
+ */
+void coprocess_fini(void);
+
+#endif                          /* __COPROCESS_H__ */
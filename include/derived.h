@@ -0,0 +1,59 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+#ifndef __DERIVED_H__
+#define __DERIVED_H__
+
+typedef struct _derived_expr derived_expr;
+
+/*
+ * Called by derived_compile() for each metric named in an expression,
+ * with sum set for names inside sum().  Returns a handle >= 0 that is
+ * passed to the lookup function, or -1 if the name can't be used.
+ */
+typedef int (*derived_resolve)(const char *name, int sum, void *opaque);
+
+/*
+ * Called by derived_eval() for the value of a handle.  Returns 0 and
+ * the value in val, or -1 if there is no value.
+ */
+typedef int (*derived_lookup)(int ref, void *opaque, double *val);
+
+/*
+ * Compile the expression src.  Supported are numbers, metric names,
+ * names in single quotes, + - * / and parentheses, sum(name) and
+ * delta(expression).  Returns NULL if the expression is not valid.
+ */
+derived_expr *derived_compile(const char *src, derived_resolve resolve,
+                              void *opaque);
+
+void derived_free(derived_expr *e);
+
+/*
+ * Allocate the state kept between evaluations of the expression, the
+ * last values of its delta() terms.  Returns NULL on failure.
+ */
+double *derived_state_new(const derived_expr *e);
+
+/*
+ * Evaluate the expression with the state from derived_state_new().
+ * Returns -1 if a metric has no value, on division by zero, or if a
+ * delta() term has no previous value yet.
+ */
+int derived_eval(const derived_expr *e, derived_lookup lookup, void *opaque,
+                 double *state, double *result);
+
+#endif                          /* __DERIVED_H__ */
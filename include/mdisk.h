@@ -0,0 +1,90 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+#ifndef __MDISK_H__
+#define __MDISK_H__
+
+#include <stdint.h>
+
+/*
+ * Binary metrics disk format, shared by vhostmd and libmetrics.
+ *
+ * The disk starts with the same header as the XML format, signature,
+ * busy flag, checksum and length, but with the signature 'mvb2'.  The
+ * content that follows is
+ * - a content header
+ * - the index, count records of MDISK2_RECORD_SIZE bytes, sorted by
+ *   context (host first), VM UUID and name, so a metric is found with
+ *   a binary search
+ * - the string table, NUL terminated strings referenced by their
+ *   offset in the table; offset 0 is the empty string
+ *
+ * All numbers are big endian.  Offsets are from the start of the
+ * content.
+ */
+
+#define MDISK_SIGNATURE_V2    0x6d766232  /* 'mvb2' */
+
+/*
+ * A disk in JSON format has the header of the XML format with the
+ * signature 'mvbj', followed by the JSON document.
+ */
+#define MDISK_SIGNATURE_JSON  0x6d76626a  /* 'mvbj' */
+
+/*
+ * A disk in version 2 of the XML schema, metrics of a VM grouped in a
+ * vm element, has the header of the XML format with the signature
+ * 'mvx2', followed by the XML document.
+ */
+#define MDISK_SIGNATURE_XML2  0x6d767832  /* 'mvx2' */
+
+typedef struct _mdisk2_content {
+   uint32_t count;        /* number of records */
+   uint32_t index;        /* offset of the first record */
+   uint32_t strings;      /* offset of the string table */
+   uint32_t strings_len;
+} mdisk2_content;
+
+/* Context of a record */
+#define MDISK2_HOST           0
+#define MDISK2_VM             1
+
+/* Flags of a record */
+#define MDISK2_STALE          (1 << 0)
+
+/*
+ * A metric value.  type is a metric type, M_INT32 to M_STRING, which
+ * are numbered alike in vhostmd and libmetrics.  Integers are stored
+ * as 64 bit values, reals as IEEE 754 doubles; the value of a string
+ * is the offset of the string in the upper and its length in the lower
+ * 32 bits.
+ */
+typedef struct _mdisk2_record {
+   uint8_t context;
+   uint8_t type;
+   uint8_t flags;
+   uint8_t reserved;
+   int32_t vm_id;         /* -1 for host metrics */
+   uint32_t uuid;         /* string offset, empty for host metrics */
+   uint32_t name;         /* string offset */
+   uint32_t unit;         /* string offset, empty if there is no unit */
+   uint32_t reserved2;
+   uint64_t value;
+} mdisk2_record;
+
+#define MDISK2_RECORD_SIZE    32
+
+#endif                          /* __MDISK_H__ */
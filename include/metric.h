@@ -21,9 +21,13 @@
 #ifndef __METRIC_H__
 #define __METRIC_H__
 
+#include <stdarg.h>
 #include <stdint.h>
+#include <time.h>
 
 #include "util.h"
+#include "coprocess.h"
+#include "derived.h"
 
 /* Supported types for metric values */
 typedef enum _metric_type {
@@ -45,20 +49,123 @@ typedef enum _metric_context {
 
 typedef int (*metric_func)(void *);
 
-/* Encapsulation of metric definition */
-typedef struct _metric {
+/* Interval of metrics collected only once */
+#define METRIC_INTERVAL_ONCE  -1
+
+/* Returned by metric_value_get() if the action did not finish in time */
+#define METRIC_TIMEOUT        -2
+
+/* What to report for a metric whose action timed out */
+typedef enum _metric_fallback {
+   METRIC_FALLBACK_OMIT,     /* leave the metric out */
+   METRIC_FALLBACK_LAST,     /* report the last value */
+   METRIC_FALLBACK_STALE     /* report the last value, marked stale */
+} metric_fallback;
+
+/* How the collected value of a metric is reported */
+typedef enum _metric_kind {
+   METRIC_KIND_GAUGE,        /* as collected */
+   METRIC_KIND_COUNTER       /* as the rate per second of a counter */
+} metric_kind;
+
+/* Status of a counter metric that has no rate yet */
+#define METRIC_NO_RATE        -3
+
+/* Status of a derived metric whose expression has no value */
+#define METRIC_NO_VALUE       -4
+
+/* An action compiled into literal text and placeholders */
+typedef struct _action_template action_template;
+
+/* Formats the metrics are written in */
+typedef enum _metric_format {
+   METRIC_FORMAT_XML,
+   METRIC_FORMAT_JSON,
+   METRIC_FORMAT_XML2,       /* compact XML, metrics grouped per VM */
+   METRIC_FORMAT_COUNT
+} metric_format;
+
+/* The output of a metric in each format, see metric_fragment() */
+typedef struct _metric_cache metric_cache;
+
+/* A variable of a group metric, or the single value of other metrics */
+typedef struct _metric_var {
    char *name;
-   char *action;
    char *type_str;
-   int cnt;
+   metric_type type;
    char *unit;
-   metric_context ctx;
+   char *xml;         /* escaped element text, see metric_xml_prepare() */
+   int xml_open;      /* length of the opening "<metric type= context=" */
+   int xml_unit;      /* length of the unit attribute that follows */
+   int xml_len;
+   char *json;        /* opening of the JSON object, name to unit */
+   int json_len;
+   char *xml2;        /* compact element text, see metric_xml2_prepare() */
+   int xml2_open;     /* length of the opening "<metric type= unit=" */
+   int xml2_len;
+} metric_var;
+
+/*
+ * A collected value parsed into the type of its variable.  Strings
+ * are kept in the metric's text value and referenced by offset.
+ */
+typedef struct _metric_slot {
+   union {
+      int32_t i32;
+      uint32_t u32;
+      int64_t i64;
+      uint64_t u64;
+      float r32;
+      double r64;
+      struct {
+         uint32_t off;
+         uint32_t len;
+      } str;
+   } v;
+   int valid;         /* the field parsed as its type */
+} metric_slot;
+
+/* Configuration strings of a metric, only needed to format and log it */
+typedef struct _metric_info {
+   char *name;        /* comma separated variable names for groups */
+   char *action;
+   char *derived;     /* expression of a derived metric */
+   metric_var *vars;  /* cnt variables */
+} metric_info;
+
+/*
+ * Encapsulation of metric definition.  The fields used while collecting
+ * come first; the configuration strings are kept apart in info, which
+ * the copies made for each VM share.
+ */
+typedef struct _metric {
    metric_type type;
+   metric_context ctx;
+   metric_kind kind;
+   int cnt;
    metric_func pf;
-   char *value;
+   void *pf_data;            /* collector of a plugin's pf */
+   coprocess *cp;
+   action_template *tmpl;    /* compiled action */
+   action_template **argv;   /* compiled arguments if it needs no shell */
+   derived_expr *expr;       /* computed from other metrics */
+   double *state;            /* per copy state of expr */
    vu_vm *vm;
-   
-   struct _metric *next;
+   char *value;
+   size_t value_size;
+   metric_slot *slots;       /* cnt typed values parsed from value */
+   int status;
+   int stale;         /* value is left over from an earlier update */
+   int due;           /* collect in the current update */
+   int all_vms;       /* one action prints "uuid,value" lines for all VMs */
+   int interval;      /* seconds, 0 to collect on every update */
+   int ttl;           /* seconds a command's output may be reused */
+   int timeout;       /* seconds an action may run, 0 for no limit */
+   metric_fallback on_timeout;
+   unsigned long long *samples;   /* last counter sample, cnt values */
+   struct timespec sample_time;
+   metric_cache *cache;      /* per copy, METRIC_FORMAT_COUNT entries */
+   metric_info *info;
 } metric;
 
 
@@ -68,9 +175,142 @@ int metric_type_from_str(const xmlChar *type, metric_type *typ);
 
 int metric_value_to_str(metric *def, char **str);
 
+/*
+ * Set def->value from a printf style format, used by collectors
+ * that produce the value themselves.
+ */
+int metric_value_printf(metric *def, const char *fmt, ...)
+  __attribute__((format (printf, 2, 3)));
+
+int metric_value_vprintf(metric *def, const char *fmt, va_list args)
+  __attribute__((format (printf, 2, 0)));
+
+/*
+ * Start a new update.  Command results of the previous update and
+ * results older than their ttl are discarded.
+ */
+void metric_results_expire(void);
+
+/*
+ * Discard all command results.
+ */
+void metric_results_free(void);
+
+/*
+ * Prepare running the metric's command action.  The action is compiled
+ * into a template once; actions without shell syntax are also split
+ * into arguments and run without a shell.
+ */
+int metric_action_prepare(metric *def);
+
+/*
+ * Free what metric_action_prepare() and metric_coprocess_create()
+ * set up.
+ */
+void metric_action_free(metric *def);
+
+/*
+ * Run the metric's action as a co-process.  The command is started
+ * once and asked for each value with a request line.
+ */
+int metric_coprocess_create(metric *def);
+
+/*
+ * Run the metric's action and store its output in def->value, parsed
+ * into def->slots.  Fields that are not valid values of their type are
+ * marked invalid.  Counter metrics store the rate since the previous
+ * sample, the first sample returns METRIC_NO_RATE.  The return value
+ * is also kept in def->status.
+ */
 int metric_value_get(metric *def);
 
-int metric_xml(metric *m, vu_buffer *buf);
+/*
+ * Get variable var of the value as a number.  Returns -1 if the metric
+ * has no valid value.
+ */
+int metric_value_real(const metric *def, int var, double *val);
+
+/*
+ * Set the value of a derived metric, converted to its type.  The
+ * status is set to 0, or to -1 if v is out of the type's range.
+ */
+int metric_value_set(metric *def, double v);
+
+/*
+ * A serializer writes the metrics of the host and of each VM into a
+ * fragment of their own, on the worker pool.  A transport joins the
+ * fragments into a document: head, the non-empty fragments separated
+ * by sep, and tail.  Serializers write as they go, without building a
+ * tree of the document.
+ */
+typedef struct _metric_serializer {
+   const char *name;          /* in the configuration and virtio requests */
+   const char *head;
+   const char *sep;
+   const char *tail;
+
+   /*
+    * Encode the fixed parts of the metric's output, everything but the
+    * VM and the value, once for all updates.
+    */
+   int (*prepare)(metric *m);
+
+   /*
+    * Write the value collected by the last metric_value_get() to the
+    * empty buffer buf.  Invalid fields are left out.
+    */
+   int (*format)(metric *m, vu_buffer *buf);
+
+   /* Append a comment to a document, NULL if the format has none */
+   void (*comment)(vu_buffer *buf, const char *text);
+
+   /*
+    * Open the group of the metrics of a VM, NULL if VM metrics are not
+    * grouped.  vm_tail closes the group.
+    */
+   void (*vm_head)(vu_buffer *buf, const vu_vm *vm);
+   const char *vm_tail;
+} metric_serializer;
+
+const metric_serializer *metric_serializer_get(metric_format f);
+
+/*
+ * Look up a format by name, case insensitive.  Returns -1 if there is
+ * no such format.
+ */
+int metric_format_from_str(const char *name, metric_format *f);
+
+/*
+ * Append fragment frag to the document doc, after s->sep unless it is
+ * the first.  n counts the fragments added so far.
+ */
+void metric_fragment_add(const metric_serializer *s, vu_buffer *doc,
+                         const vu_buffer *frag, int *n);
+
+/*
+ * Prepare the metric for all serializers.
+ */
+int metric_serializers_prepare(metric *m);
+
+/*
+ * Hash of everything the output of the metric depends on that may
+ * change between updates: status, value and VM id.
+ */
+uint64_t metric_output_hash(const metric *m);
+
+/*
+ * Get the output of the metric in format f into frag.  The output is
+ * kept and only rendered again when hash, from metric_output_hash(),
+ * differs from the hash it was rendered with.  Returns the result of
+ * the serializer's format function.
+ */
+int metric_fragment(metric *m, metric_format f, uint64_t hash,
+                    const vu_buffer **frag);
+
+/*
+ * Free the output kept by metric_fragment().
+ */
+void metric_fragments_free(metric *m);
 
 #ifdef WITH_XENSTORE
 int metrics_xenstore_update(char *buffer, int *ids, int num_vms);
@@ -0,0 +1,43 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+#ifndef __PLUGIN_H__
+#define __PLUGIN_H__
+
+#include "metric.h"
+
+/*
+ * Load the plugins in directory dir, all files ending in ".so".
+ * Plugins are loaded once; a different directory on a later call is
+ * ignored with a warning.  Plugins that fail to load are skipped.
+ * Returns -1 if the directory can't be read.
+ */
+int plugin_load(const char *dir);
+
+/*
+ * Call the plugins' fini functions and unload them.
+ */
+void plugin_fini(void);
+
+/*
+ * Find the collector 'name' registered by a plugin for context ctx.
+ * Returns the function to collect with, which expects the collector
+ * returned in data in the metric's pf_data, or NULL if there is no
+ * such collector.
+ */
+metric_func plugin_lookup(const char *name, metric_context ctx, void **data);
+
+#endif                          /* __PLUGIN_H__ */
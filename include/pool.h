@@ -0,0 +1,40 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+#ifndef __POOL_H__
+#define __POOL_H__
+
+typedef void (*pool_func)(void *arg);
+
+/*
+ * Start the worker pool.  'size' is the number of tasks run at the
+ * same time, including the calling thread.  A size of 1 runs all
+ * tasks in the calling thread.
+ */
+int pool_init(int size);
+
+/*
+ * Call func for each of the n elements in args and wait until all
+ * calls have returned.
+ */
+void pool_run(pool_func func, void **args, int n);
+
+/*
+ * Stop and join the worker threads.
+ */
+void pool_fini(void);
+
+#endif                          /* __POOL_H__ */
@@ -51,8 +51,16 @@ typedef struct _vu_vm
    int id;
    char *name;
    char *uuid;
+   void *stats;   /* statistics of the last vu_list_vms() call */
 } vu_vm;
 
+/* Groups of VM statistics fetched by vu_list_vms() */
+#define VU_STATS_CPU        (1 << 0)
+#define VU_STATS_BALLOON    (1 << 1)
+#define VU_STATS_VCPU       (1 << 2)
+#define VU_STATS_INTERFACE  (1 << 3)
+#define VU_STATS_BLOCK      (1 << 4)
+
 
 /* The libvirt URI to connect to (-c argument on the command line).  If
  * not set, this will be NULL.
@@ -91,6 +99,24 @@ int vu_buffer_delete(vu_buffer *buf);
  */
 void vu_buffer_add(vu_buffer *buf, const char *str, int len);
 
+/*
+ * Add str to buffer, escaped for XML text and attribute values.
+ * Control characters not allowed in XML are replaced by '?'.
+ */
+void vu_buffer_add_escaped(vu_buffer *buf, const char *str, int len);
+
+/*
+ * Add str to buffer, escaped for a JSON string, without the quotes.
+ */
+void vu_buffer_add_json(vu_buffer *buf, const char *str, int len);
+
+/*
+ * Add the decimal representation of val to buffer.
+ */
+void vu_buffer_add_int(vu_buffer *buf, long long val);
+
+void vu_buffer_add_uint(vu_buffer *buf, unsigned long long val);
+
 /*
  * Do a formatted print to buffer.
  */
@@ -132,11 +158,33 @@ char *vu_xpath_string(const char *xpath, xmlXPathContextPtr ctxt);
  */
 int vu_xpath_long(const char *xpath, xmlXPathContextPtr ctxt, long *value);
 
-int vu_num_vms(void);
+/*
+ * List the running VMs sorted by UUID, fetching the VU_STATS_* groups in
+ * stats for all of them with a single libvirt call.  Running VMs are
+ * tracked with libvirt domain events where possible.  The statistics
+ * stay valid until the next call.  Returns the number of VMs in vms,
+ * -1 on failure.
+ */
+int vu_list_vms(vu_vm ***vms, unsigned int stats);
+
+/*
+ * Free a list returned by vu_list_vms().
+ */
+void vu_vms_free(vu_vm **vms, int num);
 
-int vu_get_vms(int *ids, int max_ids);
+/*
+ * Get a statistics value, e.g. "cpu.time", of a VM.
+ * Returns 0 on success, -1 if the value is not available.
+ */
+int vu_vm_stat(vu_vm *vm, const char *field, unsigned long long *val);
 
-vu_vm *vu_get_vm(int id);
+/*
+ * Get the sum of a statistics value over all devices of a group,
+ * e.g. group "net" and field "rx.bytes".
+ * Returns 0 on success, -1 if the group is not available.
+ */
+int vu_vm_stat_sum(vu_vm *vm, const char *group, const char *field,
+                   unsigned long long *val);
 
 void vu_vm_free(vu_vm *vm);
 
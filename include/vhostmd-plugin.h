@@ -0,0 +1,99 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+#ifndef __VHOSTMD_PLUGIN_H__
+#define __VHOSTMD_PLUGIN_H__
+
+/*
+ * Interface of vhostmd collector plugins.
+ *
+ * A plugin is a shared object in the configured plugin directory.  It
+ * exports
+ *
+ *   const unsigned int vhostmd_plugin_abi = VHOSTMD_PLUGIN_ABI;
+ *   int vhostmd_plugin_init(const vhostmd_plugin_api *api);
+ *
+ * and optionally
+ *
+ *   void vhostmd_plugin_fini(void);
+ *
+ * vhostmd_plugin_init() is called once after loading and registers
+ * the plugin's collectors with api->register_collector().  It returns
+ * 0 on success; a plugin returning non-zero is unloaded.
+ * vhostmd_plugin_fini() is called before the plugin is unloaded at
+ * exit.  Metrics use a plugin's collector like a built-in one, with
+ * <action builtin="name"/>.
+ *
+ * Only plain C types cross this interface.  New members are only ever
+ * added at the end of vhostmd_plugin_api, so a plugin built against an
+ * older header keeps working; VHOSTMD_PLUGIN_ABI changes only when
+ * existing members change.
+ */
+
+#define VHOSTMD_PLUGIN_ABI      1
+
+/* Context of a collector */
+#define VHOSTMD_PLUGIN_HOST     0
+#define VHOSTMD_PLUGIN_VM       1
+
+/* Log levels */
+#define VHOSTMD_PLUGIN_ERR      0
+#define VHOSTMD_PLUGIN_WARN     1
+#define VHOSTMD_PLUGIN_INFO     2
+
+/* The VM a vm collector is called for */
+typedef struct _vhostmd_plugin_vm {
+   int id;
+   const char *name;
+   const char *uuid;
+} vhostmd_plugin_vm;
+
+/* Where a collector writes the value it collected */
+typedef struct _vhostmd_sink vhostmd_sink;
+
+/*
+ * Collect one value and write it to sink.  vm is NULL for host
+ * collectors.  The value is text, as an action would print it, with
+ * comma separated fields for group metrics.  Returns 0 on success,
+ * non-zero if there is no value.  Collectors are called from several
+ * threads at once, e.g. for different VMs, and must not block for
+ * long.
+ */
+typedef int (*vhostmd_collect_func)(void *data, const vhostmd_plugin_vm *vm,
+                                    vhostmd_sink *sink);
+
+typedef struct _vhostmd_plugin_api {
+   /* VHOSTMD_PLUGIN_ABI of the running vhostmd */
+   unsigned int abi;
+
+   /*
+    * Register the collector 'name' for metrics of context
+    * VHOSTMD_PLUGIN_HOST or VHOSTMD_PLUGIN_VM.  data is passed to
+    * collect.  Returns -1 if the name is already taken.
+    */
+   int (*register_collector)(const char *name, int context,
+                             vhostmd_collect_func collect, void *data);
+
+   /* Set the value from a printf style format */
+   int (*sink_printf)(vhostmd_sink *sink, const char *fmt, ...)
+      __attribute__((format (printf, 2, 3)));
+
+   /* Log a message with vhostmd's log */
+   void (*log)(int level, const char *fmt, ...)
+      __attribute__((format (printf, 2, 3)));
+} vhostmd_plugin_api;
+
+#endif                          /* __VHOSTMD_PLUGIN_H__ */
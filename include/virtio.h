@@ -21,10 +21,14 @@
 #ifndef __VIRTIO_H__
 #define __VIRTIO_H__
 
+#include "util.h"
+
 /*
- * Initialize virtio layer
+ * Initialize virtio layer.  formats has bit 1 << metric_format set for
+ * each format served.
  */
-int virtio_init(char *channel_path, int max_channel, int expiration_period);
+int virtio_init(char *channel_path, int max_channel, int expiration_period,
+                unsigned int formats);
 
 /*
  * Main virtio function
@@ -33,10 +37,10 @@ int virtio_init(char *channel_path, int max_channel, int expiration_period);
 void *virtio_run(void *arg);
 
 /*
- * Update the metrics response buffer of a VM/host
+ * Update the metrics response buffers of a VM/host from its fragments,
+ * one for each metric_format
  */
-int virtio_metrics_update(const char *buf,
-                          int len,
+int virtio_metrics_update(vu_buffer **frags,
                           int id,
                           const char *name);
 
@@ -29,6 +29,9 @@
 #include <dirent.h>
 #include <pthread.h>
 #include <ctype.h>
+#include <float.h>
+#include <math.h>
+#include <endian.h>
 #include <arpa/inet.h>
 #include <libxml/xpath.h>
 #ifdef WITH_XENSTORE
@@ -36,6 +39,7 @@
 #endif
 
 #include "libmetrics.h"
+#include "mdisk.h"
 
 typedef struct _mdisk_header
 {
@@ -49,6 +53,7 @@ typedef struct _metric_disk {
    char uuid[256];
    char *disk_name;
    char *buffer;
+   uint32_t sig;
    uint32_t sum;
    uint32_t length;
    xmlParserCtxtPtr pctxt;
@@ -66,6 +71,9 @@ typedef struct _private_metric
 
 #define MDISK_SIGNATURE     0x6d766264  /* 'mvbd' */
 #define SYS_BLOCK    "/sys/block"
+#ifndef DEBUG_MDISK_PATH
+#define DEBUG_MDISK_PATH "/dev/shm/vhostmd0"   /* with DEBUG_FROM_DOM0 */
+#endif
 #define HOST_CONTEXT "host"
 #define VM_CONTEXT   "vm"
 
@@ -137,13 +145,13 @@ static int metric_value_str_to_type(metric *mdef, char *str)
          mdef->value.i32 = atoi(str);
          break;
       case M_UINT32:
-         mdef->value.ui32 = atoi(str);
+         mdef->value.ui32 = (uint32_t) strtoul(str, NULL, 10);
          break;
       case M_INT64:
-         mdef->value.ui64 = atoll(str);
+         mdef->value.i64 = strtoll(str, NULL, 10);
          break;
       case M_UINT64:
-         mdef->value.ui64 = atoll(str);
+         mdef->value.ui64 = strtoull(str, NULL, 10);
          break;
       case M_REAL32:
          mdef->value.r32 = atof(str);
@@ -219,6 +227,25 @@ static metric *metric_alloc_padded(int pad)
    return m;
 }
 
+/*
+ * Path of a metric in the xml buffer.  Version 2 of the schema groups
+ * VM metrics in vm elements, looked up by the UUID of this VM if it
+ * is known, otherwise the name must be unique among the VM metrics.
+ */
+static int mdef_path(metric_disk *mdisk, private_metric *pmdef, char **path)
+{
+   if (mdisk->sig != MDISK_SIGNATURE_XML2)
+      return asprintf(path, "//metrics/metric[name='%s'][@context='%s']",
+                      pmdef->name, pmdef->context);
+
+   if (strcmp(pmdef->context, HOST_CONTEXT) == 0)
+      return asprintf(path, "/metrics/metric[name='%s']", pmdef->name);
+   if (pmdef->uuid && pmdef->uuid[0] != '\0')
+      return asprintf(path, "/metrics/vm[@uuid='%s']/metric[name='%s']",
+                      pmdef->uuid, pmdef->name);
+   return asprintf(path, "/metrics/vm/metric[name='%s']", pmdef->name);
+}
+
 /*
  * Get metric from the xml buffer, value set in pmdef
  */
@@ -228,6 +255,7 @@ static int get_mdef(metric_disk *mdisk, private_metric *pmdef)
    xmlXPathObjectPtr obj = NULL;
    xmlNodePtr node;
    char *str;
+   char *path = NULL;
    char *xpath;
    int ret = -1;
 
@@ -237,11 +265,12 @@ static int get_mdef(metric_disk *mdisk, private_metric *pmdef)
    }
 
    /* Get the matching metric node type */
-   if (asprintf(&xpath, "//metrics/metric[name='%s'][@context='%s']", pmdef->name, pmdef->context) < 0)
+   if (mdef_path(mdisk, pmdef, &path) < 0) {
+       path = NULL;
        goto out;
+   }
 
-   obj = xmlXPathEval(BAD_CAST xpath, ctxt);
-   free(xpath);
+   obj = xmlXPathEval(BAD_CAST path, ctxt);
    if ((obj == NULL) || (obj->type != XPATH_NODESET)) {
       libmsg("%s(): No metrics found that matches %s in context:%s or malformed definition\n",
               __func__, pmdef->name, pmdef->context);
@@ -262,7 +291,8 @@ static int get_mdef(metric_disk *mdisk, private_metric *pmdef)
    xmlXPathFreeObject(obj);
 
    /* Get the matching metric node value */
-   if (asprintf(&xpath, "//metrics/metric[name='%s'][@context='%s']/value/text()", pmdef->name, pmdef->context) < 0)
+   obj = NULL;
+   if (asprintf(&xpath, "%s/value/text()", path) < 0)
        goto out;
 
    obj = xmlXPathEval( BAD_CAST xpath, ctxt);  /* worked but no nodes */
@@ -280,6 +310,7 @@ static int get_mdef(metric_disk *mdisk, private_metric *pmdef)
    ret = 0;
 
 out:
+   free(path);
    if (obj)
       xmlXPathFreeObject(obj);
    if (ctxt)
@@ -287,6 +318,550 @@ out:
    return ret;
 }
 
+static const char *mdisk2_types[] = {
+   "int32", "uint32", "int64", "uint64", "real32", "real64", "string"
+};
+
+static const mdisk2_content *mdisk2_header(const metric_disk *mdisk)
+{
+   return (const mdisk2_content *) mdisk->buffer;
+}
+
+static const mdisk2_record *mdisk2_records(const metric_disk *mdisk)
+{
+   return (const mdisk2_record *)
+          (mdisk->buffer + ntohl(mdisk2_header(mdisk)->index));
+}
+
+static const char *mdisk2_strings(const metric_disk *mdisk)
+{
+   return mdisk->buffer + ntohl(mdisk2_header(mdisk)->strings);
+}
+
+/*
+ * Check that the index and all string references of a binary disk lie
+ * within its content, so lookups need no further checks.
+ */
+static int mdisk2_check(const metric_disk *mdisk)
+{
+   const mdisk2_content *c;
+   const mdisk2_record *r;
+   const char *strings;
+   uint32_t count, index, off, len, i;
+   uint64_t v;
+
+   if (mdisk->length < sizeof(mdisk2_content))
+      return -1;
+
+   c = mdisk2_header(mdisk);
+   count = ntohl(c->count);
+   index = ntohl(c->index);
+   off = ntohl(c->strings);
+   len = ntohl(c->strings_len);
+
+   /* records are read in place and must be aligned */
+   if (index < sizeof(mdisk2_content) || index % 8 || index > mdisk->length ||
+       count > (mdisk->length - index) / MDISK2_RECORD_SIZE)
+      return -1;
+   if (off < index + count * MDISK2_RECORD_SIZE || off > mdisk->length ||
+       len == 0 || len > mdisk->length - off)
+      return -1;
+
+   /* the last string is terminated, so every offset starts a string */
+   strings = mdisk2_strings(mdisk);
+   if (strings[len - 1] != '\0')
+      return -1;
+
+   r = mdisk2_records(mdisk);
+   for (i = 0; i < count; i++, r++) {
+      if (r->type > M_STRING || ntohl(r->uuid) >= len ||
+          ntohl(r->name) >= len || ntohl(r->unit) >= len)
+         return -1;
+      if (r->type == M_STRING) {
+         v = be64toh(r->value);
+         if ((v >> 32) >= len || (v & 0xffffffff) >= len - (v >> 32))
+            return -1;
+      }
+   }
+
+   return 0;
+}
+
+static int mdisk2_cmp(const metric_disk *mdisk, const mdisk2_record *r,
+                      uint8_t context, const char *uuid, const char *name)
+{
+   const char *strings = mdisk2_strings(mdisk);
+   int c;
+
+   if (r->context != context)
+      return r->context < context ? -1 : 1;
+   if ((c = strcmp(strings + ntohl(r->uuid), uuid)) != 0)
+      return c;
+   return strcmp(strings + ntohl(r->name), name);
+}
+
+/*
+ * Find a metric in the index of a binary disk.  VM metrics are looked
+ * up by the UUID of this VM if it is known, otherwise the name must be
+ * unique among the VM metrics, as for the XML format.
+ */
+static const mdisk2_record *mdisk2_find(const metric_disk *mdisk,
+                                        const char *name,
+                                        metric_context context)
+{
+   const mdisk2_record *r = mdisk2_records(mdisk);
+   const mdisk2_record *found = NULL;
+   const char *strings = mdisk2_strings(mdisk);
+   uint32_t lo = 0, hi = ntohl(mdisk2_header(mdisk)->count), mid;
+   uint8_t ctx = context == METRIC_CONTEXT_VM ? MDISK2_VM : MDISK2_HOST;
+   const char *uuid = ctx == MDISK2_VM ? mdisk->uuid : "";
+   int c;
+
+   if (ctx == MDISK2_VM && uuid[0] == '\0') {
+      for (mid = 0; mid < hi; mid++) {
+         if (r[mid].context != ctx ||
+             strcmp(strings + ntohl(r[mid].name), name))
+            continue;
+         if (found)
+            return NULL;
+         found = &r[mid];
+      }
+      return found;
+   }
+
+   while (lo < hi) {
+      mid = lo + (hi - lo) / 2;
+      c = mdisk2_cmp(mdisk, &r[mid], ctx, uuid, name);
+      if (c == 0)
+         return &r[mid];
+      if (c < 0)
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+
+   return NULL;
+}
+
+static int mdisk2_get_metric(const metric_disk *mdisk, const char *name,
+                             metric_context context, metric **mdef)
+{
+   const mdisk2_record *r;
+   metric *lmdef;
+   uint64_t v;
+   uint32_t len = 0;
+   double d;
+
+   if ((r = mdisk2_find(mdisk, name, context)) == NULL) {
+      libmsg("%s(): No metrics found that matches %s in context:%s\n",
+             __func__, name,
+             context == METRIC_CONTEXT_VM ? VM_CONTEXT : HOST_CONTEXT);
+      return -1;
+   }
+
+   v = be64toh(r->value);
+   if (r->type == M_STRING)
+      len = (uint32_t) (v & 0xffffffff);
+
+   if ((lmdef = metric_alloc_padded(len ? len + 1 : 0)) == NULL) {
+      errno = ENOMEM;
+      return -1;
+   }
+
+   lmdef->type = r->type;
+   switch (r->type) {
+      case M_INT32:
+         lmdef->value.i32 = (int32_t) v;
+         break;
+      case M_UINT32:
+         lmdef->value.ui32 = (uint32_t) v;
+         break;
+      case M_INT64:
+         lmdef->value.i64 = (int64_t) v;
+         break;
+      case M_UINT64:
+         lmdef->value.ui64 = v;
+         break;
+      case M_REAL32:
+         memcpy(&d, &v, sizeof(d));
+         lmdef->value.r32 = (float) d;
+         break;
+      case M_REAL64:
+         memcpy(&lmdef->value.r64, &v, sizeof(v));
+         break;
+      case M_STRING:
+         lmdef->value.str = (char *)(lmdef) + sizeof(metric);
+         memcpy(lmdef->value.str, mdisk2_strings(mdisk) + (v >> 32), len);
+         lmdef->value.str[len] = '\0';
+         break;
+   }
+
+   *mdef = lmdef;
+   return 0;
+}
+
+static void xml_escape_write(FILE *fp, const char *str, size_t len)
+{
+   size_t i;
+
+   for (i = 0; i < len; i++) {
+      switch (str[i]) {
+         case '&':
+            fputs("&amp;", fp);
+            break;
+         case '<':
+            fputs("&lt;", fp);
+            break;
+         case '>':
+            fputs("&gt;", fp);
+            break;
+         case '\'':
+            fputs("&apos;", fp);
+            break;
+         case '"':
+            fputs("&quot;", fp);
+            break;
+         case '\t':
+         case '\n':
+         case '\r':
+            fputc(str[i], fp);
+            break;
+         default:
+            /* as vhostmd does, replace what XML does not allow */
+            fputc((unsigned char) str[i] < 0x20 ? '?' : str[i], fp);
+            break;
+      }
+   }
+}
+
+/*
+ * Write real d with as few digits as vhostmd uses for it, enough to
+ * read back the same float or double.
+ */
+static void real_write(FILE *fp, double d, int real32)
+{
+   char num[32];
+
+   snprintf(num, sizeof(num), "%.*g", real32 ? FLT_DIG : DBL_DIG, d);
+   if (real32 ? strtof(num, NULL) != (float) d : strtod(num, NULL) != d)
+      snprintf(num, sizeof(num), "%.*g", real32 ? 9 : 17, d);
+   fputs(num, fp);
+}
+
+/*
+ * Write the metrics of a binary disk as an XML document, in index
+ * order.
+ */
+static void mdisk2_dump(const metric_disk *mdisk, FILE *fp)
+{
+   const mdisk2_record *r = mdisk2_records(mdisk);
+   const char *strings = mdisk2_strings(mdisk);
+   uint32_t i, count = ntohl(mdisk2_header(mdisk)->count);
+   const char *str;
+   uint64_t v;
+   double d;
+
+   fputs("<metrics>\n", fp);
+   for (i = 0; i < count; i++, r++) {
+      fprintf(fp, "  <metric type='%s'", mdisk2_types[r->type]);
+      if (r->context == MDISK2_VM) {
+         fprintf(fp, " context='vm' id='%d' uuid='", (int32_t) ntohl(r->vm_id));
+         str = strings + ntohl(r->uuid);
+         xml_escape_write(fp, str, strlen(str));
+         fputc('\'', fp);
+      }
+      else
+         fputs(" context='host'", fp);
+      if (r->unit) {
+         str = strings + ntohl(r->unit);
+         fputs(" unit='", fp);
+         xml_escape_write(fp, str, strlen(str));
+         fputc('\'', fp);
+      }
+      if (r->flags & MDISK2_STALE)
+         fputs(" stale='true'", fp);
+
+      fputs(">\n    <name>", fp);
+      str = strings + ntohl(r->name);
+      xml_escape_write(fp, str, strlen(str));
+      fputs("</name>\n    <value>", fp);
+
+      v = be64toh(r->value);
+      switch (r->type) {
+         case M_INT32:
+         case M_INT64:
+            fprintf(fp, "%lld", (long long) (int64_t) v);
+            break;
+         case M_UINT32:
+         case M_UINT64:
+            fprintf(fp, "%llu", (unsigned long long) v);
+            break;
+         case M_REAL32:
+         case M_REAL64:
+            memcpy(&d, &v, sizeof(d));
+            real_write(fp, d, r->type == M_REAL32);
+            break;
+         case M_STRING:
+            xml_escape_write(fp, strings + (v >> 32), v & 0xffffffff);
+            break;
+      }
+      fputs("</value>\n  </metric>\n", fp);
+   }
+   fputs("</metrics>\n", fp);
+}
+
+static void json_escape_write(FILE *fp, const char *str, size_t len)
+{
+   size_t i;
+
+   for (i = 0; i < len; i++) {
+      switch (str[i]) {
+         case '"':
+         case '\\':
+            fputc('\\', fp);
+            fputc(str[i], fp);
+            break;
+         case '\n':
+            fputs("\\n", fp);
+            break;
+         case '\r':
+            fputs("\\r", fp);
+            break;
+         case '\t':
+            fputs("\\t", fp);
+            break;
+         default:
+            if ((unsigned char) str[i] < 0x20)
+               fprintf(fp, "\\u%04x", (unsigned char) str[i]);
+            else
+               fputc(str[i], fp);
+            break;
+      }
+   }
+}
+
+static void json_string_write(FILE *fp, const char *str, size_t len)
+{
+   fputc('"', fp);
+   json_escape_write(fp, str, len);
+   fputc('"', fp);
+}
+
+/*
+ * Write the start of the JSON object of a metric, up to its value,
+ * as vhostmd does.  unit and uuid are NULL if the metric has none.
+ */
+static void json_metric_begin(FILE *fp, int first, const char *name,
+                              const char *type, const char *context,
+                              const char *unit, const char *id,
+                              const char *uuid, int stale)
+{
+   if (!first)
+      fputs(",\n", fp);
+   fputs("{\"name\":", fp);
+   json_string_write(fp, name, strlen(name));
+   fputs(",\"type\":", fp);
+   json_string_write(fp, type, strlen(type));
+   fputs(",\"context\":", fp);
+   json_string_write(fp, context, strlen(context));
+   if (unit && *unit) {
+      fputs(",\"unit\":", fp);
+      json_string_write(fp, unit, strlen(unit));
+   }
+   if (id) {
+      fprintf(fp, ",\"id\":%d,\"uuid\":", atoi(id));
+      json_string_write(fp, uuid ? uuid : "", uuid ? strlen(uuid) : 0);
+   }
+   if (stale)
+      fputs(",\"stale\":true", fp);
+   fputs(",\"value\":", fp);
+}
+
+static void json_real_write(FILE *fp, double d, int real32)
+{
+   if (isfinite(d))
+      real_write(fp, d, real32);
+   else
+      fputs("null", fp);
+}
+
+/*
+ * Write the text of a value of type t as a JSON value.  Text that is
+ * not a number of a numeric type is written as null.
+ */
+static void json_value_write(FILE *fp, const char *type, const char *str)
+{
+   metric_type t;
+   char *end;
+   long long ll;
+   unsigned long long ull;
+   double d;
+
+   if (metric_type_from_str(type, &t) || t == M_STRING) {
+      json_string_write(fp, str, strlen(str));
+      return;
+   }
+
+   errno = 0;
+   switch (t) {
+      case M_INT32:
+      case M_INT64:
+         ll = strtoll(str, &end, 10);
+         if (end != str && errno == 0 && *end == '\0') {
+            fprintf(fp, "%lld", ll);
+            return;
+         }
+         break;
+      case M_UINT32:
+      case M_UINT64:
+         ull = strtoull(str, &end, 10);
+         if (end != str && errno == 0 && *end == '\0' && *str != '-') {
+            fprintf(fp, "%llu", ull);
+            return;
+         }
+         break;
+      default:
+         d = strtod(str, &end);
+         if (end != str && *end == '\0') {
+            json_real_write(fp, d, t == M_REAL32);
+            return;
+         }
+         break;
+   }
+   fputs("null", fp);
+}
+
+/*
+ * Write the metrics of a binary disk as a JSON document, in index
+ * order.
+ */
+static void mdisk2_dump_json(const metric_disk *mdisk, FILE *fp)
+{
+   const mdisk2_record *r = mdisk2_records(mdisk);
+   const char *strings = mdisk2_strings(mdisk);
+   uint32_t i, count = ntohl(mdisk2_header(mdisk)->count);
+   char id[16];
+   uint64_t v;
+   double d;
+
+   fputs("{\"metrics\":[\n", fp);
+   for (i = 0; i < count; i++, r++) {
+      snprintf(id, sizeof(id), "%d", (int32_t) ntohl(r->vm_id));
+      json_metric_begin(fp, i == 0, strings + ntohl(r->name),
+                        mdisk2_types[r->type],
+                        r->context == MDISK2_VM ? VM_CONTEXT : HOST_CONTEXT,
+                        strings + ntohl(r->unit),
+                        r->context == MDISK2_VM ? id : NULL,
+                        strings + ntohl(r->uuid),
+                        r->flags & MDISK2_STALE);
+
+      v = be64toh(r->value);
+      switch (r->type) {
+         case M_INT32:
+         case M_INT64:
+            fprintf(fp, "%lld", (long long) (int64_t) v);
+            break;
+         case M_UINT32:
+         case M_UINT64:
+            fprintf(fp, "%llu", (unsigned long long) v);
+            break;
+         case M_REAL32:
+         case M_REAL64:
+            memcpy(&d, &v, sizeof(d));
+            json_real_write(fp, d, r->type == M_REAL32);
+            break;
+         case M_STRING:
+            json_string_write(fp, strings + (v >> 32), v & 0xffffffff);
+            break;
+      }
+      fputc('}', fp);
+   }
+   fputs("\n]}\n", fp);
+}
+
+/*
+ * Write a metric element as a JSON object.  In version 2 of the XML
+ * schema, the context, id and uuid of VM metrics come from their vm
+ * element.
+ */
+static void xml_metric_dump_json(FILE *fp, xmlNodePtr node, xmlNodePtr vm,
+                                 int *first)
+{
+   xmlNodePtr child;
+   xmlChar *type, *context, *unit, *id, *uuid, *stale;
+   xmlChar *name = NULL, *value = NULL;
+
+   for (child = node->children; child; child = child->next) {
+      if (child->type != XML_ELEMENT_NODE)
+         continue;
+      if (name == NULL && xmlStrEqual(child->name, BAD_CAST "name"))
+         name = xmlNodeGetContent(child);
+      else if (value == NULL && xmlStrEqual(child->name, BAD_CAST "value"))
+         value = xmlNodeGetContent(child);
+   }
+   type = xmlGetProp(node, BAD_CAST "type");
+   context = xmlGetProp(node, BAD_CAST "context");
+   unit = xmlGetProp(node, BAD_CAST "unit");
+   id = xmlGetProp(node, BAD_CAST "id");
+   uuid = xmlGetProp(node, BAD_CAST "uuid");
+   stale = xmlGetProp(node, BAD_CAST "stale");
+
+   if (context == NULL)
+      context = xmlStrdup(BAD_CAST (vm ? VM_CONTEXT : HOST_CONTEXT));
+   if (vm && id == NULL)
+      id = xmlGetProp(vm, BAD_CAST "id");
+   if (vm && uuid == NULL)
+      uuid = xmlGetProp(vm, BAD_CAST "uuid");
+
+   if (name && value && type && context) {
+      json_metric_begin(fp, *first, (char *) name, (char *) type,
+                        (char *) context, (char *) unit, (char *) id,
+                        (char *) uuid,
+                        stale && xmlStrEqual(stale, BAD_CAST "true"));
+      json_value_write(fp, (char *) type, (char *) value);
+      fputc('}', fp);
+      *first = 0;
+   }
+
+   xmlFree(name);
+   xmlFree(value);
+   xmlFree(type);
+   xmlFree(context);
+   xmlFree(unit);
+   xmlFree(id);
+   xmlFree(uuid);
+   xmlFree(stale);
+}
+
+/*
+ * Write the metrics of an XML disk, in either version of the schema,
+ * as a JSON document, in document order.
+ */
+static void mdisk_dump_json(const metric_disk *mdisk, FILE *fp)
+{
+   xmlNodePtr root = xmlDocGetRootElement(mdisk->doc);
+   xmlNodePtr node, child;
+   int first = 1;
+
+   fputs("{\"metrics\":[\n", fp);
+   for (node = root ? root->children : NULL; node; node = node->next) {
+      if (node->type != XML_ELEMENT_NODE)
+         continue;
+      if (xmlStrEqual(node->name, BAD_CAST "metric")) {
+         xml_metric_dump_json(fp, node, NULL, &first);
+         continue;
+      }
+      if (!xmlStrEqual(node->name, BAD_CAST "vm"))
+         continue;
+      for (child = node->children; child; child = child->next) {
+         if (child->type == XML_ELEMENT_NODE &&
+             xmlStrEqual(child->name, BAD_CAST "metric"))
+            xml_metric_dump_json(fp, child, node, &first);
+      }
+   }
+   fputs("\n]}\n", fp);
+}
+
 /* Read from an O_DIRECT device.  You can't do arbitrary reads on
  * such devices.  You can only read block-aligned block-sized
  * chunks of data into block-aligned memory.
@@ -357,7 +932,7 @@ retry:
       if (asprintf(&path, "/dev/%s", entry->d_name) < 0)
           goto error;
 #else
-      path = strdup("/dev/shm/vhostmd0");
+      path = strdup(DEBUG_MDISK_PATH);
 #endif
       /* Open with O_DIRECT to avoid kernel keeping old copies around
        * in the cache.
@@ -373,7 +948,9 @@ retry:
          continue;
       }
 
-      if ((sig = ntohl(md_header.sig)) == MDISK_SIGNATURE) {
+      sig = ntohl(md_header.sig);
+      if (sig == MDISK_SIGNATURE || sig == MDISK_SIGNATURE_V2 ||
+          sig == MDISK_SIGNATURE_JSON || sig == MDISK_SIGNATURE_XML2) {
          busy = ntohl(md_header.busy);
          if (busy) {
 	     close(fd);
@@ -381,6 +958,7 @@ retry:
              sleep(1);
              goto retry;
          }
+         mdisk->sig = sig;
          mdisk->sum = ntohl(md_header.sum);
          mdisk->length = ntohl(md_header.length);
          mdisk->buffer = malloc(mdisk->length);
@@ -412,6 +990,22 @@ retry:
    if (mdisk->buffer == NULL)
       goto error;
 
+   /* the binary format is used in place, without parsing */
+   if (mdisk->sig == MDISK_SIGNATURE_V2) {
+      if (mdisk2_check(mdisk)) {
+         libmsg("%s(): Invalid binary metrics disk\n", __func__);
+         goto error;
+      }
+      closedir(dir);
+      return 0;
+   }
+
+   /* a JSON disk is only dumped, as it is */
+   if (mdisk->sig == MDISK_SIGNATURE_JSON) {
+      closedir(dir);
+      return 0;
+   }
+
    /* Set up a parser context */
    mdisk->pctxt = xmlNewParserCtxt();
    if (!mdisk->pctxt || !mdisk->pctxt->sax) {
@@ -460,7 +1054,10 @@ static uint32_t read_mdisk_sum(metric_disk *mdisk)
    }
    close (fd);
 
-   if (ntohl(md_header.sig) == MDISK_SIGNATURE) {
+   if (ntohl(md_header.sig) == MDISK_SIGNATURE ||
+       ntohl(md_header.sig) == MDISK_SIGNATURE_V2 ||
+       ntohl(md_header.sig) == MDISK_SIGNATURE_JSON ||
+       ntohl(md_header.sig) == MDISK_SIGNATURE_XML2) {
       if (ntohl(md_header.busy)) {
          return 0;
       }
@@ -597,9 +1194,9 @@ int get_metric(const char *metric_name, metric **mdef, metric_context context)
    /* lock library data */
    pthread_mutex_lock(&libmetrics_mutex);
 
-   /* refresh library data if sum changed */
+   /* refresh library data if sum changed or nothing was read yet */
    sum = read_mdisk_sum(mdisk);
-   if (sum != mdisk->sum) {
+   if (sum != mdisk->sum || mdisk->buffer == NULL) {
        mdisk_free();
        if (mdisk_alloc() == NULL) {
            errno = ENOMEM;
@@ -608,6 +1205,19 @@ int get_metric(const char *metric_name, metric **mdef, metric_context context)
        read_mdisk(mdisk);
    }
 
+   if (mdisk->sig == MDISK_SIGNATURE_V2) {
+      if (mdisk->buffer)
+         ret = mdisk2_get_metric(mdisk, metric_name, context, mdef);
+      goto out;
+   }
+
+   if (mdisk->sig == MDISK_SIGNATURE_JSON) {
+      libmsg("%s(): Metrics disk in JSON format, use dump_metrics()\n",
+             __func__);
+      errno = ENOTSUP;
+      goto out;
+   }
+
    pmdef.name = strdup(metric_name);
    pmdef.context = context_to_str(context);
    pmdef.uuid = mdisk->uuid;
@@ -673,10 +1283,16 @@ void __attribute__ ((destructor)) libmetrics_fini(void){
    xmlCleanupParser();
 }
 
-int dump_metrics(const char *dest_file)
+/*
+ * Dump the metrics disk as XML, or as JSON if json is set.  A disk in
+ * JSON format is dumped as it is.
+ */
+static int dump_mdisk(const char *dest_file, int json)
 {
     FILE *fp;
 
+    /* drop what an earlier get_metric() or dump has read */
+    mdisk_content_free();
     if (mdisk == NULL || read_mdisk(mdisk) < 0) {
         errno = ENOMEDIUM;
         return -1;
@@ -693,7 +1309,14 @@ int dump_metrics(const char *dest_file)
         fp = stdout;
     }
 
-    if (fwrite(mdisk->buffer, 1, mdisk->length, fp) != mdisk->length) {
+    if (mdisk->sig == MDISK_SIGNATURE_V2 && json)
+        mdisk2_dump_json(mdisk, fp);
+    else if (mdisk->sig == MDISK_SIGNATURE_V2)
+        mdisk2_dump(mdisk, fp);
+    else if ((mdisk->sig == MDISK_SIGNATURE ||
+              mdisk->sig == MDISK_SIGNATURE_XML2) && json)
+        mdisk_dump_json(mdisk, fp);
+    else if (fwrite(mdisk->buffer, 1, mdisk->length, fp) != mdisk->length) {
         libmsg("Error, unable to export metrics to file:%s - error:%s\n",
                 dest_file ? dest_file : "stdout", strerror(errno));
     }
@@ -703,6 +1326,16 @@ int dump_metrics(const char *dest_file)
     return 0;
 }
 
+int dump_metrics(const char *dest_file)
+{
+    return dump_mdisk(dest_file, 0);
+}
+
+int dump_metrics_json(const char *dest_file)
+{
+    return dump_mdisk(dest_file, 1);
+}
+
 #ifdef WITH_XENSTORE
 /*
  * dump metrics received from xenstore to the dest file 
@@ -754,6 +1387,13 @@ int dump_xenstore_metrics(const char *dest_file)
         goto out;
     }
 
+    /* metrics in JSON format are dumped as they are */
+    if (metrics[strspn(metrics, " \t\r\n")] == '{') {
+        if (fputs(metrics, fp) != EOF)
+            ret = 0;
+        goto out;
+    }
+
     pctxt = xmlNewParserCtxt();
     if (!pctxt || !pctxt->sax) {
       libmsg("%s(): failed to create parser \n", __func__);
@@ -788,9 +1428,9 @@ out:
 /*
  * dump metrics from virtio serial port to buffer
  */
-static char *get_virtio_metrics(void)
+static char *get_virtio_metrics(const char *request)
 {
-    const char request[] = "GET /metrics/XML\n\n", end_token[] = "\n\n";
+    const char end_token[] = "\n\n";
     const char dev[] = "/dev/virtio-ports/org.github.vhostmd.1";
 
     char *response = NULL;
@@ -884,19 +1524,26 @@ static char *get_virtio_metrics(void)
 }
 
 /*
- * dump metrics from virtio serial port to xml formatted file
+ * dump the response to request from virtio serial port to file
  */
-int dump_virtio_metrics(const char *dest_file)
+static int dump_virtio_request(const char *dest_file, const char *request)
 {
     FILE *fp = stdout;
     char *response = NULL;
     size_t len;
     int ret = -1;
 
-    response = get_virtio_metrics();
+    response = get_virtio_metrics(request);
     if (response == NULL)
         return -1;
 
+    /* vhostmd does not serve the format requested */
+    if (strncmp(response, "INVALID REQUEST", 15) == 0) {
+        free(response);
+        errno = ENOTSUP;
+        return -1;
+    }
+
     len = strlen(response);
 
     if (dest_file) {
@@ -925,3 +1572,24 @@ out:
 
     return ret;
 }
+
+/*
+ * dump metrics from virtio serial port to xml formatted file, in
+ * version 2 of the schema if vhostmd only serves that
+ */
+int dump_virtio_metrics(const char *dest_file)
+{
+    if (dump_virtio_request(dest_file, "GET /metrics/XML\n\n") == 0)
+        return 0;
+    if (errno != ENOTSUP)
+        return -1;
+    return dump_virtio_request(dest_file, "GET /metrics/XML2\n\n");
+}
+
+/*
+ * dump metrics from virtio serial port to json formatted file
+ */
+int dump_virtio_metrics_json(const char *dest_file)
+{
+    return dump_virtio_request(dest_file, "GET /metrics/JSON\n\n");
+}
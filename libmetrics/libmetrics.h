@@ -97,9 +97,15 @@ int get_metric(const char *name, metric **rec, metric_context context);
 /* dump metrics to xml formatted file */
 int dump_metrics(const char *dest_file);
 
+/* dump metrics to json formatted file */
+int dump_metrics_json(const char *dest_file);
+
 /* dump metrics from xenstore to xml formatted file */
 int dump_xenstore_metrics(const char *dest_file);
 
 /* dump metrics from virtio serial port to xml formatted file */
 int dump_virtio_metrics(const char *dest_file);
+
+/* dump metrics from virtio serial port to json formatted file */
+int dump_virtio_metrics_json(const char *dest_file);
 #endif
@@ -8,6 +8,7 @@
 #                    Page Fault Rate
 #
 use strict;
+use Time::HiRes qw(time sleep);
 
 my %vmstat;               # holds current copy of vmstat
 my $pgpgin1 = 0;
@@ -26,6 +27,33 @@ sub getvmstat
     }
 }
 
+# With --loop, run as a vhostmd co-process: print the rates since the
+# previous request for every request line read from stdin
+if (@ARGV && $ARGV[0] eq '--loop') {
+    my ($t1, $t2);
+
+    $| = 1;
+    getvmstat();
+    $pgpgin1 = $vmstat{'pgpgin'};
+    $pgpgout1 = $vmstat{'pgpgout'};
+    $t1 = time();
+    sleep(1);
+
+    while (<STDIN>) {
+        getvmstat();
+        $pgpgin2 = $vmstat{'pgpgin'};
+        $pgpgout2 = $vmstat{'pgpgout'};
+        $t2 = time();
+        $t2 = $t1 + 1 if ($t2 <= $t1);
+
+        printf("%f,%f\n", ($pgpgin2 - $pgpgin1) / ($t2 - $t1),
+               ($pgpgout2 - $pgpgout1) / ($t2 - $t1));
+
+        ($pgpgin1, $pgpgout1, $t1) = ($pgpgin2, $pgpgout2, $t2);
+    }
+    exit(0);
+}
+
 getvmstat();
 $pgpgin1 = $vmstat{'pgpgin'};
 $pgpgout1 = $vmstat{'pgpgout'};
@@ -0,0 +1,122 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+/*
+ * Actions compiled into templates: the placeholders of an action are
+ * replaced for each VM, and the action is run directly or, if it has
+ * shell syntax, with /bin/sh -c.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+#include "metric.h"
+#include "test.h"
+
+const char *libvirt_uri = NULL;
+
+/* Run action for vm, NULL for a host metric; 1 if it prints expect */
+static int prints(const char *action, vu_vm *vm, const char *expect)
+{
+   metric_var var = { .name = "Action", .type_str = "string",
+                      .type = M_STRING };
+   metric_info info = { .name = "Action", .vars = &var };
+   metric m = {
+      .type = M_STRING,
+      .ctx = vm ? METRIC_CONTEXT_VM : METRIC_CONTEXT_HOST,
+      .cnt = 1,
+      .vm = vm,
+      .info = &info,
+   };
+   size_t len;
+   int ret = 0;
+
+   info.action = (char *) action;
+   if (metric_action_prepare(&m) == 0 && metric_value_get(&m) == 0) {
+      len = strlen(m.value);
+      if (len && m.value[len - 1] == '\n')
+         m.value[--len] = '\0';
+      ret = strcmp(m.value, expect) == 0;
+   }
+   if (!ret)
+      fprintf(stderr, "'%s': got '%s', want '%s'\n", action,
+              m.value ? m.value : "", expect);
+
+   metric_action_free(&m);
+   free(m.value);
+   free(m.slots);
+   metric_results_expire();
+
+   return ret;
+}
+
+int main(void)
+{
+   vu_vm vm = {
+      .id = 3,
+      .name = "guest",
+      .uuid = "6695eb01-f6a4-8304-79aa-97f2502e193f",
+   };
+   vu_vm spaced = { .id = 12, .name = "a  b", .uuid = "" };
+   char action[512], expect[512];
+   int i;
+
+   vu_log_init(1, 0);
+
+   /* run directly */
+   test_check(prints("echo NAME VMID UUID", &vm,
+                     "guest 3 6695eb01-f6a4-8304-79aa-97f2502e193f"));
+   test_check(prints("echo vm-NAME-VMID.", &vm, "vm-guest-3."));
+   test_check(prints("printf %s NAME", &spaced, "a  b"));
+   test_check(prints("  echo \tplain\n", &vm, "plain"));
+
+   /* with /bin/sh -c */
+   test_check(prints("echo 'NAME' | tr a-z A-Z", &vm, "GUEST"));
+   test_check(prints("printf '%s' \"NAME\"", &spaced, "a  b"));
+
+   /* host metrics have no VM placeholders */
+   test_check(prints("echo NAME VMID UUID", NULL, "NAME VMID UUID"));
+
+   /* CONNECT is the libvirt URI option, if there is a URI */
+   test_check(prints("echo CONNECT NAME", NULL, "NAME"));
+   test_check(prints("echo x-CONNECT", NULL, "x-"));
+   libvirt_uri = "test:///default";
+   test_check(prints("echo CONNECT NAME", NULL,
+                     "--connect test:///default NAME"));
+   test_check(prints("echo x-CONNECT", NULL, "x---connect test:///default"));
+   test_check(prints("echo CONNECT | tr -d -", NULL,
+                     "connect test:///default"));
+   test_check(prints("echo UUID CONNECT", &vm,
+                     "6695eb01-f6a4-8304-79aa-97f2502e193f --connect "
+                     "test:///default"));
+
+   /* placeholders next to each other */
+   strcpy(action, "echo ");
+   expect[0] = '\0';
+   for (i = 0; i < 50; i++) {
+      strcat(action, i % 2 ? "NAME" : "VMID");
+      strcat(expect, i % 2 ? "guest" : "3");
+   }
+   test_check(prints(action, &vm, expect));
+
+   metric_results_free();
+
+   return test_result("action");
+}
@@ -0,0 +1,132 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+/*
+ * Rates of counter metrics: vhostmd reports the increase of a counter
+ * per second since its last sample, across wraps and resets.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+
+#include "util.h"
+#include "metric.h"
+#include "test.h"
+
+/* samples are taken at least this far apart, and at most MAX_SECS */
+#define SAMPLE_NSECS 50000000L
+#define MIN_SECS     0.05
+#define MAX_SECS     10.0
+
+const char *libvirt_uri = NULL;
+
+static char output[128];
+
+static int counter_collect(void *arg)
+{
+   return metric_value_printf((metric *) arg, "%s", output);
+}
+
+static int sample(metric *m, const char *value)
+{
+   struct timespec t = { 0, SAMPLE_NSECS };
+
+   nanosleep(&t, NULL);
+   snprintf(output, sizeof(output), "%s", value);
+   return metric_value_get(m);
+}
+
+/* The rate of variable var is that of an increase by delta */
+static int rate_is(metric *m, int var, double delta)
+{
+   double v;
+
+   if (metric_value_real(m, var, &v))
+      return 0;
+   /* integer rates are rounded */
+   return v >= delta / MAX_SECS - 0.5 && v <= delta / MIN_SECS + 0.5;
+}
+
+int main(void)
+{
+   metric_var vars[2] = {
+      { .name = "PageInRate", .type_str = "uint64", .type = M_UINT64 },
+      { .name = "CpuRate", .type_str = "real64", .type = M_REAL64 },
+   };
+   metric_info info = { .name = "PageInRate,CpuRate", .vars = vars };
+   metric m = {
+      .type = M_GROUP,
+      .ctx = METRIC_CONTEXT_HOST,
+      .kind = METRIC_KIND_COUNTER,
+      .cnt = 2,
+      .pf = counter_collect,
+      .info = &info,
+   };
+   char buf[128];
+   double v;
+
+   vu_log_init(1, 0);
+
+   /* the first sample only starts the counter */
+   test_check(sample(&m, "100,0") == METRIC_NO_RATE);
+   test_check(metric_value_real(&m, 0, &v) != 0);
+
+   test_check(sample(&m, "1100,1000\n") == 0);
+   test_check(rate_is(&m, 0, 1000));
+   test_check(rate_is(&m, 1, 1000));
+
+   /* no increase */
+   test_check(sample(&m, "1100,1000") == 0);
+   test_check(rate_is(&m, 0, 0));
+
+   /* a 32 bit counter wraps from the upper half of its range */
+   snprintf(buf, sizeof(buf), "%lu,0", (unsigned long) UINT32_MAX - 499);
+   test_check(sample(&m, buf) == 0);
+   test_check(sample(&m, "500,0") == 0);
+   test_check(rate_is(&m, 0, 1000));
+
+   /* and so does a 64 bit counter, whose rate up to here is too large */
+   snprintf(buf, sizeof(buf), "%llu,0", ULLONG_MAX - 499);
+   test_check(sample(&m, buf) == 0);
+   test_check(sample(&m, "500,0") == 0);
+   test_check(rate_is(&m, 0, 1000));
+
+   /* a counter going down from the lower half was reset to zero */
+   test_check(sample(&m, "2000000,0") == 0);
+   test_check(sample(&m, "1000,0") == 0);
+   test_check(rate_is(&m, 0, 1000));
+
+   /* counters are non-negative integers */
+   test_check(sample(&m, "-1,0") != 0);
+   test_check(sample(&m, "x,0") != 0);
+   test_check(sample(&m, "1000") != 0);
+
+   /* and an invalid sample does not replace the last one */
+   test_check(sample(&m, "2000,0") == 0);
+   test_check(rate_is(&m, 0, 1000));
+
+   free(m.value);
+   free(m.slots);
+   free(m.samples);
+
+   return test_result("counter");
+}
@@ -0,0 +1,221 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+/*
+ * Reading back a metrics disk that vhostmd writes with the metrics of
+ * disk.xml, see disk.sh.  libmetrics is built to read the disk from
+ * DEBUG_MDISK_PATH instead of looking for it among the block devices.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <libxml/parser.h>
+
+#include "libmetrics.h"
+#include "test.h"
+
+/* seconds to wait for vhostmd to write the disk */
+#define DISK_WAIT 30
+
+static char *read_file(const char *path)
+{
+   FILE *fp;
+   char *buf;
+   long len;
+
+   if ((fp = fopen(path, "r")) == NULL)
+      return NULL;
+   if (fseek(fp, 0, SEEK_END) || (len = ftell(fp)) < 0 ||
+       fseek(fp, 0, SEEK_SET) || (buf = malloc((size_t) len + 1)) == NULL) {
+      fclose(fp);
+      return NULL;
+   }
+   buf[fread(buf, 1, (size_t) len, fp)] = '\0';
+   fclose(fp);
+
+   return buf;
+}
+
+static metric *get(const char *name, metric_context ctx, metric_type t)
+{
+   metric *m;
+
+   if (get_metric(name, &m, ctx)) {
+      fprintf(stderr, "no metric %s\n", name);
+      return NULL;
+   }
+   if (m->type != t) {
+      fprintf(stderr, "metric %s has type %d, want %d\n", name, m->type, t);
+      metric_free(m);
+      return NULL;
+   }
+   return m;
+}
+
+static void check_values(const char *str)
+{
+   metric *m;
+
+   if ((m = get("HostU", METRIC_CONTEXT_HOST, M_UINT64))) {
+      test_check(m->value.ui64 == UINT64_MAX);
+      metric_free(m);
+   }
+   if ((m = get("HostI", METRIC_CONTEXT_HOST, M_INT32))) {
+      test_check(m->value.i32 == -5);
+      metric_free(m);
+   }
+   if ((m = get("HostL", METRIC_CONTEXT_HOST, M_INT64))) {
+      test_check(m->value.i64 == INT64_MIN);
+      metric_free(m);
+   }
+   if ((m = get("HostR", METRIC_CONTEXT_HOST, M_REAL64))) {
+      test_check(m->value.r64 == 846.6);
+      metric_free(m);
+   }
+   if ((m = get("HostF", METRIC_CONTEXT_HOST, M_REAL32))) {
+      test_check(m->value.r32 == 0.1f);
+      metric_free(m);
+   }
+   if ((m = get("HostS", METRIC_CONTEXT_HOST, M_STRING))) {
+      test_check(strcmp(m->value.str, str) == 0);
+      metric_free(m);
+   }
+   if ((m = get("GroupA", METRIC_CONTEXT_HOST, M_UINT32))) {
+      test_check(m->value.ui32 == 3);
+      metric_free(m);
+   }
+   if ((m = get("GroupB", METRIC_CONTEXT_HOST, M_REAL64))) {
+      test_check(m->value.r64 == 2.5);
+      metric_free(m);
+   }
+
+   /* the test driver of libvirt has a single VM */
+   if ((m = get("VmConst", METRIC_CONTEXT_VM, M_UINT32))) {
+      test_check(m->value.ui32 == 7);
+      metric_free(m);
+   }
+   if ((m = get("VmName", METRIC_CONTEXT_VM, M_STRING))) {
+      test_check(m->value.str[0] != '\0');
+      metric_free(m);
+   }
+
+   test_check(get_metric("HostU", &m, METRIC_CONTEXT_VM) != 0);
+   test_check(get_metric("NoSuchMetric", &m, METRIC_CONTEXT_HOST) != 0);
+}
+
+static int contains(const char *doc, const char *str)
+{
+   if (doc && strstr(doc, str))
+      return 1;
+   fprintf(stderr, "missing '%s'\n", str);
+   return 0;
+}
+
+/* The JSON dump of any disk has the same values */
+static void check_json(const char *doc, const char *str)
+{
+   char want[256];
+
+   test_check(contains(doc, "{\"name\":\"HostU\",\"type\":\"uint64\","
+                            "\"context\":\"host\","
+                            "\"value\":18446744073709551615}"));
+   test_check(contains(doc, "{\"name\":\"HostI\",\"type\":\"int32\","
+                            "\"context\":\"host\",\"value\":-5}"));
+   test_check(contains(doc, "{\"name\":\"HostL\",\"type\":\"int64\","
+                            "\"context\":\"host\","
+                            "\"value\":-9223372036854775808}"));
+   test_check(contains(doc, "{\"name\":\"HostR\",\"type\":\"real64\","
+                            "\"context\":\"host\",\"unit\":\"s\","
+                            "\"value\":846.6}"));
+   test_check(contains(doc, "{\"name\":\"HostF\",\"type\":\"real32\","
+                            "\"context\":\"host\",\"value\":0.1}"));
+   snprintf(want, sizeof(want), "{\"name\":\"HostS\",\"type\":\"string\","
+            "\"context\":\"host\",\"value\":\"%s\"}", str);
+   test_check(contains(doc, want));
+   test_check(contains(doc, "{\"name\":\"GroupA\",\"type\":\"uint32\","
+                            "\"context\":\"host\",\"value\":3}"));
+   test_check(contains(doc, "{\"name\":\"VmConst\",\"type\":\"uint32\","
+                            "\"context\":\"vm\",\"id\":"));
+   test_check(contains(doc, "\"value\":7}"));
+   test_check(contains(doc, "{\"metrics\":["));
+}
+
+int main(int argc, char *argv[])
+{
+   char out[] = "/tmp/test_disk.XXXXXX";
+   const char *format;
+   xmlDocPtr xml;
+   metric *m;
+   char *doc;
+   int fd, i;
+
+   if (argc != 2) {
+      fprintf(stderr, "Usage: %s xml|xml2|binary|json\n", argv[0]);
+      return 2;
+   }
+   format = argv[1];
+
+   if ((fd = mkstemp(out)) < 0)
+      return 2;
+   close(fd);
+
+   /* wait for the first update */
+   for (i = 0; i < DISK_WAIT; i++) {
+      errno = 0;
+      if (get_metric("HostU", &m, METRIC_CONTEXT_HOST) == 0) {
+         metric_free(m);
+         break;
+      }
+      if (errno == ENOTSUP)
+         break;
+      sleep(1);
+   }
+   test_check(i < DISK_WAIT);
+
+   if (strcmp(format, "json") == 0) {
+      /* libmetrics only dumps JSON disks */
+      errno = 0;
+      test_check(get_metric("HostU", &m, METRIC_CONTEXT_HOST) != 0);
+      test_check(errno == ENOTSUP);
+   }
+   else {
+      /* XML does not allow control characters, the binary disk does */
+      check_values(strcmp(format, "binary") == 0 ? "a<b&\"c'd\001e\tf" :
+                   "a<b&\"c'd?e\tf");
+
+      test_check(dump_metrics(out) == 0);
+      xml = xmlParseFile(out);
+      test_check(xml != NULL);
+      xmlFreeDoc(xml);
+   }
+
+   /* escaped for JSON, an XML disk has the control character replaced */
+   test_check(dump_metrics_json(out) == 0);
+   doc = read_file(out);
+   check_json(doc, strcmp(format, "xml") && strcmp(format, "xml2") ?
+              "a<b&\\\"c'd\\u0001e\\tf" : "a<b&\\\"c'd?e\\tf");
+   free(doc);
+
+   unlink(out);
+
+   return test_result(format);
+}
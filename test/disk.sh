@@ -0,0 +1,41 @@
+#!/bin/sh
+#
+# Round trip of the metrics disk formats: vhostmd writes the metrics of
+# disk.xml to a disk in each format, and test_disk reads them back
+# through libmetrics while vhostmd keeps updating the disk.
+#
+# Usage: disk.sh <vhostmd> <disk path> <format>...
+#
+# vhostmd reads the VMs of the libvirt test driver.  srcdir and
+# abs_top_srcdir locate disk.xml and vhostmd.dtd, CHECKER is run with
+# test_disk.
+
+vhostmd=$1
+disk=$2
+shift 2
+
+ret=0
+for format in "$@"; do
+   conf=disk-$format.conf
+   sed -e "s|@FORMAT@|$format|" -e "s|@DISK@|$disk|" \
+       -e "s|@DTD@|$abs_top_srcdir/vhostmd.dtd|" \
+       "$srcdir/disk.xml" > $conf || exit 1
+
+   rm -f $disk
+   $vhostmd -d -c test:///default -f $conf -p disk-$format.pid \
+       > disk-$format.log 2>&1 &
+   daemon=$!
+
+   if $CHECKER ./test_disk $format; then
+      rm -f disk-$format.log
+   else
+      echo "vhostmd log in disk-$format.log"
+      ret=1
+   fi
+
+   kill $daemon
+   wait $daemon
+   rm -f $conf disk-$format.pid $disk
+done
+
+exit $ret
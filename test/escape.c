@@ -0,0 +1,176 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+/*
+ * Escaping of names, units and values, so that any output of an action
+ * leaves the metrics document well formed.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libxml/parser.h>
+
+#include "util.h"
+#include "metric.h"
+#include "test.h"
+
+const char *libvirt_uri = NULL;
+
+static const char *output;
+
+static int value_collect(void *arg)
+{
+   return metric_value_printf((metric *) arg, "%s", output);
+}
+
+static int buffer_is(const vu_buffer *buf, const char *expect)
+{
+   if (buf->use == strlen(expect) && memcmp(buf->content, expect, buf->use) == 0)
+      return 1;
+   fprintf(stderr, "got '%.*s', want '%s'\n", (int) buf->use, buf->content,
+           expect);
+   return 0;
+}
+
+static int xml_escaped(const char *str, int len, const char *expect)
+{
+   vu_buffer *buf;
+   int ret;
+
+   if (vu_buffer_create(&buf, 16))
+      return 0;
+   vu_buffer_add_escaped(buf, str, len);
+   ret = buffer_is(buf, expect);
+   vu_buffer_delete(buf);
+
+   return ret;
+}
+
+static int json_escaped(const char *str, int len, const char *expect)
+{
+   vu_buffer *buf;
+   int ret;
+
+   if (vu_buffer_create(&buf, 16))
+      return 0;
+   vu_buffer_add_json(buf, str, len);
+   ret = buffer_is(buf, expect);
+   vu_buffer_delete(buf);
+
+   return ret;
+}
+
+/* The output of metric m in format f for value, 0 if there is one */
+static int metric_output(metric *m, metric_format f, const char *value,
+                         vu_buffer *buf)
+{
+   const metric_serializer *s = metric_serializer_get(f);
+
+   output = value;
+   if (metric_value_get(m) || s->prepare(m))
+      return -1;
+   vu_buffer_erase(buf);
+   return s->format(m, buf);
+}
+
+int main(void)
+{
+   metric_var var = {
+      .name = "Esc<&>\"'",
+      .type_str = "string",
+      .type = M_STRING,
+      .unit = "'KiB'",
+   };
+   metric_info info = { .name = "Esc<&>\"'", .vars = &var };
+   metric m = {
+      .type = M_STRING,
+      .ctx = METRIC_CONTEXT_HOST,
+      .cnt = 1,
+      .pf = value_collect,
+      .info = &info,
+   };
+   vu_buffer *buf, *doc;
+   xmlDocPtr xml;
+   int i;
+
+   vu_log_init(1, 0);
+
+   test_check(xml_escaped("plain text", -1, "plain text"));
+   test_check(xml_escaped("a<b&c>d'e\"f", -1,
+                          "a&lt;b&amp;c&gt;d&apos;e&quot;f"));
+   test_check(xml_escaped("&&", -1, "&amp;&amp;"));
+   test_check(xml_escaped("a&b", 2, "a&amp;"));
+   test_check(xml_escaped("", -1, ""));
+
+   /* white space is kept, other control characters are not allowed */
+   test_check(xml_escaped("a\tb\nc\rd", -1, "a\tb\nc\rd"));
+   test_check(xml_escaped("a\001b\033c", -1, "a?b?c"));
+
+   /* many replacements grow the buffer */
+   test_check(vu_buffer_create(&buf, 16) == 0);
+   for (i = 0; i < 10000; i++)
+      vu_buffer_add_escaped(buf, "<", 1);
+   test_check(buf->use == 40000);
+   test_check(strncmp(buf->content + 39996, "&lt;", 4) == 0);
+
+   /* names, units and values are escaped in a well formed document */
+   test_check(metric_output(&m, METRIC_FORMAT_XML,
+                            "x</value><y>&\001", buf) == 0);
+   test_check(strstr(buf->content,
+                     "<name>Esc&lt;&amp;&gt;&quot;&apos;</name>") != NULL);
+   test_check(strstr(buf->content, "unit='&apos;KiB&apos;'") != NULL);
+   test_check(strstr(buf->content,
+                     "<value>x&lt;/value&gt;&lt;y&gt;&amp;?</value>") != NULL);
+
+   test_check(vu_buffer_create(&doc, 256) == 0);
+   vu_buffer_add(doc, "<metrics>\n", -1);
+   vu_buffer_add(doc, buf->content, (int) buf->use);
+   vu_buffer_add(doc, "</metrics>\n", -1);
+   xml = xmlParseMemory(doc->content, (int) doc->use);
+   test_check(xml != NULL);
+   xmlFreeDoc(xml);
+   vu_buffer_delete(doc);
+
+   /* JSON strings escape quotes, backslashes and control characters */
+   test_check(json_escaped("plain <text> & 'more'", -1,
+                           "plain <text> & 'more'"));
+   test_check(json_escaped("a\"b\\c", -1, "a\\\"b\\\\c"));
+   test_check(json_escaped("a\tb\nc\rd", -1, "a\\tb\\nc\\rd"));
+   test_check(json_escaped("a\001b\037c\177", -1,
+                           "a\\u0001b\\u001fc\177"));
+   test_check(json_escaped("\"\"", 1, "\\\""));
+   test_check(json_escaped("caf\303\251", -1, "caf\303\251"));
+
+   test_check(metric_output(&m, METRIC_FORMAT_JSON,
+                            "x\"},{\\\001", buf) == 0);
+   test_check(strstr(buf->content,
+                     "{\"name\":\"Esc<&>\\\"'\",\"type\":\"string\","
+                     "\"context\":\"host\",\"unit\":\"'KiB'\","
+                     "\"value\":\"x\\\"},{\\\\\\u0001\"}") != NULL);
+
+   vu_buffer_delete(buf);
+   free(var.xml);
+   free(var.json);
+   free(var.xml2);
+   free(m.value);
+   free(m.slots);
+   xmlCleanupParser();
+
+   return test_result("escape");
+}
@@ -0,0 +1,196 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+/*
+ * Expressions of derived metrics: compiling, resolving metric names and
+ * evaluating, with delta() keeping state between evaluations.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+#include "derived.h"
+#include "test.h"
+
+/* The metrics known to the expressions, sum() only of vm metrics */
+static struct {
+   const char *name;
+   int vm;
+   double value;
+   int valid;
+} metrics[] = {
+   { "UsedMem", 0, 25, 1 },
+   { "FreeMem", 0, 75, 1 },
+   { "Page.Rate", 0, 4, 1 },
+   { "Free Mem", 0, 10, 1 },
+   { "CpuTime", 1, 30, 1 },
+   { "Missing", 0, 0, 0 },
+};
+
+#define METRICS_CNT ((int) (sizeof(metrics) / sizeof(metrics[0])))
+
+/* sum() of a vm metric resolves to its index plus SUM_REF */
+#define SUM_REF 100
+
+static int resolve(const char *name, int sum, void *opaque)
+{
+   int i;
+
+   (void) opaque;
+   for (i = 0; i < METRICS_CNT; i++) {
+      if (strcmp(metrics[i].name, name) == 0 && metrics[i].vm == sum)
+         return sum ? i + SUM_REF : i;
+   }
+   return -1;
+}
+
+static int lookup(int ref, void *opaque, double *val)
+{
+   int sum = ref >= SUM_REF;
+   int i = sum ? ref - SUM_REF : ref;
+
+   (void) opaque;
+   if (i < 0 || i >= METRICS_CNT || !metrics[i].valid)
+      return -1;
+   /* the sum of a vm metric over two VMs */
+   *val = sum ? 2 * metrics[i].value : metrics[i].value;
+   return 0;
+}
+
+/* Compile and evaluate src once, 0 if its value is expect */
+static int value_is(const char *src, double expect)
+{
+   derived_expr *e;
+   double *state;
+   double v = 0;
+   int ret = 0;
+
+   if ((e = derived_compile(src, resolve, NULL)) == NULL) {
+      fprintf(stderr, "'%s' does not compile\n", src);
+      return 0;
+   }
+   if ((state = derived_state_new(e)) != NULL) {
+      ret = derived_eval(e, lookup, NULL, state, &v) == 0 && v == expect;
+      if (!ret)
+         fprintf(stderr, "'%s' is %g, want %g\n", src, v, expect);
+   }
+   free(state);
+   derived_free(e);
+
+   return ret;
+}
+
+static int compiles(const char *src)
+{
+   derived_expr *e = derived_compile(src, resolve, NULL);
+
+   derived_free(e);
+   return e != NULL;
+}
+
+static int has_value(const char *src)
+{
+   derived_expr *e;
+   double *state;
+   double v;
+   int ret = 0;
+
+   if ((e = derived_compile(src, resolve, NULL)) == NULL)
+      return 0;
+   if ((state = derived_state_new(e)) != NULL)
+      ret = derived_eval(e, lookup, NULL, state, &v) == 0;
+   free(state);
+   derived_free(e);
+
+   return ret;
+}
+
+int main(void)
+{
+   derived_expr *e;
+   double *state, *state2;
+   double v;
+
+   vu_log_init(1, 0);
+
+   /* numbers, precedence and associativity */
+   test_check(value_is("42", 42));
+   test_check(value_is(" .5 + 1e2 ", 100.5));
+   test_check(value_is("1 + 2 * 3", 7));
+   test_check(value_is("(1 + 2) * 3", 9));
+   test_check(value_is("10 - 4 - 3", 3));
+   test_check(value_is("8 / 4 / 2", 1));
+   test_check(value_is("-2 * -3", 6));
+   test_check(value_is("--2", 2));
+   test_check(value_is("1 - (2 - (3 - (4 - 5)))", 3));
+   test_check(value_is("((((((((7))))))))", 7));
+
+   /* metrics by name, quoted and summed over VMs */
+   test_check(value_is("100 * UsedMem / (UsedMem + FreeMem)", 25));
+   test_check(value_is("Page.Rate*2", 8));
+   test_check(value_is("'Free Mem' + 1", 11));
+   test_check(value_is("sum(CpuTime) / 2", 30));
+   test_check(value_is("sum( 'CpuTime' )", 60));
+
+   /* unknown metrics and syntax errors */
+   test_check(!compiles(""));
+   test_check(!compiles("NoSuchMetric"));
+   test_check(!compiles("CpuTime"));
+   test_check(!compiles("sum(UsedMem)"));
+   test_check(!compiles("sum(1)"));
+   test_check(!compiles("1 +"));
+   test_check(!compiles("(1 + 2"));
+   test_check(!compiles("1 2"));
+   test_check(!compiles("1 % 2"));
+   test_check(!compiles("max(UsedMem)"));
+   test_check(!compiles("'Free Mem"));
+   test_check(!compiles("''"));
+
+   /* no value without all inputs, or when it is not finite */
+   test_check(!has_value("UsedMem + Missing"));
+   test_check(!has_value("1 / 0"));
+   test_check(!has_value("UsedMem / (FreeMem - 75)"));
+   test_check(!has_value("1e308 * 10"));
+
+   /* delta() has its value from the second evaluation on */
+   e = derived_compile("delta(UsedMem) + 2 * delta(FreeMem)", resolve, NULL);
+   test_check(e != NULL);
+   state = derived_state_new(e);
+   state2 = derived_state_new(e);
+   test_check(state != NULL && state2 != NULL);
+   if (e && state && state2) {
+      test_check(derived_eval(e, lookup, NULL, state, &v) != 0);
+      metrics[0].value = 40;
+      metrics[1].value = 70;
+      test_check(derived_eval(e, lookup, NULL, state, &v) == 0 && v == 5);
+      test_check(derived_eval(e, lookup, NULL, state, &v) == 0 && v == 0);
+
+      /* each copy of the metric has its own previous values */
+      test_check(derived_eval(e, lookup, NULL, state2, &v) != 0);
+      metrics[0].value = 50;
+      test_check(derived_eval(e, lookup, NULL, state2, &v) == 0 && v == 10);
+      test_check(derived_eval(e, lookup, NULL, state, &v) == 0 && v == 10);
+   }
+   free(state);
+   free(state2);
+   derived_free(e);
+
+   return test_result("derived");
+}
@@ -0,0 +1,43 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+#ifndef __TEST_H__
+#define __TEST_H__
+
+#include <stdio.h>
+
+/*
+ * Checks of the unit tests of vhostmd.  A failed check is reported and
+ * counted, and the test goes on; test_result() is the exit status.
+ */
+static int test_failures;
+
+#define test_check(cond)                                              \
+   do {                                                               \
+      if (!(cond)) {                                                  \
+         fprintf(stderr, "%s:%d: check failed: %s\n",                 \
+                 __FILE__, __LINE__, #cond);                          \
+         test_failures++;                                             \
+      }                                                               \
+   } while (0)
+
+static inline int test_result(const char *name)
+{
+   fprintf(stderr, "%s: %s\n", name, test_failures ? "FAILED" : "ok");
+   return test_failures ? 1 : 0;
+}
+
+#endif /* __TEST_H__ */
@@ -0,0 +1,219 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+/*
+ * Typed metric values: the output of an action is parsed into the type
+ * of each variable right after it is collected, and the parsed values
+ * are formatted for the metrics disk.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+#include "metric.h"
+#include "test.h"
+
+const char *libvirt_uri = NULL;
+
+static const char *output;
+
+static int value_collect(void *arg)
+{
+   return metric_value_printf((metric *) arg, "%s", output);
+}
+
+static void metric_clear(metric *m)
+{
+   int i;
+
+   for (i = 0; i < m->cnt; i++) {
+      free(m->info->vars[i].xml);
+      free(m->info->vars[i].json);
+      free(m->info->vars[i].xml2);
+      m->info->vars[i].xml = NULL;
+      m->info->vars[i].json = NULL;
+      m->info->vars[i].xml2 = NULL;
+   }
+   free(m->value);
+   free(m->slots);
+   m->value = NULL;
+   m->value_size = 0;
+   m->slots = NULL;
+}
+
+/*
+ * Collect text as the value of metric m and format it in f into out.
+ * Returns 0 if there is a valid value.
+ */
+static int value_format(metric *m, const char *text, metric_format f,
+                        char *out, size_t size)
+{
+   const metric_serializer *s = metric_serializer_get(f);
+   vu_buffer *buf;
+   int ret = -1;
+
+   out[0] = '\0';
+   output = text;
+   if (metric_value_get(m) || s->prepare(m))
+      return -1;
+
+   if (vu_buffer_create(&buf, 256))
+      return -1;
+   if (s->format(m, buf) == 0 && buf->use < size) {
+      memcpy(out, buf->content, buf->use);
+      out[buf->use] = '\0';
+      ret = 0;
+   }
+   vu_buffer_delete(buf);
+
+   return ret;
+}
+
+/* The value of a metric of type t from text, as written to the disk */
+static int value_is(metric_type t, metric_format f, const char *text,
+                    const char *expect)
+{
+   metric_var var = { .name = "Value", .type = t };
+   metric_info info = { .name = "Value", .vars = &var };
+   metric m = {
+      .type = t,
+      .ctx = METRIC_CONTEXT_HOST,
+      .cnt = 1,
+      .pf = value_collect,
+      .info = &info,
+   };
+   char out[512], want[128];
+   int ret;
+
+   var.type_str = metric_type_to_str(t);
+   if (f == METRIC_FORMAT_JSON)
+      snprintf(want, sizeof(want), "\"value\":%s}", expect);
+   else
+      snprintf(want, sizeof(want), "<value>%s</value>", expect);
+
+   ret = value_format(&m, text, f, out, sizeof(out)) == 0 &&
+         strstr(out, want) != NULL;
+   if (!ret)
+      fprintf(stderr, "%s '%s': got '%s', want '%s'\n",
+              var.type_str, text, out, want);
+   metric_clear(&m);
+
+   return ret;
+}
+
+static int valid(metric_type t, const char *text)
+{
+   metric_var var = { .name = "Value", .type = t };
+   metric_info info = { .name = "Value", .vars = &var };
+   metric m = {
+      .type = t,
+      .ctx = METRIC_CONTEXT_HOST,
+      .cnt = 1,
+      .pf = value_collect,
+      .info = &info,
+   };
+   char out[512];
+   int ret;
+
+   var.type_str = metric_type_to_str(t);
+   ret = value_format(&m, text, METRIC_FORMAT_XML, out, sizeof(out)) == 0;
+   metric_clear(&m);
+
+   return ret;
+}
+
+int main(void)
+{
+   metric_var vars[3] = {
+      { .name = "Count", .type_str = "int32", .type = M_INT32 },
+      { .name = "Load", .type_str = "real64", .type = M_REAL64 },
+      { .name = "Text", .type_str = "string", .type = M_STRING },
+   };
+   metric_info info = { .name = "Count,Load,Text", .vars = vars };
+   metric m = {
+      .type = M_GROUP,
+      .ctx = METRIC_CONTEXT_HOST,
+      .cnt = 3,
+      .pf = value_collect,
+      .info = &info,
+   };
+   char out[512];
+   double v;
+
+   vu_log_init(1, 0);
+
+   /* integer ranges */
+   test_check(value_is(M_INT32, METRIC_FORMAT_XML, "-2147483648", "-2147483648"));
+   test_check(value_is(M_INT32, METRIC_FORMAT_XML, " 2147483647\n", "2147483647"));
+   test_check(!valid(M_INT32, "2147483648"));
+   test_check(!valid(M_INT32, "-2147483649"));
+   test_check(value_is(M_UINT32, METRIC_FORMAT_XML, "4294967295", "4294967295"));
+   test_check(!valid(M_UINT32, "4294967296"));
+   test_check(!valid(M_UINT32, "-1"));
+   test_check(value_is(M_INT64, METRIC_FORMAT_XML, "-9223372036854775808",
+                       "-9223372036854775808"));
+   test_check(!valid(M_INT64, "9223372036854775808"));
+   test_check(value_is(M_UINT64, METRIC_FORMAT_XML, "18446744073709551615",
+                       "18446744073709551615"));
+   test_check(!valid(M_UINT64, "18446744073709551616"));
+   test_check(!valid(M_UINT64, ""));
+   test_check(!valid(M_UINT64, "12 MB"));
+
+   /* the fraction of an integer is dropped */
+   test_check(value_is(M_UINT64, METRIC_FORMAT_XML, "12.000000", "12"));
+   test_check(value_is(M_INT32, METRIC_FORMAT_XML, "-3.75", "-3"));
+   test_check(!valid(M_UINT32, ".5"));
+   test_check(!valid(M_UINT32, "1.5x"));
+   test_check(!valid(M_UINT32, "1.5.5"));
+
+   /* reals read back as the same value, in as few digits as possible */
+   test_check(value_is(M_REAL64, METRIC_FORMAT_XML, "846.600000", "846.6"));
+   test_check(value_is(M_REAL64, METRIC_FORMAT_XML, "0.000000", "0"));
+   test_check(value_is(M_REAL64, METRIC_FORMAT_XML, "1.25e-9", "1.25e-09"));
+   test_check(value_is(M_REAL64, METRIC_FORMAT_XML, "3.141592653589793",
+                       "3.1415926535897931"));
+   test_check(value_is(M_REAL64, METRIC_FORMAT_XML, "9007199254740993",
+                       "9007199254740992"));
+   test_check(value_is(M_REAL32, METRIC_FORMAT_XML, "0.1", "0.1"));
+   test_check(value_is(M_REAL32, METRIC_FORMAT_XML, "16777217", "16777216"));
+   test_check(value_is(M_REAL32, METRIC_FORMAT_JSON, "0.1", "0.1"));
+   test_check(value_is(M_REAL64, METRIC_FORMAT_JSON, "-1e300", "-1e+300"));
+   test_check(!valid(M_REAL32, "1e39"));
+   test_check(!valid(M_REAL64, "inf"));
+   test_check(!valid(M_REAL64, "nan"));
+
+   /* the values of a group, the last taking the rest of the output */
+   test_check(value_format(&m, " 7, 0.5 ,a, b\n", METRIC_FORMAT_XML,
+                           out, sizeof(out)) == 0);
+   test_check(metric_value_real(&m, 0, &v) == 0 && v == 7);
+   test_check(metric_value_real(&m, 1, &v) == 0 && v == 0.5);
+   test_check(strstr(out, "<value>a, b</value>") != NULL);
+   metric_clear(&m);
+
+   /* an invalid field is left out, the others are reported */
+   test_check(value_format(&m, "x,0.5,a", METRIC_FORMAT_XML,
+                           out, sizeof(out)) == 0);
+   test_check(metric_value_real(&m, 0, &v) != 0);
+   test_check(strstr(out, "<name>Count</name>") == NULL);
+   test_check(strstr(out, "<value>0.5</value>") != NULL);
+   metric_clear(&m);
+
+   return test_result("value");
+}
@@ -130,5 +130,6 @@ sbin/ldconfig
 %{_libdir}/libmetrics.so.0.0.0
 %dir /usr/include/vhostmd
 /usr/include/vhostmd/libmetrics.h
+/usr/include/vhostmd/vhostmd-plugin.h
 
 %changelog -n vhostmd
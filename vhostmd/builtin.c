@@ -0,0 +1,490 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "util.h"
+#include "metric.h"
+#include "builtin.h"
+
+/*
+ * Built-in collectors read their values directly from /proc instead
+ * of running a shell pipeline.  The files are opened once and re-read
+ * from the start on every collection.
+ *
+ * VM collectors read the statistics fetched for all VMs at once by
+ * vu_list_vms().  Each one names the statistics groups it needs.
+ *
+ * On a Xen host, /proc/meminfo and /proc/stat only describe dom0, not
+ * the host, so the collectors reading them are not available there.
+ */
+
+#define PROC_BUF_SIZE 16384
+
+typedef struct _proc_file {
+   const char *path;
+   int fd;
+} proc_file;
+
+static proc_file proc_meminfo = { "/proc/meminfo", -1 };
+static proc_file proc_stat = { "/proc/stat", -1 };
+static proc_file proc_vmstat = { "/proc/vmstat", -1 };
+
+static proc_file *proc_files[] = {
+   &proc_meminfo,
+   &proc_stat,
+   &proc_vmstat,
+   NULL
+};
+
+typedef struct _builtin {
+   const char *name;
+   metric_context ctx;
+   metric_func func;
+   unsigned int stats;
+   int dom0_only;           /* reports dom0 only on a Xen host */
+} builtin;
+
+/*
+ * Read the current content of a /proc file into buf.
+ * buf is always NUL terminated.  Returns 0 on success, -1 on error.
+ */
+static int proc_read(proc_file *pf, char *buf, size_t len)
+{
+   size_t pos = 0;
+   ssize_t n;
+
+   if (pf->fd == -1)
+      return -1;
+
+   while (pos < len - 1) {
+      n = pread(pf->fd, &buf[pos], len - 1 - pos, (off_t) pos);
+      if (n < 0) {
+         if (errno == EINTR)
+            continue;
+         vu_log(VHOSTMD_ERR, "Failed to read %s: %s", pf->path,
+                strerror(errno));
+         return -1;
+      }
+      if (n == 0)
+         break;
+      pos += (size_t) n;
+   }
+   buf[pos] = '\0';
+
+   return 0;
+}
+
+/*
+ * Find the line starting with key in buf and parse the number
+ * following it.  Lines look like "MemTotal:  1234 kB" or
+ * "pgpgin 1234".  Returns 0 on success, -1 if key was not found.
+ */
+static int proc_field(const char *buf, const char *key,
+                      unsigned long long *val)
+{
+   size_t klen = strlen(key);
+   const char *line = buf;
+   char *end;
+
+   while (line && *line) {
+      if (strncmp(line, key, klen) == 0 &&
+          (line[klen] == ':' || line[klen] == ' ')) {
+         line += klen + 1;
+         *val = strtoull(line, &end, 10);
+         if (end == line)
+            return -1;
+         return 0;
+      }
+      if ((line = strchr(line, '\n')))
+         line++;
+   }
+
+   return -1;
+}
+
+static int meminfo_get(const char *key, unsigned long long *val)
+{
+   char buf[PROC_BUF_SIZE];
+
+   if (proc_read(&proc_meminfo, buf, sizeof(buf)) ||
+       proc_field(buf, key, val)) {
+      vu_log(VHOSTMD_ERR, "Unable to read %s from %s", key,
+             proc_meminfo.path);
+      return -1;
+   }
+
+   return 0;
+}
+
+static int vmstat_get(const char *key, unsigned long long *val)
+{
+   char buf[PROC_BUF_SIZE];
+
+   if (proc_read(&proc_vmstat, buf, sizeof(buf)) ||
+       proc_field(buf, key, val)) {
+      vu_log(VHOSTMD_ERR, "Unable to read %s from %s", key,
+             proc_vmstat.path);
+      return -1;
+   }
+
+   return 0;
+}
+
+/* Total memory in MiB */
+static int meminfo_total(void *arg)
+{
+   unsigned long long total;
+
+   if (meminfo_get("MemTotal", &total))
+      return -1;
+
+   return metric_value_printf((metric *) arg, "%llu", total / 1024);
+}
+
+/* Unused memory in MiB */
+static int meminfo_free(void *arg)
+{
+   unsigned long long mfree;
+
+   if (meminfo_get("MemFree", &mfree))
+      return -1;
+
+   return metric_value_printf((metric *) arg, "%llu", mfree / 1024);
+}
+
+/* Memory available for new allocations in MiB, as reported by free(1) */
+static int meminfo_available(void *arg)
+{
+   unsigned long long avail;
+
+   if (meminfo_get("MemAvailable", &avail))
+      return -1;
+
+   return metric_value_printf((metric *) arg, "%llu", avail / 1024);
+}
+
+/* Used memory in MiB, i.e. total memory less available memory */
+static int meminfo_used(void *arg)
+{
+   unsigned long long total, avail;
+
+   if (meminfo_get("MemTotal", &total) ||
+       meminfo_get("MemAvailable", &avail))
+      return -1;
+
+   if (avail > total)
+      avail = total;
+
+   return metric_value_printf((metric *) arg, "%llu", (total - avail) / 1024);
+}
+
+/* KiB paged in since boot */
+static int vmstat_pgpgin(void *arg)
+{
+   unsigned long long val;
+
+   if (vmstat_get("pgpgin", &val))
+      return -1;
+
+   return metric_value_printf((metric *) arg, "%llu", val);
+}
+
+/* KiB paged out since boot */
+static int vmstat_pgpgout(void *arg)
+{
+   unsigned long long val;
+
+   if (vmstat_get("pgpgout", &val))
+      return -1;
+
+   return metric_value_printf((metric *) arg, "%llu", val);
+}
+
+/* Page faults since boot */
+static int vmstat_pgfault(void *arg)
+{
+   unsigned long long val;
+
+   if (vmstat_get("pgfault", &val))
+      return -1;
+
+   return metric_value_printf((metric *) arg, "%llu", val);
+}
+
+/*
+ * KiB paged in and out since boot, for a group metric.  Report them
+ * as rates with kind="counter".
+ */
+static int vmstat_paging(void *arg)
+{
+   char buf[PROC_BUF_SIZE];
+   unsigned long long in, out;
+
+   if (proc_read(&proc_vmstat, buf, sizeof(buf)) ||
+       proc_field(buf, "pgpgin", &in) ||
+       proc_field(buf, "pgpgout", &out)) {
+      vu_log(VHOSTMD_ERR, "Unable to read paging counters from %s",
+             proc_vmstat.path);
+      return -1;
+   }
+
+   return metric_value_printf((metric *) arg, "%llu,%llu", in, out);
+}
+
+/* User, nice and system time of all CPUs in seconds */
+static int stat_cpu_time(void *arg)
+{
+   char buf[PROC_BUF_SIZE];
+   unsigned long long user, nice, sys;
+   long hz;
+
+   if (proc_read(&proc_stat, buf, sizeof(buf)) ||
+       sscanf(buf, "cpu %llu %llu %llu", &user, &nice, &sys) != 3) {
+      vu_log(VHOSTMD_ERR, "Unable to read cpu times from %s",
+             proc_stat.path);
+      return -1;
+   }
+
+   if ((hz = sysconf(_SC_CLK_TCK)) <= 0)
+      return -1;
+
+   return metric_value_printf((metric *) arg, "%f",
+                              (double) (user + nice + sys) / hz);
+}
+
+/*
+ * Format a single VM statistics value, scaled down by div.
+ */
+static int vm_stat_print(metric *m, const char *field, unsigned long long div)
+{
+   unsigned long long val;
+
+   if (m->vm == NULL || vu_vm_stat(m->vm, field, &val)) {
+      vu_log(VHOSTMD_ERR, "No %s statistics for metric %s", field, m->info->name);
+      return -1;
+   }
+
+   return metric_value_printf(m, "%llu", val / div);
+}
+
+/*
+ * Format the sum of a VM statistics value over all devices of group.
+ */
+static int vm_stat_sum_print(metric *m, const char *group, const char *field)
+{
+   unsigned long long val;
+
+   if (m->vm == NULL || vu_vm_stat_sum(m->vm, group, field, &val)) {
+      vu_log(VHOSTMD_ERR, "No %s statistics for metric %s", group, m->info->name);
+      return -1;
+   }
+
+   return metric_value_printf(m, "%llu", val);
+}
+
+/* CPU time used by the VM in seconds */
+static int vm_cpu_time(void *arg)
+{
+   metric *m = (metric *) arg;
+   unsigned long long ns;
+
+   if (m->vm == NULL || vu_vm_stat(m->vm, "cpu.time", &ns)) {
+      vu_log(VHOSTMD_ERR, "No cpu.time statistics for metric %s", m->info->name);
+      return -1;
+   }
+
+   return metric_value_printf(m, "%f", (double) ns / 1000000000.0);
+}
+
+/* Current and maximum balloon size in MiB */
+static int vm_balloon_current(void *arg)
+{
+   return vm_stat_print((metric *) arg, "balloon.current", 1024);
+}
+
+static int vm_balloon_maximum(void *arg)
+{
+   return vm_stat_print((metric *) arg, "balloon.maximum", 1024);
+}
+
+/* Online and maximum number of vCPUs */
+static int vm_vcpu_current(void *arg)
+{
+   return vm_stat_print((metric *) arg, "vcpu.current", 1);
+}
+
+static int vm_vcpu_maximum(void *arg)
+{
+   return vm_stat_print((metric *) arg, "vcpu.maximum", 1);
+}
+
+/* Bytes and requests of all disks */
+static int vm_block_rd_bytes(void *arg)
+{
+   return vm_stat_sum_print((metric *) arg, "block", "rd.bytes");
+}
+
+static int vm_block_wr_bytes(void *arg)
+{
+   return vm_stat_sum_print((metric *) arg, "block", "wr.bytes");
+}
+
+static int vm_block_rd_reqs(void *arg)
+{
+   return vm_stat_sum_print((metric *) arg, "block", "rd.reqs");
+}
+
+static int vm_block_wr_reqs(void *arg)
+{
+   return vm_stat_sum_print((metric *) arg, "block", "wr.reqs");
+}
+
+/* Bytes and packets of all network interfaces */
+static int vm_net_rx_bytes(void *arg)
+{
+   return vm_stat_sum_print((metric *) arg, "net", "rx.bytes");
+}
+
+static int vm_net_tx_bytes(void *arg)
+{
+   return vm_stat_sum_print((metric *) arg, "net", "tx.bytes");
+}
+
+static int vm_net_rx_pkts(void *arg)
+{
+   return vm_stat_sum_print((metric *) arg, "net", "rx.pkts");
+}
+
+static int vm_net_tx_pkts(void *arg)
+{
+   return vm_stat_sum_print((metric *) arg, "net", "tx.pkts");
+}
+
+static builtin builtins[] = {
+   { "meminfo.total", METRIC_CONTEXT_HOST, meminfo_total, 0, 1 },
+   { "meminfo.free", METRIC_CONTEXT_HOST, meminfo_free, 0, 1 },
+   { "meminfo.available", METRIC_CONTEXT_HOST, meminfo_available, 0, 1 },
+   { "meminfo.used", METRIC_CONTEXT_HOST, meminfo_used, 0, 1 },
+   { "vmstat.pgpgin", METRIC_CONTEXT_HOST, vmstat_pgpgin, 0, 0 },
+   { "vmstat.pgpgout", METRIC_CONTEXT_HOST, vmstat_pgpgout, 0, 0 },
+   { "vmstat.pgfault", METRIC_CONTEXT_HOST, vmstat_pgfault, 0, 0 },
+   { "vmstat.paging", METRIC_CONTEXT_HOST, vmstat_paging, 0, 0 },
+   { "stat.cputime", METRIC_CONTEXT_HOST, stat_cpu_time, 0, 1 },
+   { "vm.cpu.time", METRIC_CONTEXT_VM, vm_cpu_time, VU_STATS_CPU, 0 },
+   { "vm.balloon.current", METRIC_CONTEXT_VM, vm_balloon_current,
+     VU_STATS_BALLOON, 0 },
+   { "vm.balloon.maximum", METRIC_CONTEXT_VM, vm_balloon_maximum,
+     VU_STATS_BALLOON, 0 },
+   { "vm.vcpu.current", METRIC_CONTEXT_VM, vm_vcpu_current, VU_STATS_VCPU, 0 },
+   { "vm.vcpu.maximum", METRIC_CONTEXT_VM, vm_vcpu_maximum, VU_STATS_VCPU, 0 },
+   { "vm.block.rd.bytes", METRIC_CONTEXT_VM, vm_block_rd_bytes,
+     VU_STATS_BLOCK, 0 },
+   { "vm.block.wr.bytes", METRIC_CONTEXT_VM, vm_block_wr_bytes,
+     VU_STATS_BLOCK, 0 },
+   { "vm.block.rd.reqs", METRIC_CONTEXT_VM, vm_block_rd_reqs,
+     VU_STATS_BLOCK, 0 },
+   { "vm.block.wr.reqs", METRIC_CONTEXT_VM, vm_block_wr_reqs,
+     VU_STATS_BLOCK, 0 },
+   { "vm.net.rx.bytes", METRIC_CONTEXT_VM, vm_net_rx_bytes,
+     VU_STATS_INTERFACE, 0 },
+   { "vm.net.tx.bytes", METRIC_CONTEXT_VM, vm_net_tx_bytes,
+     VU_STATS_INTERFACE, 0 },
+   { "vm.net.rx.pkts", METRIC_CONTEXT_VM, vm_net_rx_pkts,
+     VU_STATS_INTERFACE, 0 },
+   { "vm.net.tx.pkts", METRIC_CONTEXT_VM, vm_net_tx_pkts,
+     VU_STATS_INTERFACE, 0 },
+   { NULL, METRIC_CONTEXT_HOST, NULL, 0, 0 }
+};
+
+/*
+ * Open the files read by the built-in collectors.
+ */
+int builtin_init(void)
+{
+   int i;
+
+   for (i = 0; proc_files[i]; i++) {
+      proc_file *pf = proc_files[i];
+
+      if (pf->fd != -1)
+         continue;
+
+      pf->fd = open(pf->path, O_RDONLY | O_CLOEXEC);
+      if (pf->fd == -1)
+         vu_log(VHOSTMD_WARN, "Unable to open %s: %s", pf->path,
+                strerror(errno));
+   }
+
+   return 0;
+}
+
+/*
+ * Close the files read by the built-in collectors.
+ */
+void builtin_fini(void)
+{
+   int i;
+
+   for (i = 0; proc_files[i]; i++) {
+      if (proc_files[i]->fd != -1) {
+         close(proc_files[i]->fd);
+         proc_files[i]->fd = -1;
+      }
+   }
+}
+
+/* Whether vhostmd runs in dom0 of a Xen host, checked once */
+static int xen_host(void)
+{
+   static int xen = -1;
+
+   if (xen == -1)
+      xen = access("/proc/xen/privcmd", F_OK) == 0;
+   return xen;
+}
+
+/*
+ * Find a built-in collector by name and context.
+ */
+metric_func builtin_lookup(const char *name, metric_context ctx,
+                           unsigned int *stats)
+{
+   int i;
+
+   for (i = 0; builtins[i].name; i++) {
+      if (strcmp(builtins[i].name, name) == 0 &&
+          builtins[i].ctx == ctx) {
+         if (builtins[i].dom0_only && xen_host()) {
+            vu_log(VHOSTMD_INFO, "Builtin '%s' is not available on a "
+                   "Xen host", name);
+            return NULL;
+         }
+         if (stats)
+            *stats = builtins[i].stats;
+         return builtins[i].func;
+      }
+   }
+
+   return NULL;
+}
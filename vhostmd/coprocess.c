@@ -0,0 +1,317 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "util.h"
+#include "coprocess.h"
+
+/*
+ * A co-process is a helper command started once and kept running.
+ * vhostmd writes one request line to its stdin for each value and
+ * reads one reply line from its stdout.  Requests to the same
+ * co-process are serialized.
+ */
+
+#define COPROCESS_BUF_SIZE    4096
+
+struct _coprocess {
+   char *cmd;
+   pid_t pid;
+   int in;                      /* the helper's stdin */
+   int out;                     /* the helper's stdout */
+   char buf[COPROCESS_BUF_SIZE];
+   size_t used;
+   pthread_mutex_t lock;
+   struct _coprocess *next;
+};
+
+static coprocess *coprocesses = NULL;
+static pthread_mutex_t coprocesses_lock = PTHREAD_MUTEX_INITIALIZER;
+
+coprocess *coprocess_new(const char *cmd)
+{
+   coprocess *cp;
+
+   cp = calloc(1, sizeof(coprocess));
+   if (cp == NULL)
+      return NULL;
+
+   if ((cp->cmd = strdup(cmd)) == NULL) {
+      free(cp);
+      return NULL;
+   }
+   cp->pid = -1;
+   cp->in = -1;
+   cp->out = -1;
+   pthread_mutex_init(&cp->lock, NULL);
+
+   pthread_mutex_lock(&coprocesses_lock);
+   cp->next = coprocesses;
+   coprocesses = cp;
+   pthread_mutex_unlock(&coprocesses_lock);
+
+   return cp;
+}
+
+static int coprocess_start(coprocess *cp)
+{
+   int in[2] = { -1, -1 };
+   int out[2] = { -1, -1 };
+   sigset_t none;
+   pid_t pid;
+
+   if (pipe2(in, O_CLOEXEC) == -1 || pipe2(out, O_CLOEXEC) == -1) {
+      vu_log(VHOSTMD_ERR, "pipe: %s", strerror(errno));
+      goto error;
+   }
+
+   if ((pid = fork()) == -1) {
+      vu_log(VHOSTMD_ERR, "fork: %s", strerror(errno));
+      goto error;
+   }
+
+   if (pid == 0) {
+      /* the calling thread may block signals, don't pass that on */
+      sigemptyset(&none);
+      sigprocmask(SIG_SETMASK, &none, NULL);
+
+      /* own process group, so helpers it starts are killed with it */
+      setpgid(0, 0);
+
+      if (dup2(in[0], STDIN_FILENO) == -1 ||
+          dup2(out[1], STDOUT_FILENO) == -1)
+         _exit(127);
+
+      execl("/bin/sh", "sh", "-c", cp->cmd, (char *) NULL);
+      _exit(127);
+   }
+
+   /* also set in the parent, the group may be killed before the child runs */
+   setpgid(pid, pid);
+   close(in[0]);
+   close(out[1]);
+   cp->pid = pid;
+   cp->in = in[1];
+   cp->out = out[0];
+   cp->used = 0;
+
+   vu_log(VHOSTMD_INFO, "Started co-process '%s' (pid %d)", cp->cmd,
+          (int) pid);
+   return 0;
+
+ error:
+   if (in[0] != -1) {
+      close(in[0]);
+      close(in[1]);
+   }
+   if (out[0] != -1) {
+      close(out[0]);
+      close(out[1]);
+   }
+   return -1;
+}
+
+static void coprocess_stop(coprocess *cp)
+{
+   if (cp->pid == -1)
+      return;
+
+   close(cp->in);
+   close(cp->out);
+   kill(-cp->pid, SIGKILL);
+   while (waitpid(cp->pid, NULL, 0) == -1 && errno == EINTR)
+      ;
+
+   cp->pid = -1;
+   cp->in = -1;
+   cp->out = -1;
+   cp->used = 0;
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+   ssize_t n;
+
+   while (len > 0) {
+      n = write(fd, buf, len);
+      if (n < 0) {
+         if (errno == EINTR)
+            continue;
+         return -1;
+      }
+      buf += n;
+      len -= (size_t) n;
+   }
+
+   return 0;
+}
+
+static long ms_since(const struct timespec *start)
+{
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (now.tv_sec - start->tv_sec) * 1000 +
+          (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/*
+ * Read one line from the co-process.  Returns 0 on success,
+ * COPROCESS_TIMEOUT on timeout, -1 on error and -3 on end of file.
+ */
+static int read_line(coprocess *cp, char *reply, size_t len, int timeout)
+{
+   struct timespec start;
+   struct pollfd pfd;
+   char *nl;
+   size_t n;
+   ssize_t r;
+   long left;
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+
+   while ((nl = memchr(cp->buf, '\n', cp->used)) == NULL) {
+      if (cp->used == sizeof(cp->buf)) {
+         vu_log(VHOSTMD_ERR, "Co-process '%s' reply too long", cp->cmd);
+         return -1;
+      }
+
+      if ((left = timeout - ms_since(&start)) <= 0) {
+         vu_log(VHOSTMD_ERR, "Co-process '%s' did not reply within %d ms",
+                cp->cmd, timeout);
+         return COPROCESS_TIMEOUT;
+      }
+
+      pfd.fd = cp->out;
+      pfd.events = POLLIN;
+      if (poll(&pfd, 1, (int) left) == -1 && errno != EINTR)
+         return -1;
+      if (pfd.revents == 0)
+         continue;
+
+      r = read(cp->out, &cp->buf[cp->used], sizeof(cp->buf) - cp->used);
+      if (r < 0) {
+         if (errno == EINTR || errno == EAGAIN)
+            continue;
+         return -1;
+      }
+      if (r == 0)
+         return -3;
+      cp->used += (size_t) r;
+   }
+
+   n = (size_t) (nl - cp->buf);
+   if (n > len - 1)
+      n = len - 1;
+   memcpy(reply, cp->buf, n);
+   reply[n] = '\0';
+
+   n = (size_t) (nl - cp->buf) + 1;
+   memmove(cp->buf, &cp->buf[n], cp->used - n);
+   cp->used -= n;
+
+   return 0;
+}
+
+int coprocess_request(coprocess *cp, const char *req, char *reply, size_t len,
+                      int timeout)
+{
+   int ret = -1;
+   int tries;
+   int rc;
+
+   pthread_mutex_lock(&cp->lock);
+
+   /* retry once with a new process if the helper has died */
+   for (tries = 0; tries < 2; tries++) {
+      if (cp->pid == -1 && coprocess_start(cp))
+         break;
+
+      /* replies left over from a previous request are stale */
+      cp->used = 0;
+
+      if (write_all(cp->in, req, strlen(req))) {
+         vu_log(VHOSTMD_WARN, "Co-process '%s' not accepting requests, "
+                "restarting", cp->cmd);
+         coprocess_stop(cp);
+         continue;
+      }
+
+      rc = read_line(cp, reply, len, timeout);
+      if (rc == 0) {
+         ret = 0;
+         break;
+      }
+
+      coprocess_stop(cp);
+      if (rc != -3) {
+         ret = rc;
+         break;
+      }
+      vu_log(VHOSTMD_WARN, "Co-process '%s' exited, restarting", cp->cmd);
+   }
+
+   pthread_mutex_unlock(&cp->lock);
+   return ret;
+}
+
+void coprocess_free(coprocess *cp)
+{
+   coprocess **p;
+
+   if (cp == NULL)
+      return;
+
+   pthread_mutex_lock(&coprocesses_lock);
+   for (p = &coprocesses; *p; p = &(*p)->next) {
+      if (*p == cp) {
+         *p = cp->next;
+         break;
+      }
+   }
+   pthread_mutex_unlock(&coprocesses_lock);
+
+   coprocess_stop(cp);
+   pthread_mutex_destroy(&cp->lock);
+   free(cp->cmd);
+   free(cp);
+}
+
+void coprocess_fini(void)
+{
+   coprocess *cp;
+
+   pthread_mutex_lock(&coprocesses_lock);
+   for (cp = coprocesses; cp; cp = cp->next) {
+      pthread_mutex_lock(&cp->lock);
+      coprocess_stop(cp);
+      pthread_mutex_unlock(&cp->lock);
+   }
+   pthread_mutex_unlock(&coprocesses_lock);
+}
@@ -0,0 +1,384 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+
+#include "util.h"
+#include "derived.h"
+
+/*
+ * A derived metric's expression is compiled once, when the
+ * configuration is read, into instructions for a small stack machine.
+ * Metric names are resolved to handles by the caller, so evaluating
+ * an expression is a single pass over its instructions.
+ */
+
+#define DERIVED_NAME_MAX 256
+
+typedef enum _derived_op {
+   OP_NUM,
+   OP_REF,
+   OP_ADD,
+   OP_SUB,
+   OP_MUL,
+   OP_DIV,
+   OP_NEG,
+   OP_DELTA
+} derived_op;
+
+typedef struct _derived_insn {
+   derived_op op;
+   int arg;                     /* handle of OP_REF, state of OP_DELTA */
+   double num;                  /* value of OP_NUM */
+} derived_insn;
+
+struct _derived_expr {
+   derived_insn *code;
+   int len;
+   int size;
+   int depth;                   /* stack needed for evaluation */
+   int deltas;                  /* number of delta() terms */
+};
+
+typedef struct _derived_parser {
+   const char *src;
+   const char *p;
+   derived_expr *e;
+   derived_resolve resolve;
+   void *opaque;
+   int sp;                      /* stack depth after the code so far */
+} derived_parser;
+
+static int parse_expr(derived_parser *ps);
+
+static int parse_error(derived_parser *ps, const char *msg)
+{
+   vu_log(VHOSTMD_WARN, "Derived expression '%s': %s at '%s'", ps->src,
+          msg, ps->p);
+   return -1;
+}
+
+static int emit(derived_parser *ps, derived_op op, int arg, double num)
+{
+   derived_expr *e = ps->e;
+   derived_insn *code;
+
+   if (e->len == e->size) {
+      code = realloc(e->code, (size_t) (e->size + 16) * sizeof(derived_insn));
+      if (code == NULL)
+         return parse_error(ps, "out of memory");
+      e->code = code;
+      e->size += 16;
+   }
+   e->code[e->len].op = op;
+   e->code[e->len].arg = arg;
+   e->code[e->len].num = num;
+   e->len++;
+
+   if (op == OP_NUM || op == OP_REF)
+      ps->sp++;
+   else if (op != OP_NEG && op != OP_DELTA)
+      ps->sp--;
+   if (ps->sp > e->depth)
+      e->depth = ps->sp;
+
+   return 0;
+}
+
+static void skip_space(derived_parser *ps)
+{
+   while (isspace((unsigned char) *ps->p))
+      ps->p++;
+}
+
+static int name_char(int c, int first)
+{
+   return isalpha(c) || c == '_' || (!first && (isdigit(c) || c == '.'));
+}
+
+/*
+ * Read a name, plain or in single quotes, into name.
+ */
+static int parse_name(derived_parser *ps, char *name)
+{
+   const char *start;
+   size_t len;
+
+   skip_space(ps);
+   if (*ps->p == '\'') {
+      start = ++ps->p;
+      while (*ps->p && *ps->p != '\'')
+         ps->p++;
+      if (*ps->p != '\'')
+         return parse_error(ps, "missing quote");
+      len = (size_t) (ps->p - start);
+      ps->p++;
+   }
+   else {
+      start = ps->p;
+      if (!name_char((unsigned char) *ps->p, 1))
+         return parse_error(ps, "metric name expected");
+      while (name_char((unsigned char) *ps->p, 0))
+         ps->p++;
+      len = (size_t) (ps->p - start);
+   }
+
+   if (len == 0 || len >= DERIVED_NAME_MAX)
+      return parse_error(ps, "invalid metric name");
+   memcpy(name, start, len);
+   name[len] = '\0';
+
+   return 0;
+}
+
+static int parse_ref(derived_parser *ps, const char *name, int sum)
+{
+   int ref = ps->resolve(name, sum, ps->opaque);
+
+   if (ref < 0) {
+      vu_log(VHOSTMD_WARN, "Derived expression '%s': no numeric %smetric "
+             "'%s'", ps->src, sum ? "vm " : "", name);
+      return -1;
+   }
+   return emit(ps, OP_REF, ref, 0);
+}
+
+static int expect(derived_parser *ps, char c)
+{
+   skip_space(ps);
+   if (*ps->p != c)
+      return parse_error(ps, c == ')' ? "')' expected" : "syntax error");
+   ps->p++;
+   return 0;
+}
+
+/* primary: number | name | 'name' | sum(name) | delta(expr) | (expr) */
+static int parse_primary(derived_parser *ps)
+{
+   char name[DERIVED_NAME_MAX];
+   char *end;
+   double num;
+
+   skip_space(ps);
+
+   if (isdigit((unsigned char) *ps->p) || *ps->p == '.') {
+      num = strtod(ps->p, &end);
+      if (end == ps->p)
+         return parse_error(ps, "invalid number");
+      ps->p = end;
+      return emit(ps, OP_NUM, 0, num);
+   }
+
+   if (*ps->p == '(') {
+      ps->p++;
+      if (parse_expr(ps))
+         return -1;
+      return expect(ps, ')');
+   }
+
+   if (*ps->p == '\'')
+      return parse_name(ps, name) || parse_ref(ps, name, 0);
+
+   if (parse_name(ps, name))
+      return -1;
+   skip_space(ps);
+   if (*ps->p != '(')
+      return parse_ref(ps, name, 0);
+
+   ps->p++;
+   if (strcmp(name, "sum") == 0) {
+      if (parse_name(ps, name) || parse_ref(ps, name, 1))
+         return -1;
+   }
+   else if (strcmp(name, "delta") == 0) {
+      if (parse_expr(ps) || emit(ps, OP_DELTA, ps->e->deltas++, 0))
+         return -1;
+   }
+   else
+      return parse_error(ps, "unknown function");
+
+   return expect(ps, ')');
+}
+
+/* unary: -unary | primary */
+static int parse_unary(derived_parser *ps)
+{
+   skip_space(ps);
+   if (*ps->p == '-') {
+      ps->p++;
+      return parse_unary(ps) || emit(ps, OP_NEG, 0, 0);
+   }
+   return parse_primary(ps);
+}
+
+/* product: unary (('*' | '/') unary)* */
+static int parse_product(derived_parser *ps)
+{
+   char op;
+
+   if (parse_unary(ps))
+      return -1;
+
+   for (;;) {
+      skip_space(ps);
+      op = *ps->p;
+      if (op != '*' && op != '/')
+         return 0;
+      ps->p++;
+      if (parse_unary(ps) || emit(ps, op == '*' ? OP_MUL : OP_DIV, 0, 0))
+         return -1;
+   }
+}
+
+/* expr: product (('+' | '-') product)* */
+static int parse_expr(derived_parser *ps)
+{
+   char op;
+
+   if (parse_product(ps))
+      return -1;
+
+   for (;;) {
+      skip_space(ps);
+      op = *ps->p;
+      if (op != '+' && op != '-')
+         return 0;
+      ps->p++;
+      if (parse_product(ps) || emit(ps, op == '+' ? OP_ADD : OP_SUB, 0, 0))
+         return -1;
+   }
+}
+
+derived_expr *derived_compile(const char *src, derived_resolve resolve,
+                              void *opaque)
+{
+   derived_parser ps;
+
+   memset(&ps, 0, sizeof(ps));
+   ps.src = src;
+   ps.p = src;
+   ps.resolve = resolve;
+   ps.opaque = opaque;
+
+   if ((ps.e = calloc(1, sizeof(derived_expr))) == NULL)
+      return NULL;
+
+   if (parse_expr(&ps))
+      goto error;
+   skip_space(&ps);
+   if (*ps.p != '\0') {
+      parse_error(&ps, "syntax error");
+      goto error;
+   }
+
+   return ps.e;
+
+ error:
+   derived_free(ps.e);
+   return NULL;
+}
+
+void derived_free(derived_expr *e)
+{
+   if (e == NULL)
+      return;
+
+   free(e->code);
+   free(e);
+}
+
+double *derived_state_new(const derived_expr *e)
+{
+   double *state;
+   int i;
+
+   state = calloc((size_t) (e->deltas ? e->deltas : 1), sizeof(double));
+   if (state == NULL)
+      return NULL;
+
+   /* no previous values yet */
+   for (i = 0; i < e->deltas; i++)
+      state[i] = NAN;
+
+   return state;
+}
+
+int derived_eval(const derived_expr *e, derived_lookup lookup, void *opaque,
+                 double *state, double *result)
+{
+   double stack[e->depth];
+   const derived_insn *in;
+   double prev;
+   int sp = 0;
+   int ret = 0;
+   int i;
+
+   for (i = 0; i < e->len; i++) {
+      in = &e->code[i];
+
+      switch (in->op) {
+         case OP_NUM:
+            stack[sp++] = in->num;
+            break;
+         case OP_REF:
+            if (lookup(in->arg, opaque, &stack[sp]))
+               return -1;
+            sp++;
+            break;
+         case OP_ADD:
+            sp--;
+            stack[sp - 1] += stack[sp];
+            break;
+         case OP_SUB:
+            sp--;
+            stack[sp - 1] -= stack[sp];
+            break;
+         case OP_MUL:
+            sp--;
+            stack[sp - 1] *= stack[sp];
+            break;
+         case OP_DIV:
+            sp--;
+            if (stack[sp] == 0)
+               return -1;
+            stack[sp - 1] /= stack[sp];
+            break;
+         case OP_NEG:
+            stack[sp - 1] = -stack[sp - 1];
+            break;
+         case OP_DELTA:
+            prev = state[in->arg];
+            state[in->arg] = stack[sp - 1];
+            /* keep going on the first sample, so all terms get one */
+            if (isnan(prev))
+               ret = -1;
+            else
+               stack[sp - 1] -= prev;
+            break;
+      }
+   }
+
+   if (ret || !isfinite(stack[0]))
+      return -1;
+
+   *result = stack[0];
+   return 0;
+}
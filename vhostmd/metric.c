@@ -25,75 +25,24 @@
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <ctype.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <float.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <time.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/wait.h>
 
 #include "util.h"
 #include "metric.h"
 
-/* If this returns NULL (for error), then 'str' has been freed. */
-static char *replace (char *str, const char *patt, const char *format, ...)
-{
-    char *repl = NULL;
-    char *old_str;
-    va_list args;
-    int r;
-
-    va_start (args, format);
-    r = vasprintf (&repl, format, args);
-    va_end (args);
-    if (r == -1) {
-	vu_log (VHOSTMD_ERR, "vasprintf failed: %m");
-	free (repl);
-	free (str);
-	return NULL;
-    }
-
-    old_str = str;
-    str = vu_str_replace (old_str, patt, repl);
-    free (repl);
-    if (str == NULL) {
-	vu_log (VHOSTMD_ERR, "vu_str_replace failed: %m");
-	free (old_str);
-	return NULL;
-    }
-    free (old_str);
-
-    return str;
-}
-
-static int metric_action_subst(metric *m, char **action)
-{
-    char *temp;
-
-    temp = strdup (m->action);
-    if (temp == NULL) {
-	vu_log (VHOSTMD_ERR, "strdup: %m");
-	return -1;
-    }
-
-    if (libvirt_uri) {
-	temp = replace (temp, "CONNECT", "--connect '%s'", libvirt_uri);
-	if (temp == NULL) return -1;
-    } else {
-	temp = replace (temp, "CONNECT", "");
-	if (temp == NULL) return -1;
-    }
-
-    if (m->ctx == METRIC_CONTEXT_VM) {
-	temp = replace (temp, "NAME", "%s", m->vm->name);
-	if (temp == NULL) return -1;
-
-	temp = replace (temp, "VMID", "%d", m->vm->id);
-	if (temp == NULL) return -1;
-
-	temp = replace (temp, "UUID", "%s", m->vm->uuid);
-	if (temp == NULL) return -1;
-    }
-
-    *action = temp;
-    return 0;
-}
-
 /*
  * Verify XML contained in parameter xml is valid.
  * Returns 1 is XML is valid, 0 otherwise.
@@ -240,114 +189,1855 @@ int metric_type_from_str(const xmlChar *t, metric_type *typ)
    return ret;
 }
 
-int metric_value_get(metric *m)
+/*
+ * Replace the value buffer of a metric with buf of size bytes.
+ */
+static void metric_value_take(metric *m, char *buf, size_t size)
 {
-   FILE *fp = NULL;
-   int ret = -1;
-   size_t len;
-   char *cmd = NULL;
-   
-   if (m->pf) { 
-	   ret = m->pf(m);
-	   return ret;
-   }
+   free(m->value);
+   m->value = buf;
+   m->value_size = buf ? size : 0;
+}
+
+int metric_value_vprintf(metric *m, const char *fmt, va_list args)
+{
+   va_list copy;
+   char *buf;
+   int len;
+
+   va_copy(copy, args);
+   len = vsnprintf(m->value, m->value_size, fmt, copy);
+   va_end(copy);
+   if (len < 0)
+      return -1;
+   if ((size_t) len < m->value_size)
+      return 0;
+
+   /* the value did not fit, grow the buffer to its length */
+   if ((buf = malloc((size_t) len + 1)) == NULL)
+      return -1;
+
+   vsnprintf(buf, (size_t) len + 1, fmt, args);
+   metric_value_take(m, buf, (size_t) len + 1);
 
-   if (metric_action_subst(m, &cmd)) {
-       vu_log(VHOSTMD_ERR, "Failed action 'KEYWORD' substitution");
-       return ret;
+   return 0;
+}
+
+int metric_value_printf(metric *m, const char *fmt, ...)
+{
+   va_list args;
+   int ret;
+
+   va_start(args, fmt);
+   ret = metric_value_vprintf(m, fmt, args);
+   va_end(args);
+
+   return ret;
+}
+
+/*
+ * Parse the field v of len bytes, without surrounding white space,
+ * into slot s as a value of type t.  Returns 0 if it is valid.
+ */
+static int slot_parse(metric_slot *s, metric_type t, const char *v, size_t len)
+{
+   char num[64];
+   char *end;
+   long long ll = 0;
+   unsigned long long ull = 0;
+   double d = 0;
+
+   if (t == M_STRING) {
+      s->v.str.len = (uint32_t) len;
+      return 0;
    }
 
-   fp = popen (cmd, "r");
+   if (len == 0 || len >= sizeof(num))
+      return -1;
+   memcpy(num, v, len);
+   num[len] = '\0';
 
-   if (fp == NULL) {
-      vu_log(VHOSTMD_ERR, "Command failed: %s", cmd);
-      free(cmd);
-      return ret;
+   errno = 0;
+   switch (t) {
+      case M_INT32:
+      case M_INT64:
+         ll = strtoll(num, &end, 10);
+         break;
+      case M_UINT32:
+      case M_UINT64:
+         if (num[0] == '-')
+            return -1;
+         ull = strtoull(num, &end, 10);
+         break;
+      case M_REAL32:
+      case M_REAL64:
+         d = strtod(num, &end);
+         if (!isfinite(d))
+            return -1;
+         break;
+      default:
+         return -1;
    }
-   free(cmd);
-   
-   if (m->type == M_XML)
-      len = 2048;
-   else
-      len = 256;
-   
-   if (m->value)
-      memset(m->value, 0, len);
-   else
-      m->value = calloc(1, len);
+   /* scripts like pagerate.pl print integers with %f, drop the fraction */
+   if (t != M_REAL32 && t != M_REAL64 && *end == '.' && end > num &&
+       isdigit((unsigned char) end[-1])) {
+      end++;
+      while (isdigit((unsigned char) *end))
+         end++;
+   }
+   if (errno || *end != '\0')
+      return -1;
 
-   if (m->value == NULL)
-      goto out;
+   switch (t) {
+      case M_INT32:
+         if (ll < INT32_MIN || ll > INT32_MAX)
+            return -1;
+         s->v.i32 = (int32_t) ll;
+         break;
+      case M_INT64:
+         s->v.i64 = (int64_t) ll;
+         break;
+      case M_UINT32:
+         if (ull > UINT32_MAX)
+            return -1;
+         s->v.u32 = (uint32_t) ull;
+         break;
+      case M_UINT64:
+         s->v.u64 = (uint64_t) ull;
+         break;
+      case M_REAL32:
+         if (fabs(d) > FLT_MAX)
+            return -1;
+         s->v.r32 = (float) d;
+         break;
+      default:
+         s->v.r64 = d;
+         break;
+   }
 
-   fread(m->value, 1, len-1, fp);
-   
- out:
-   ret = pclose(fp);
-   
-   return ret;
+   return 0;
 }
 
-int metric_xml(metric *m, vu_buffer *buf)
+/*
+ * Split the text value of a metric into its fields, the last one
+ * taking the rest, and parse each into the slot of its variable.
+ * White space around a field, like the line feed ending the output
+ * of commands, is dropped.
+ */
+static int metric_value_parse(metric *m)
 {
-   char *n;
-   char *v;
-   char *t;
-   char *u;
+   const char *v, *end, *p, *q;
+   metric_slot *s;
    int i;
 
-   if (metric_value_get(m))
+   if (m->type == M_XML)
+      return 0;
+
+   if (m->slots == NULL &&
+       (m->slots = calloc((size_t) m->cnt, sizeof(metric_slot))) == NULL)
       return -1;
-   
-   if (m->type == M_XML) {
-      if (validate_metric_xml_value(m->value)) {
-         vu_buffer_add(buf, m->value, strlen(m->value));
-         return 0;
-      } else  {
-         vu_log(VHOSTMD_WARN, "Validation of XML returned by metric %s failed",
-                m->name);
+
+   v = m->value;
+   for (i = 0; i < m->cnt; i++) {
+      s = &m->slots[i];
+
+      if (i == m->cnt - 1 || (end = strchr(v, ',')) == NULL)
+         end = v + strlen(v);
+
+      for (p = v; p < end && isspace((unsigned char) *p); p++)
+         ;
+      for (q = end; q > p && isspace((unsigned char) q[-1]); q--)
+         ;
+
+      s->v.str.off = (uint32_t) (p - m->value);
+      s->valid = !slot_parse(s, m->info->vars[i].type, p, (size_t) (q - p));
+      if (!s->valid)
+         vu_log(VHOSTMD_WARN, "Metric %s: invalid %s value '%.*s'",
+                m->info->vars[i].name, m->info->vars[i].type_str,
+                (int) (q - p), p);
+
+      v = *end ? end + 1 : end;
+   }
+
+   return 0;
+}
+
+/*
+ * Store v in slot s as a value of type t, integers rounded to the
+ * nearest.  Returns 0 if v is in the range of the type.
+ */
+static int slot_set(metric_slot *s, metric_type t, double v)
+{
+   if (t != M_REAL32 && t != M_REAL64)
+      v = round(v);
+
+   switch (t) {
+      case M_INT32:
+         if (v < INT32_MIN || v > INT32_MAX)
+            return -1;
+         s->v.i32 = (int32_t) v;
+         break;
+      case M_UINT32:
+         if (v < 0 || v > UINT32_MAX)
+            return -1;
+         s->v.u32 = (uint32_t) v;
+         break;
+      case M_INT64:
+         if (v < -9223372036854775808.0 || v >= 9223372036854775808.0)
+            return -1;
+         s->v.i64 = (int64_t) v;
+         break;
+      case M_UINT64:
+         if (v < 0 || v >= 18446744073709551616.0)
+            return -1;
+         s->v.u64 = (uint64_t) v;
+         break;
+      case M_REAL32:
+         if (fabs(v) > FLT_MAX)
+            return -1;
+         s->v.r32 = (float) v;
+         break;
+      case M_REAL64:
+         s->v.r64 = v;
+         break;
+      default:
+         return -1;
+   }
+
+   return 0;
+}
+
+int metric_value_real(const metric *m, int var, double *val)
+{
+   const metric_slot *s;
+
+   if (m->status || m->slots == NULL || !m->slots[var].valid)
+      return -1;
+
+   s = &m->slots[var];
+   switch (m->info->vars[var].type) {
+      case M_INT32:
+         *val = s->v.i32;
+         break;
+      case M_UINT32:
+         *val = s->v.u32;
+         break;
+      case M_INT64:
+         *val = (double) s->v.i64;
+         break;
+      case M_UINT64:
+         *val = (double) s->v.u64;
+         break;
+      case M_REAL32:
+         *val = s->v.r32;
+         break;
+      case M_REAL64:
+         *val = s->v.r64;
+         break;
+      default:
+         return -1;
+   }
+
+   return 0;
+}
+
+int metric_value_set(metric *m, double v)
+{
+   if (m->slots == NULL &&
+       (m->slots = calloc((size_t) m->cnt, sizeof(metric_slot))) == NULL) {
+      m->status = -1;
+      return -1;
+   }
+
+   m->stale = 0;
+   m->slots[0].valid = !slot_set(&m->slots[0], m->type, v);
+   if (!m->slots[0].valid) {
+      vu_log(VHOSTMD_WARN, "Metric %s: value %f out of range for %s",
+             m->info->name, v, m->info->vars[0].type_str);
+      m->status = -1;
+      return -1;
+   }
+
+   m->status = 0;
+   return 0;
+}
+
+/*
+ * Print real r into num with as few digits as read back to the same
+ * float or double, at most 9 or 17.
+ */
+static int real_format(char *num, size_t size, double r, int real32)
+{
+   int len;
+
+   len = snprintf(num, size, "%.*g", real32 ? FLT_DIG : DBL_DIG, r);
+   if (real32 ? strtof(num, NULL) != (float) r : strtod(num, NULL) != r)
+      len = snprintf(num, size, "%.*g", real32 ? 9 : 17, r);
+
+   return len;
+}
+
+/*
+ * Append the value of slot s of type t in format f, without going
+ * through a format string for integers and strings.
+ */
+static void slot_format(vu_buffer *buf, const metric *m, const metric_slot *s,
+                        metric_type t, metric_format f)
+{
+   char num[32];
+   double r;
+   int len;
+
+   switch (t) {
+      case M_INT32:
+         vu_buffer_add_int(buf, s->v.i32);
+         break;
+      case M_UINT32:
+         vu_buffer_add_uint(buf, s->v.u32);
+         break;
+      case M_INT64:
+         vu_buffer_add_int(buf, s->v.i64);
+         break;
+      case M_UINT64:
+         vu_buffer_add_uint(buf, s->v.u64);
+         break;
+      case M_REAL32:
+      case M_REAL64:
+         r = t == M_REAL32 ? (double) s->v.r32 : s->v.r64;
+         /* JSON has no numbers for infinity and NaN */
+         if (f == METRIC_FORMAT_JSON && !isfinite(r)) {
+            vu_buffer_add(buf, "null", 4);
+            break;
+         }
+         len = real_format(num, sizeof(num), r, t == M_REAL32);
+         if (len > 0 && len < (int) sizeof(num))
+            vu_buffer_add(buf, num, len);
+         break;
+      default:
+         if (f == METRIC_FORMAT_JSON) {
+            vu_buffer_add(buf, "\"", 1);
+            vu_buffer_add_json(buf, m->value + s->v.str.off,
+                               (int) s->v.str.len);
+            vu_buffer_add(buf, "\"", 1);
+         }
+         else
+            vu_buffer_add_escaped(buf, m->value + s->v.str.off,
+                                  (int) s->v.str.len);
+         break;
+   }
+}
+
+/*
+ * Actions are compiled into templates when the configuration is read:
+ * literal text and the placeholders CONNECT, NAME, VMID and UUID.  A
+ * template is expanded in a single pass into a buffer that belongs to
+ * the calling worker thread and is reused for all its actions.
+ */
+typedef enum _action_token {
+   TOKEN_TEXT,
+   TOKEN_CONNECT,
+   TOKEN_NAME,
+   TOKEN_VMID,
+   TOKEN_UUID
+} action_token;
+
+typedef struct _action_part {
+   action_token token;
+   const char *text;            /* literal text, not NUL terminated */
+   size_t len;
+} action_part;
+
+struct _action_template {
+   char *src;                   /* the text the literal parts point into */
+   int num;
+   action_part *parts;
+};
+
+static const struct {
+   const char *name;
+   size_t len;
+   action_token token;
+} placeholders[] = {
+   { "CONNECT", 7, TOKEN_CONNECT },
+   { "NAME", 4, TOKEN_NAME },
+   { "VMID", 4, TOKEN_VMID },
+   { "UUID", 4, TOKEN_UUID },
+   { NULL, 0, TOKEN_TEXT }
+};
+
+static void template_free(action_template *t)
+{
+   if (t == NULL)
+      return;
+   free(t->src);
+   free(t->parts);
+   free(t);
+}
+
+/*
+ * Split src into literal text and placeholders.  NAME, VMID and UUID
+ * are placeholders only if vm_tokens is set.
+ */
+static action_template *template_compile(const char *src, int vm_tokens)
+{
+   action_template *t;
+   const char *p, *text;
+   size_t len = strlen(src);
+   int i;
+
+   if ((t = calloc(1, sizeof(action_template))) == NULL ||
+       (t->src = strdup(src)) == NULL ||
+       (t->parts = calloc(len / 2 + 2, sizeof(action_part))) == NULL) {
+      vu_log(VHOSTMD_ERR, "calloc: %m");
+      template_free(t);
+      return NULL;
+   }
+
+   text = p = t->src;
+   while (*p) {
+      for (i = 0; placeholders[i].name; i++) {
+         if (!vm_tokens && placeholders[i].token != TOKEN_CONNECT)
+            continue;
+         if (strncmp(p, placeholders[i].name, placeholders[i].len) == 0)
+            break;
+      }
+      if (placeholders[i].name == NULL) {
+         p++;
+         continue;
+      }
+
+      if (p > text) {
+         t->parts[t->num].token = TOKEN_TEXT;
+         t->parts[t->num].text = text;
+         t->parts[t->num++].len = (size_t) (p - text);
+      }
+      t->parts[t->num++].token = placeholders[i].token;
+      p += placeholders[i].len;
+      text = p;
+   }
+   if (p > text) {
+      t->parts[t->num].token = TOKEN_TEXT;
+      t->parts[t->num].text = text;
+      t->parts[t->num++].len = (size_t) (p - text);
+   }
+
+   return t;
+}
+
+/*
+ * Append len bytes of str to the buffer *buf of *size bytes at *pos,
+ * growing it if needed.
+ */
+static int buf_append(char **buf, size_t *size, size_t *pos,
+                      const char *str, size_t len)
+{
+   char *nbuf;
+   size_t nsize;
+
+   if (*pos + len + 1 > *size) {
+      nsize = *size ? *size : 256;
+      while (*pos + len + 1 > nsize)
+         nsize *= 2;
+      if ((nbuf = realloc(*buf, nsize)) == NULL) {
+         vu_log(VHOSTMD_ERR, "realloc: %m");
          return -1;
       }
+      *buf = nbuf;
+      *size = nsize;
    }
-   
-   for (i=0; i < m->cnt; i++) {
-       n = vu_get_nth_token(m->name, ",", i, m->cnt); 
-       t = vu_get_nth_token(m->type_str, ",", i, m->cnt);
-       v = vu_get_nth_token(m->value, ",", i, m->cnt);
-       u = vu_get_nth_token(m->unit, ",", i, m->cnt);
-       
-       if (m->ctx == METRIC_CONTEXT_HOST) {
-		   vu_buffer_vsprintf(buf, "  <metric type='%s' context='host'", t);
-           if (u && u[0] != '\0')
-               vu_buffer_vsprintf(buf, " unit='%s'", u);
-           vu_buffer_add(buf, ">\n", 2);
-           vu_buffer_vsprintf(buf,
-                              "    <name>%s</name>\n"
-                              "    <value>%s</value>\n"
-                              "  </metric>\n",
-                              n,
-                              v);
-	   }
-	   else {
-		   vu_buffer_vsprintf(buf,
-                              "  <metric type='%s' context='vm' id='%d' uuid='%s'",
-                              t,
-                              m->vm->id,
-                              m->vm->uuid);
-           if (u && u[0] != '\0')
-               vu_buffer_vsprintf(buf, " unit='%s'", u);
-           vu_buffer_add(buf, ">\n", 2);
-           vu_buffer_vsprintf(buf,
-                              "    <name>%s</name>\n"
-                              "    <value>%s</value>\n"
-                              "  </metric>\n",
-                              n,
-                              v);
-	   }
-	   if (n) free(n);
-	   if (t) free(t);
-	   if (v) free(v);
-	   if (u) free(u);
+
+   memcpy(*buf + *pos, str, len);
+   *pos += len;
+   (*buf)[*pos] = '\0';
+   return 0;
+}
+
+/*
+ * Expand template t for VM vm at *pos of the buffer *buf, followed by
+ * a NUL.  CONNECT expands to "--connect 'uri'", or nothing.
+ */
+static int template_expand(const action_template *t, const vu_vm *vm,
+                           char **buf, size_t *size, size_t *pos)
+{
+   char id[16];
+   const char *str;
+   size_t len;
+   int i;
+
+   if (buf_append(buf, size, pos, "", 0))
+      return -1;
+
+   for (i = 0; i < t->num; i++) {
+      const action_part *part = &t->parts[i];
+
+      switch (part->token) {
+         case TOKEN_TEXT:
+            str = part->text;
+            len = part->len;
+            break;
+         case TOKEN_CONNECT:
+            if (libvirt_uri == NULL)
+               continue;
+            if (buf_append(buf, size, pos, "--connect '", 11) ||
+                buf_append(buf, size, pos, libvirt_uri, strlen(libvirt_uri)))
+               return -1;
+            str = "'";
+            len = 1;
+            break;
+         case TOKEN_NAME:
+            str = vm->name ? vm->name : "";
+            len = strlen(str);
+            break;
+         case TOKEN_VMID:
+            len = (size_t) snprintf(id, sizeof(id), "%d", vm->id);
+            str = id;
+            break;
+         case TOKEN_UUID:
+            str = vm->uuid;
+            len = strlen(str);
+            break;
+         default:
+            continue;
+      }
+      if (buf_append(buf, size, pos, str, len))
+         return -1;
+   }
+
+   return 0;
+}
+
+/* Expansion buffers of a worker thread */
+typedef struct _action_buffers {
+   char *cmd;
+   size_t cmd_size;
+   char *args;                  /* the arguments, NUL separated */
+   size_t args_size;
+   char **argv;
+   size_t argv_size;
+} action_buffers;
+
+static pthread_key_t buffers_key;
+static pthread_once_t buffers_once = PTHREAD_ONCE_INIT;
+
+static void buffers_free(void *arg)
+{
+   action_buffers *b = arg;
+
+   free(b->cmd);
+   free(b->args);
+   free(b->argv);
+   free(b);
+}
+
+static void buffers_key_create(void)
+{
+   pthread_key_create(&buffers_key, buffers_free);
+}
+
+static action_buffers *buffers_get(void)
+{
+   action_buffers *b;
+
+   pthread_once(&buffers_once, buffers_key_create);
+   if ((b = pthread_getspecific(buffers_key)) == NULL) {
+      if ((b = calloc(1, sizeof(action_buffers))) == NULL)
+         return NULL;
+      pthread_setspecific(buffers_key, b);
+   }
+
+   return b;
+}
+
+/*
+ * Expand the metric's action for running it by the shell.  The result
+ * is valid until the thread's next call.
+ */
+static const char *metric_action_expand(metric *m)
+{
+   action_buffers *b;
+   size_t len = 0;
+
+   if ((b = buffers_get()) == NULL ||
+       template_expand(m->tmpl, m->vm, &b->cmd, &b->cmd_size, &len))
+      return NULL;
+
+   return b->cmd;
+}
+
+int metric_coprocess_create(metric *m)
+{
+   action_template *t;
+   char *cmd = NULL;
+   size_t size = 0, len = 0;
+
+   /* VM details are passed in the request lines */
+   if ((t = template_compile(m->info->action, 0)) == NULL)
+      return -1;
+   if (template_expand(t, NULL, &cmd, &size, &len)) {
+      template_free(t);
+      free(cmd);
+      return -1;
+   }
+   template_free(t);
+
+   m->cp = coprocess_new(cmd);
+   free(cmd);
+   if (m->cp == NULL) {
+      vu_log(VHOSTMD_ERR, "Failed to create co-process for metric %s",
+             m->info->name);
+      return -1;
    }
 
    return 0;
 }
+
+/* seconds to wait for a co-process without a timeout set */
+#define COPROCESS_DEF_TIMEOUT 10
+#define COPROCESS_REPLY_MAX   4096
+
+/*
+ * Ask the metric's co-process for a value.  The request line is
+ * "host" for host metrics and "vm VMID UUID NAME" for vm metrics.
+ */
+static int metric_value_coprocess(metric *m)
+{
+   char req[512];
+   char *reply;
+   int rc;
+
+   if (m->ctx == METRIC_CONTEXT_VM)
+      snprintf(req, sizeof(req), "vm %d %s %s\n", m->vm->id, m->vm->uuid,
+               m->vm->name ? m->vm->name : "");
+   else
+      snprintf(req, sizeof(req), "host\n");
+
+   /* keep the last value until a new one has been read */
+   if ((reply = calloc(1, COPROCESS_REPLY_MAX)) == NULL)
+      return -1;
+
+   /* a co-process must always reply eventually */
+   rc = coprocess_request(m->cp, req, reply, COPROCESS_REPLY_MAX,
+                          (m->timeout ? m->timeout : COPROCESS_DEF_TIMEOUT) * 1000);
+   if (rc) {
+      free(reply);
+      return rc == COPROCESS_TIMEOUT ? METRIC_TIMEOUT : rc;
+   }
+
+   metric_value_take(m, reply, COPROCESS_REPLY_MAX);
+   return 0;
+}
+
+/*
+ * Results of command actions, keyed by the substituted command.  Metrics
+ * running the same command share one result per update, or for the
+ * metric's ttl.  A result being produced is flagged pending; other
+ * threads asking for it wait for it instead of running the command too.
+ *
+ * The output of actions run for all VMs is split into "uuid,value" lines
+ * once, sorted by UUID, and each VM looks up its own line.
+ */
+#define RESULT_BUCKETS 1024
+
+typedef struct _batch_line {
+   const char *uuid;
+   const char *value;
+} batch_line;
+
+typedef struct _action_result {
+   char *cmd;
+   char *output;
+   char *batch;                 /* copy of output split into lines */
+   batch_line *lines;
+   int num_lines;
+   int status;
+   int pending;
+   unsigned long update;        /* update the result was produced in */
+   time_t taken;                /* when it was produced */
+   int ttl;                     /* longest ttl of the metrics using it */
+   struct _action_result *next;
+} action_result;
+
+static action_result *results[RESULT_BUCKETS];
+static unsigned long results_update = 0;
+static pthread_mutex_t results_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t results_done = PTHREAD_COND_INITIALIZER;
+
+static time_t monotonic_time(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec;
+}
+
+static unsigned int result_hash(const char *cmd)
+{
+   unsigned int h = 2166136261U;
+
+   while (*cmd) {
+      h ^= (unsigned char) *cmd++;
+      h *= 16777619U;
+   }
+
+   return h % RESULT_BUCKETS;
+}
+
+static void result_free(action_result *r)
+{
+   free(r->cmd);
+   free(r->output);
+   free(r->batch);
+   free(r->lines);
+   free(r);
+}
+
+static int batch_line_cmp(const void *a, const void *b)
+{
+   return strcasecmp(((const batch_line *) a)->uuid,
+                     ((const batch_line *) b)->uuid);
+}
+
+/*
+ * Split the output of an action run for all VMs into its lines.
+ * Lines without a comma are ignored.  Returns 0 on success.
+ */
+static int result_index(action_result *r)
+{
+   char *p, *nl, *comma;
+   int n = 0;
+
+   if ((r->batch = strdup(r->output)) == NULL)
+      return -1;
+
+   for (p = r->batch; *p; p++)
+      if (*p == '\n')
+         n++;
+   if ((r->lines = calloc((size_t) n + 1, sizeof(batch_line))) == NULL) {
+      free(r->batch);
+      r->batch = NULL;
+      return -1;
+   }
+
+   for (p = r->batch; *p; p = nl) {
+      if ((nl = strchr(p, '\n')))
+         *nl++ = '\0';
+      else
+         nl = p + strlen(p);
+
+      if ((comma = strchr(p, ',')) == NULL)
+         continue;
+      *comma = '\0';
+      r->lines[r->num_lines].uuid = p;
+      r->lines[r->num_lines].value = comma + 1;
+      r->num_lines++;
+   }
+
+   qsort(r->lines, (size_t) r->num_lines, sizeof(batch_line), batch_line_cmp);
+   return 0;
+}
+
+/*
+ * Copy the value of result r for metric m: the whole output, or the
+ * line of m's VM for actions run for all VMs.  Called with results_lock
+ * held.
+ */
+static int result_value(metric *m, action_result *r)
+{
+   batch_line key, *line;
+
+   /* a successful run without output ran out of memory saving it */
+   if (r->output == NULL)
+      return r->status ? r->status : -1;
+
+   if (!m->all_vms) {
+      metric_value_take(m, strdup(r->output), strlen(r->output) + 1);
+      return m->value ? r->status : -1;
+   }
+
+   if (r->status)
+      return r->status;
+
+   if (r->lines == NULL && result_index(r)) {
+      vu_log(VHOSTMD_ERR, "Unable to allocate memory");
+      return -1;
+   }
+
+   key.uuid = m->vm->uuid;
+   line = bsearch(&key, r->lines, (size_t) r->num_lines, sizeof(batch_line),
+                  batch_line_cmp);
+   if (line == NULL) {
+      vu_log(VHOSTMD_ERR, "No value for VM %s in the output of metric %s",
+             m->vm->uuid, m->info->name);
+      return -1;
+   }
+
+   metric_value_take(m, strdup(line->value), strlen(line->value) + 1);
+   return m->value ? 0 : -1;
+}
+
+void metric_results_expire(void)
+{
+   action_result **rp, *r;
+   time_t now = monotonic_time();
+   int i;
+
+   pthread_mutex_lock(&results_lock);
+   results_update++;
+
+   for (i = 0; i < RESULT_BUCKETS; i++) {
+      rp = &results[i];
+      while ((r = *rp)) {
+         if (!r->pending && r->taken + r->ttl <= now) {
+            *rp = r->next;
+            result_free(r);
+         }
+         else
+            rp = &r->next;
+      }
+   }
+   pthread_mutex_unlock(&results_lock);
+}
+
+void metric_results_free(void)
+{
+   action_result *r;
+   int i;
+
+   pthread_mutex_lock(&results_lock);
+   for (i = 0; i < RESULT_BUCKETS; i++) {
+      while ((r = results[i])) {
+         results[i] = r->next;
+         result_free(r);
+      }
+   }
+   pthread_mutex_unlock(&results_lock);
+}
+
+/*
+ * Command actions are started with posix_spawn(), which avoids copying
+ * the daemon's address space.  Actions without shell syntax are split
+ * into arguments when the configuration is read and executed directly;
+ * all others are run by /bin/sh -c.
+ */
+
+#define ACTION_OUTPUT_MAX (1024 * 1024)
+
+/* characters that need a shell to be interpreted */
+static const char shell_chars[] = "|&;<>()$`\\\"'*?[#~=";
+
+extern char **environ;
+
+static void templates_free(action_template **tmpls)
+{
+   int i;
+
+   if (tmpls == NULL)
+      return;
+   for (i = 0; tmpls[i]; i++)
+      template_free(tmpls[i]);
+   free(tmpls);
+}
+
+int metric_action_prepare(metric *m)
+{
+   const char *p = m->info->action;
+   action_template **argv;
+   char *arg;
+   int vm_tokens = m->ctx == METRIC_CONTEXT_VM && !m->all_vms;
+   size_t n = 0, len;
+
+   if ((m->tmpl = template_compile(m->info->action, vm_tokens)) == NULL)
+      return -1;
+
+   if (strpbrk(m->info->action, shell_chars))
+      return 0;
+
+   /* at most one argument per two characters */
+   argv = calloc(strlen(m->info->action) / 2 + 2, sizeof(action_template *));
+   if (argv == NULL) {
+      vu_log(VHOSTMD_ERR, "calloc: %m");
+      return -1;
+   }
+
+   for (;;) {
+      p += strspn(p, " \t\n\r");
+      if (*p == '\0')
+         break;
+      len = strcspn(p, " \t\n\r");
+
+      /* CONNECT expands to two arguments, or none */
+      if (strncmp(p, "CONNECT", len) != 0 && memmem(p, len, "CONNECT", 7)) {
+         templates_free(argv);
+         return 0;
+      }
+      if ((arg = strndup(p, len)) == NULL) {
+         vu_log(VHOSTMD_ERR, "strndup: %m");
+         templates_free(argv);
+         return -1;
+      }
+      argv[n] = template_compile(arg, vm_tokens);
+      free(arg);
+      if (argv[n++] == NULL) {
+         templates_free(argv);
+         return -1;
+      }
+      p += len;
+   }
+
+   if (n == 0) {
+      templates_free(argv);
+      return 0;
+   }
+
+   m->argv = argv;
+   return 0;
+}
+
+void metric_action_free(metric *m)
+{
+   template_free(m->tmpl);
+   templates_free(m->argv);
+   coprocess_free(m->cp);
+   m->tmpl = NULL;
+   m->argv = NULL;
+   m->cp = NULL;
+}
+
+/*
+ * Expand the prepared arguments of metric m into the thread's buffers.
+ * Returns the arguments to run, valid until the thread's next call,
+ * NULL on failure.
+ */
+static char **metric_argv_expand(metric *m)
+{
+   action_buffers *b;
+   char *arg;
+   size_t len = 0;
+   size_t n = 0, i, k;
+
+   if ((b = buffers_get()) == NULL)
+      return NULL;
+
+   /* the arguments follow each other in b->args, NUL terminated */
+   for (i = 0; m->argv[i]; i++) {
+      const action_template *t = m->argv[i];
+
+      if (n + 3 > b->argv_size) {
+         size_t size = b->argv_size ? b->argv_size * 2 : 16;
+         char **argv = realloc(b->argv, size * sizeof(char *));
+
+         if (argv == NULL)
+            return NULL;
+         b->argv = argv;
+         b->argv_size = size;
+      }
+
+      if (t->num == 1 && t->parts[0].token == TOKEN_CONNECT) {
+         if (libvirt_uri == NULL)
+            continue;
+         if (buf_append(&b->args, &b->args_size, &len, "--connect", 9))
+            return NULL;
+         len++;
+         if (buf_append(&b->args, &b->args_size, &len, libvirt_uri,
+                        strlen(libvirt_uri)))
+            return NULL;
+         len++;
+         n += 2;
+         continue;
+      }
+
+      if (template_expand(t, m->vm, &b->args, &b->args_size, &len))
+         return NULL;
+      len++;
+      n++;
+   }
+
+   /* the buffer may have moved while growing, point into it only now */
+   arg = b->args;
+   for (k = 0; k < n; k++) {
+      b->argv[k] = arg;
+      arg += strlen(arg) + 1;
+   }
+   b->argv[n] = NULL;
+
+   return b->argv;
+}
+
+/*
+ * Start argv, or /bin/sh -c cmd if argv is NULL, with its stdout
+ * connected to a pipe.  Returns the read end of the pipe, -1 on failure.
+ */
+static int action_spawn(char **argv, const char *cmd, pid_t *pid)
+{
+   posix_spawn_file_actions_t actions;
+   posix_spawnattr_t attr;
+   char *sh_argv[] = { "sh", "-c", (char *) cmd, NULL };
+   sigset_t none;
+   int fds[2];
+   int rc;
+
+   if (pipe2(fds, O_CLOEXEC) == -1) {
+      vu_log(VHOSTMD_ERR, "pipe: %m");
+      return -1;
+   }
+
+   posix_spawn_file_actions_init(&actions);
+   posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+
+   /* worker threads block all signals, don't pass that on */
+   sigemptyset(&none);
+   posix_spawnattr_init(&attr);
+   posix_spawnattr_setsigmask(&attr, &none);
+
+   /* own process group, so a pipeline can be killed as a whole */
+   posix_spawnattr_setpgroup(&attr, 0);
+   posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK |
+                            POSIX_SPAWN_SETPGROUP);
+
+   if (argv)
+      rc = posix_spawnp(pid, argv[0], &actions, &attr, argv, environ);
+   else
+      rc = posix_spawn(pid, "/bin/sh", &actions, &attr, sh_argv, environ);
+
+   posix_spawnattr_destroy(&attr);
+   posix_spawn_file_actions_destroy(&actions);
+   close(fds[1]);
+
+   if (rc != 0) {
+      vu_log(VHOSTMD_ERR, "Command failed: %s: %s", argv ? argv[0] : cmd,
+             strerror(rc));
+      close(fds[0]);
+      return -1;
+   }
+
+   return fds[0];
+}
+
+static long ms_until(const struct timespec *deadline)
+{
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (deadline->tv_sec - now.tv_sec) * 1000 +
+          (deadline->tv_nsec - now.tv_nsec) / 1000000;
+}
+
+/*
+ * Read all output of a command into a new buffer, giving up after
+ * timeout seconds unless timeout is 0.  *timed_out is set if the
+ * deadline passed.
+ */
+static char *action_read(int fd, size_t *size, const char *cmd, int timeout,
+                         int *timed_out)
+{
+   struct timespec deadline;
+   struct pollfd pfd;
+   char *buf = NULL, *tmp;
+   size_t len = 0;
+   ssize_t n;
+   long left;
+   int rc;
+
+   *timed_out = 0;
+   *size = 256;
+   if ((buf = malloc(*size)) == NULL)
+      return NULL;
+
+   clock_gettime(CLOCK_MONOTONIC, &deadline);
+   deadline.tv_sec += timeout;
+
+   for (;;) {
+      if (timeout) {
+         if ((left = ms_until(&deadline)) <= 0) {
+            *timed_out = 1;
+            break;
+         }
+         pfd.fd = fd;
+         pfd.events = POLLIN;
+         pfd.revents = 0;
+         rc = poll(&pfd, 1, (int) left);
+         if (rc == -1 && errno != EINTR) {
+            /* without poll the deadline can't be kept, kill the action */
+            vu_log(VHOSTMD_ERR, "Unable to wait for output of '%s': %s",
+                   cmd, strerror(errno));
+            *timed_out = 1;
+            break;
+         }
+         /* read only when there is something to read, never blocking */
+         if (rc <= 0 || pfd.revents == 0)
+            continue;
+      }
+
+      if (len + 1 == *size) {
+         if (*size >= ACTION_OUTPUT_MAX) {
+            vu_log(VHOSTMD_WARN, "Output of '%s' truncated to %d bytes",
+                   cmd, ACTION_OUTPUT_MAX);
+            break;
+         }
+         if ((tmp = realloc(buf, *size * 2)) == NULL)
+            break;
+         buf = tmp;
+         *size *= 2;
+      }
+
+      n = read(fd, &buf[len], *size - len - 1);
+      if (n < 0) {
+         if (errno == EINTR)
+            continue;
+         break;
+      }
+      if (n == 0)
+         break;
+      len += (size_t) n;
+   }
+   buf[len] = '\0';
+
+   return buf;
+}
+
+/*
+ * Run a command action, reading its output into m->value.
+ * Returns the command's wait status.
+ */
+static int metric_action_run(metric *m, const char *cmd)
+{
+   char **argv = NULL;
+   char *out;
+   size_t size;
+   pid_t pid;
+   int fd, status;
+   int timed_out;
+
+   if (m->argv && (argv = metric_argv_expand(m)) == NULL) {
+      vu_log(VHOSTMD_ERR, "Failed action 'KEYWORD' substitution");
+      return -1;
+   }
+
+   fd = action_spawn(argv, cmd, &pid);
+   if (fd == -1)
+      return -1;
+
+   out = action_read(fd, &size, cmd, m->timeout, &timed_out);
+   close(fd);
+
+   if (timed_out) {
+      vu_log(VHOSTMD_ERR, "Action of metric %s did not finish within %d s",
+             m->info->name, m->timeout);
+      kill(-pid, SIGKILL);
+   }
+
+   while (waitpid(pid, &status, 0) == -1) {
+      if (errno != EINTR) {
+         status = -1;
+         break;
+      }
+   }
+
+   if (timed_out) {
+      free(out);
+      return METRIC_TIMEOUT;
+   }
+   if (out == NULL)
+      return -1;
+   metric_value_take(m, out, size);
+
+   return status;
+}
+
+/*
+ * Get the result of cmd for metric m, running the command unless a
+ * result of the current update, or one younger than the metric's ttl,
+ * is available.
+ */
+static int metric_action_result(metric *m, const char *cmd)
+{
+   action_result *r;
+   unsigned int h = result_hash(cmd);
+   int ret;
+
+   pthread_mutex_lock(&results_lock);
+   for (r = results[h]; r; r = r->next)
+      if (strcmp(r->cmd, cmd) == 0)
+         break;
+
+   if (r) {
+      while (r->pending)
+         pthread_cond_wait(&results_done, &results_lock);
+
+      if (r->ttl < m->ttl)
+         r->ttl = m->ttl;
+      if (r->update == results_update ||
+          r->taken + m->ttl > monotonic_time()) {
+         ret = result_value(m, r);
+         pthread_mutex_unlock(&results_lock);
+         return ret;
+      }
+   }
+   else {
+      if ((r = calloc(1, sizeof(action_result))) == NULL ||
+          (r->cmd = strdup(cmd)) == NULL) {
+         free(r);
+         pthread_mutex_unlock(&results_lock);
+         /* the output of all VMs can't be shared without a result */
+         if (m->all_vms)
+            return -1;
+         return metric_action_run(m, cmd);
+      }
+      r->ttl = m->ttl;
+      r->next = results[h];
+      results[h] = r;
+   }
+   r->pending = 1;
+   pthread_mutex_unlock(&results_lock);
+
+   ret = metric_action_run(m, cmd);
+
+   pthread_mutex_lock(&results_lock);
+   free(r->output);
+   free(r->batch);
+   free(r->lines);
+   r->batch = NULL;
+   r->lines = NULL;
+   r->num_lines = 0;
+   /* m->value is only this run's output if the run succeeded */
+   r->output = (ret == 0 && m->value) ? strdup(m->value) : NULL;
+   r->status = ret;
+   r->update = results_update;
+   r->taken = monotonic_time();
+   r->pending = 0;
+   pthread_cond_broadcast(&results_done);
+   if (m->all_vms && ret != METRIC_TIMEOUT)
+      ret = result_value(m, r);
+   pthread_mutex_unlock(&results_lock);
+
+   return ret;
+}
+
+/*
+ * Apply the metric's timeout fallback.  prev is the status of the
+ * previous collection.
+ */
+static int metric_timeout_fallback(metric *m, int prev)
+{
+   if (m->on_timeout == METRIC_FALLBACK_OMIT || prev || m->value == NULL)
+      return METRIC_TIMEOUT;
+
+   if (m->on_timeout == METRIC_FALLBACK_STALE)
+      m->stale = 1;
+   return 0;
+}
+
+/*
+ * Increase of a counter from prev to cur.  A counter that went down
+ * wrapped around if prev was in the upper half of its 32 or 64 bit
+ * range, otherwise it was reset and has counted up from zero since.
+ */
+static unsigned long long counter_delta(unsigned long long prev,
+                                        unsigned long long cur)
+{
+   if (cur >= prev || prev > (ULLONG_MAX >> 1))
+      return cur - prev;
+
+   if (prev > (UINT32_MAX >> 1) && prev <= UINT32_MAX)
+      return cur + ((unsigned long long) UINT32_MAX + 1) - prev;
+
+   return cur;
+}
+
+/*
+ * Replace the counter values of a metric with their rate per second
+ * since the previous sample.  Values of integer types are rounded.
+ */
+static int metric_counter_rate(metric *m)
+{
+   unsigned long long cur[m->cnt];
+   struct timespec now;
+   vu_buffer *buf = NULL;
+   metric_type type;
+   double secs, rate;
+   char *p, *end;
+   int i;
+
+   p = m->value;
+   for (i = 0; i < m->cnt; i++) {
+      while (*p == ' ' || *p == '\t' || (i > 0 && *p == ','))
+         p++;
+      errno = 0;
+      cur[i] = strtoull(p, &end, 10);
+      if (*p == '-' || errno || end == p) {
+         vu_log(VHOSTMD_ERR, "Metric %s: invalid counter value '%s'",
+                m->info->name, m->value);
+         return -1;
+      }
+      p = end;
+   }
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+
+   /* the first sample only sets the start */
+   if (m->samples == NULL) {
+      if ((m->samples = calloc((size_t) m->cnt, sizeof(*m->samples))) == NULL)
+         return -1;
+      memcpy(m->samples, cur, sizeof(cur));
+      m->sample_time = now;
+      return METRIC_NO_RATE;
+   }
+
+   secs = (double) (now.tv_sec - m->sample_time.tv_sec) +
+          (double) (now.tv_nsec - m->sample_time.tv_nsec) / 1e9;
+   if (secs <= 0)
+      return METRIC_NO_RATE;
+
+   if (vu_buffer_create(&buf, 256))
+      return -1;
+
+   for (i = 0; i < m->cnt; i++) {
+      rate = (double) counter_delta(m->samples[i], cur[i]) / secs;
+      type = m->info->vars[i].type;
+      if (type == M_REAL32 || type == M_REAL64)
+         vu_buffer_vsprintf(buf, "%s%f", i ? "," : "", rate);
+      else
+         vu_buffer_vsprintf(buf, "%s%.0f", i ? "," : "", rate);
+   }
+
+   metric_value_take(m, buf->content, buf->size);
+   buf->content = NULL;
+   vu_buffer_delete(buf);
+
+   memcpy(m->samples, cur, sizeof(cur));
+   m->sample_time = now;
+   return 0;
+}
+
+int metric_value_get(metric *m)
+{
+   int ret = -1;
+   int prev = m->status;
+   const char *cmd;
+   
+   if (m->pf)
+      ret = m->pf(m);
+   else if (m->cp)
+      ret = metric_value_coprocess(m);
+   else {
+      if ((cmd = metric_action_expand(m)) == NULL) {
+         vu_log(VHOSTMD_ERR, "Failed action 'KEYWORD' substitution");
+         m->status = ret;
+         return ret;
+      }
+
+      ret = metric_action_result(m, cmd);
+   }
+
+   m->stale = 0;
+   if (ret == 0 && m->kind == METRIC_KIND_COUNTER)
+      ret = metric_counter_rate(m);
+   else if (ret == METRIC_TIMEOUT)
+      ret = metric_timeout_fallback(m, prev);
+   if (ret == 0 && !m->stale)
+      ret = metric_value_parse(m);
+   m->status = ret;
+   
+   return ret;
+}
+
+static int metric_xml_prepare(metric *m)
+{
+   vu_buffer *buf;
+   metric_var *var;
+   int i;
+
+   if (vu_buffer_create(&buf, 128))
+      return -1;
+
+   for (i = 0; i < m->cnt; i++) {
+      var = &m->info->vars[i];
+
+      vu_buffer_erase(buf);
+      vu_buffer_add(buf, "  <metric type='", -1);
+      vu_buffer_add_escaped(buf, var->type_str, -1);
+      if (m->ctx == METRIC_CONTEXT_HOST)
+         vu_buffer_add(buf, "' context='host'", -1);
+      else
+         vu_buffer_add(buf, "' context='vm'", -1);
+      var->xml_open = (int) buf->use;
+
+      if (var->unit && var->unit[0] != '\0') {
+         vu_buffer_add(buf, " unit='", -1);
+         vu_buffer_add_escaped(buf, var->unit, -1);
+         vu_buffer_add(buf, "'", 1);
+      }
+      var->xml_unit = (int) buf->use - var->xml_open;
+
+      vu_buffer_add(buf, ">\n"
+                         "    <name>", -1);
+      vu_buffer_add_escaped(buf, var->name, -1);
+      vu_buffer_add(buf, "</name>\n"
+                         "    <value>", -1);
+
+      free(var->xml);
+      if ((var->xml = strndup(buf->content, buf->use)) == NULL) {
+         vu_buffer_delete(buf);
+         return -1;
+      }
+      var->xml_len = (int) buf->use;
+   }
+
+   vu_buffer_delete(buf);
+   return 0;
+}
+
+/* The metric elements returned by an xml metric are passed on as they are */
+static int metric_xml_value(metric *m, vu_buffer *buf)
+{
+   if (m->value == NULL)
+      return -1;
+   if (validate_metric_xml_value(m->value)) {
+      vu_buffer_add(buf, m->value, strlen(m->value));
+      return 0;
+   } else  {
+      vu_log(VHOSTMD_WARN, "Validation of XML returned by metric %s failed",
+             m->info->name);
+      return -1;
+   }
+}
+
+static int metric_xml(metric *m, vu_buffer *buf)
+{
+   const metric_var *var;
+   int i, n = 0;
+
+   /* nothing to report until a counter has two samples */
+   if (m->status == METRIC_NO_RATE || m->status == METRIC_NO_VALUE)
+      return 0;
+
+   if (m->status)
+      return -1;
+   
+   if (m->type == M_XML)
+      return metric_xml_value(m, buf);
+   
+   if (m->slots == NULL)
+      return -1;
+
+   for (i = 0; i < m->cnt; i++) {
+      if (!m->slots[i].valid)
+         continue;
+      var = &m->info->vars[i];
+      n++;
+
+      vu_buffer_add(buf, var->xml, var->xml_open);
+      if (m->ctx == METRIC_CONTEXT_VM) {
+         vu_buffer_add(buf, " id='", 5);
+         vu_buffer_add_int(buf, m->vm->id);
+         vu_buffer_add(buf, "' uuid='", 8);
+         vu_buffer_add_escaped(buf, m->vm->uuid, -1);
+         vu_buffer_add(buf, "'", 1);
+      }
+      vu_buffer_add(buf, var->xml + var->xml_open, var->xml_unit);
+      if (m->stale)
+         vu_buffer_add(buf, " stale='true'", -1);
+      vu_buffer_add(buf, var->xml + var->xml_open + var->xml_unit,
+                    var->xml_len - var->xml_open - var->xml_unit);
+      slot_format(buf, m, &m->slots[i], var->type, METRIC_FORMAT_XML);
+      vu_buffer_add(buf, "</value>\n"
+                         "  </metric>\n", -1);
+   }
+
+   return n ? 0 : -1;
+}
+
+static void metric_xml_comment(vu_buffer *buf, const char *text)
+{
+   vu_buffer_add(buf, "<!-- ", 5);
+   vu_buffer_add(buf, text, -1);
+   vu_buffer_add(buf, " -->", 4);
+}
+
+/*
+ * Version 2 of the XML schema leaves out what the structure of the
+ * document already tells: host metrics are children of the metrics
+ * element, the metrics of a VM are children of its vm element, which
+ * carries id, uuid and name.  One line per variable:
+ *
+ *   <metrics version='2'>
+ *     <metric type='T' unit='U'><name>N</name><value>V</value></metric>
+ *     <vm id='1' uuid='U' name='N'>
+ *       <metric type='T' stale='true'><name>N</name><value>V</value></metric>
+ *     </vm>
+ *   </metrics>
+ */
+static int metric_xml2_prepare(metric *m)
+{
+   vu_buffer *buf;
+   metric_var *var;
+   int i;
+
+   if (vu_buffer_create(&buf, 128))
+      return -1;
+
+   for (i = 0; i < m->cnt; i++) {
+      var = &m->info->vars[i];
+
+      vu_buffer_erase(buf);
+      if (m->ctx == METRIC_CONTEXT_HOST)
+         vu_buffer_add(buf, "  <metric type='", -1);
+      else
+         vu_buffer_add(buf, "    <metric type='", -1);
+      vu_buffer_add_escaped(buf, var->type_str, -1);
+      vu_buffer_add(buf, "'", 1);
+      if (var->unit && var->unit[0] != '\0') {
+         vu_buffer_add(buf, " unit='", -1);
+         vu_buffer_add_escaped(buf, var->unit, -1);
+         vu_buffer_add(buf, "'", 1);
+      }
+      var->xml2_open = (int) buf->use;
+
+      vu_buffer_add(buf, "><name>", -1);
+      vu_buffer_add_escaped(buf, var->name, -1);
+      vu_buffer_add(buf, "</name><value>", -1);
+
+      free(var->xml2);
+      if ((var->xml2 = strndup(buf->content, buf->use)) == NULL) {
+         vu_buffer_delete(buf);
+         return -1;
+      }
+      var->xml2_len = (int) buf->use;
+   }
+
+   vu_buffer_delete(buf);
+   return 0;
+}
+
+static int metric_xml2(metric *m, vu_buffer *buf)
+{
+   const metric_var *var;
+   int i, n = 0;
+
+   if (m->status == METRIC_NO_RATE || m->status == METRIC_NO_VALUE)
+      return 0;
+
+   if (m->status)
+      return -1;
+
+   if (m->type == M_XML)
+      return metric_xml_value(m, buf);
+
+   if (m->slots == NULL)
+      return -1;
+
+   for (i = 0; i < m->cnt; i++) {
+      if (!m->slots[i].valid)
+         continue;
+      var = &m->info->vars[i];
+      n++;
+
+      vu_buffer_add(buf, var->xml2, var->xml2_open);
+      if (m->stale)
+         vu_buffer_add(buf, " stale='true'", -1);
+      vu_buffer_add(buf, var->xml2 + var->xml2_open,
+                    var->xml2_len - var->xml2_open);
+      slot_format(buf, m, &m->slots[i], var->type, METRIC_FORMAT_XML2);
+      vu_buffer_add(buf, "</value></metric>\n", -1);
+   }
+
+   return n ? 0 : -1;
+}
+
+static void metric_xml2_vm_head(vu_buffer *buf, const vu_vm *vm)
+{
+   vu_buffer_add(buf, "  <vm id='", -1);
+   vu_buffer_add_int(buf, vm->id);
+   vu_buffer_add(buf, "' uuid='", 8);
+   vu_buffer_add_escaped(buf, vm->uuid, -1);
+   vu_buffer_add(buf, "' name='", 8);
+   vu_buffer_add_escaped(buf, vm->name, -1);
+   vu_buffer_add(buf, "'>\n", 3);
+}
+
+/*
+ * A JSON document is an object with the array "metrics", one object
+ * per line for each variable:
+ *
+ *   {"name":"N","type":"T","context":"vm","unit":"U","id":1,
+ *    "uuid":"U","stale":true,"value":V}
+ *
+ * unit, id, uuid and stale are only present if they apply.  The value
+ * is a number, or a string for strings and xml metrics; a real that is
+ * not finite is null.
+ */
+static int metric_json_prepare(metric *m)
+{
+   vu_buffer *buf;
+   metric_var *var;
+   int i;
+
+   if (vu_buffer_create(&buf, 128))
+      return -1;
+
+   for (i = 0; i < m->cnt; i++) {
+      var = &m->info->vars[i];
+
+      vu_buffer_erase(buf);
+      vu_buffer_add(buf, "{\"name\":\"", -1);
+      vu_buffer_add_json(buf, var->name, -1);
+      vu_buffer_add(buf, "\",\"type\":\"", -1);
+      vu_buffer_add_json(buf, var->type_str, -1);
+      if (m->ctx == METRIC_CONTEXT_HOST)
+         vu_buffer_add(buf, "\",\"context\":\"host\"", -1);
+      else
+         vu_buffer_add(buf, "\",\"context\":\"vm\"", -1);
+      if (var->unit && var->unit[0] != '\0') {
+         vu_buffer_add(buf, ",\"unit\":\"", -1);
+         vu_buffer_add_json(buf, var->unit, -1);
+         vu_buffer_add(buf, "\"", 1);
+      }
+
+      free(var->json);
+      if ((var->json = strndup(buf->content, buf->use)) == NULL) {
+         vu_buffer_delete(buf);
+         return -1;
+      }
+      var->json_len = (int) buf->use;
+   }
+
+   vu_buffer_delete(buf);
+   return 0;
+}
+
+/* Append the object of variable var up to its value */
+static void metric_json_open(metric *m, const metric_var *var, vu_buffer *buf)
+{
+   /* buf starts empty, anything before is an earlier variable's object */
+   if (buf->use)
+      vu_buffer_add(buf, ",\n", 2);
+   vu_buffer_add(buf, var->json, var->json_len);
+   if (m->ctx == METRIC_CONTEXT_VM) {
+      vu_buffer_add(buf, ",\"id\":", 6);
+      vu_buffer_add_int(buf, m->vm->id);
+      vu_buffer_add(buf, ",\"uuid\":\"", 9);
+      vu_buffer_add_json(buf, m->vm->uuid, -1);
+      vu_buffer_add(buf, "\"", 1);
+   }
+   if (m->stale)
+      vu_buffer_add(buf, ",\"stale\":true", -1);
+   vu_buffer_add(buf, ",\"value\":", 9);
+}
+
+static int metric_json(metric *m, vu_buffer *buf)
+{
+   const metric_var *var;
+   int i, n = 0;
+
+   if (m->status == METRIC_NO_RATE || m->status == METRIC_NO_VALUE)
+      return 0;
+
+   if (m->status)
+      return -1;
+
+   /* the elements of xml metrics are passed on as a string */
+   if (m->type == M_XML) {
+      if (m->value == NULL)
+         return -1;
+      if (!validate_metric_xml_value(m->value)) {
+         vu_log(VHOSTMD_WARN, "Validation of XML returned by metric %s failed",
+                m->info->name);
+         return -1;
+      }
+      metric_json_open(m, &m->info->vars[0], buf);
+      vu_buffer_add(buf, "\"", 1);
+      vu_buffer_add_json(buf, m->value, -1);
+      vu_buffer_add(buf, "\"}", 2);
+      return 0;
+   }
+
+   if (m->slots == NULL)
+      return -1;
+
+   for (i = 0; i < m->cnt; i++) {
+      if (!m->slots[i].valid)
+         continue;
+      var = &m->info->vars[i];
+      n++;
+
+      metric_json_open(m, var, buf);
+      slot_format(buf, m, &m->slots[i], var->type, METRIC_FORMAT_JSON);
+      vu_buffer_add(buf, "}", 1);
+   }
+
+   return n ? 0 : -1;
+}
+
+static const metric_serializer serializers[METRIC_FORMAT_COUNT] = {
+   [METRIC_FORMAT_XML] = {
+      .name = "xml",
+      .head = "<metrics>\n",
+      .sep = "",
+      .tail = "</metrics>\n",
+      .prepare = metric_xml_prepare,
+      .format = metric_xml,
+      .comment = metric_xml_comment,
+   },
+   [METRIC_FORMAT_JSON] = {
+      .name = "json",
+      .head = "{\"metrics\":[\n",
+      .sep = ",\n",
+      .tail = "\n]}\n",
+      .prepare = metric_json_prepare,
+      .format = metric_json,
+      .comment = NULL,
+   },
+   [METRIC_FORMAT_XML2] = {
+      .name = "xml2",
+      .head = "<metrics version='2'>\n",
+      .sep = "",
+      .tail = "</metrics>\n",
+      .prepare = metric_xml2_prepare,
+      .format = metric_xml2,
+      .comment = metric_xml_comment,
+      .vm_head = metric_xml2_vm_head,
+      .vm_tail = "  </vm>\n",
+   },
+};
+
+const metric_serializer *metric_serializer_get(metric_format f)
+{
+   return &serializers[f];
+}
+
+int metric_format_from_str(const char *name, metric_format *f)
+{
+   int i;
+
+   for (i = 0; i < METRIC_FORMAT_COUNT; i++) {
+      if (strcasecmp(name, serializers[i].name) == 0) {
+         *f = (metric_format) i;
+         return 0;
+      }
+   }
+   return -1;
+}
+
+void metric_fragment_add(const metric_serializer *s, vu_buffer *doc,
+                         const vu_buffer *frag, int *n)
+{
+   if (frag->use == 0)
+      return;
+   if ((*n)++)
+      vu_buffer_add(doc, s->sep, -1);
+   vu_buffer_add(doc, frag->content, frag->use);
+}
+
+int metric_serializers_prepare(metric *m)
+{
+   int i;
+
+   for (i = 0; i < METRIC_FORMAT_COUNT; i++) {
+      if (serializers[i].prepare(m))
+         return -1;
+   }
+   return 0;
+}
+
+/*
+ * The output of a metric is kept for each format together with the
+ * hash of what it was rendered from, so an update only renders the
+ * metrics whose value changed and copies the others.
+ */
+struct _metric_cache {
+   vu_buffer *buf;
+   uint64_t hash;
+   int ret;
+   int valid;
+};
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME  1099511628211ULL
+
+static uint64_t hash_add(uint64_t h, const void *data, size_t len)
+{
+   const unsigned char *p = data;
+   size_t i;
+
+   for (i = 0; i < len; i++) {
+      h ^= p[i];
+      h *= FNV_PRIME;
+   }
+   return h;
+}
+
+uint64_t metric_output_hash(const metric *m)
+{
+   uint64_t h = FNV_OFFSET;
+   const metric_slot *s;
+   int i;
+
+   h = hash_add(h, &m->status, sizeof(m->status));
+   h = hash_add(h, &m->stale, sizeof(m->stale));
+   if (m->vm)
+      h = hash_add(h, &m->vm->id, sizeof(m->vm->id));
+
+   /* derived metrics have slots only, xml metrics text only */
+   if (m->type == M_XML) {
+      if (m->value)
+         h = hash_add(h, m->value, strlen(m->value));
+      return h;
+   }
+   if (m->slots == NULL)
+      return h;
+
+   for (i = 0; i < m->cnt; i++) {
+      s = &m->slots[i];
+      h = hash_add(h, &s->valid, sizeof(s->valid));
+      if (!s->valid)
+         continue;
+      if (m->info->vars[i].type == M_STRING)
+         h = hash_add(h, m->value + s->v.str.off, s->v.str.len);
+      else
+         h = hash_add(h, &s->v, sizeof(s->v));
+   }
+   return h;
+}
+
+int metric_fragment(metric *m, metric_format f, uint64_t hash,
+                    const vu_buffer **frag)
+{
+   metric_cache *c;
+
+   if (m->cache == NULL &&
+       (m->cache = calloc(METRIC_FORMAT_COUNT, sizeof(metric_cache))) == NULL)
+      return -1;
+
+   c = &m->cache[f];
+   if (c->buf == NULL && vu_buffer_create(&c->buf, 128)) {
+      c->buf = NULL;
+      return -1;
+   }
+
+   if (!c->valid || c->hash != hash) {
+      vu_buffer_erase(c->buf);
+      c->ret = serializers[f].format(m, c->buf);
+      if (c->ret)
+         vu_buffer_erase(c->buf);
+      c->hash = hash;
+      c->valid = 1;
+   }
+
+   *frag = c->buf;
+   return c->ret;
+}
+
+void metric_fragments_free(metric *m)
+{
+   int i;
+
+   if (m->cache == NULL)
+      return;
+
+   for (i = 0; i < METRIC_FORMAT_COUNT; i++) {
+      if (m->cache[i].buf)
+         vu_buffer_delete(m->cache[i].buf);
+   }
+   free(m->cache);
+   m->cache = NULL;
+}
@@ -0,0 +1,318 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <dlfcn.h>
+
+#include "util.h"
+#include "metric.h"
+#include "builtin.h"
+#include "plugin.h"
+#include "vhostmd-plugin.h"
+
+/*
+ * Plugins are loaded once at startup, while vhostmd may still run as
+ * root, and stay loaded until exit.  They only see the function table
+ * in vhostmd-plugin.h, never vhostmd's own structures, so a plugin
+ * keeps working across vhostmd versions with the same ABI number.
+ */
+
+#define PLUGIN_LOG_SIZE 1024
+
+typedef struct _plugin {
+   char *path;
+   void *handle;
+   void (*fini)(void);
+   struct _plugin *next;
+} plugin;
+
+typedef struct _plugin_collector {
+   char *name;
+   metric_context ctx;
+   vhostmd_collect_func collect;
+   void *data;
+   plugin *owner;
+   struct _plugin_collector *next;
+} plugin_collector;
+
+static plugin *plugins = NULL;
+static plugin_collector *collectors = NULL;
+static char *plugin_dir = NULL;
+
+/* the plugin whose init function is running */
+static plugin *loading = NULL;
+
+static plugin_collector *collector_find(const char *name, metric_context ctx)
+{
+   plugin_collector *c;
+
+   for (c = collectors; c; c = c->next) {
+      if (c->ctx == ctx && strcmp(c->name, name) == 0)
+         return c;
+   }
+   return NULL;
+}
+
+static int api_register_collector(const char *name, int context,
+                                  vhostmd_collect_func collect, void *data)
+{
+   plugin_collector *c;
+   metric_context ctx;
+
+   if (loading == NULL || name == NULL || collect == NULL)
+      return -1;
+
+   if (context == VHOSTMD_PLUGIN_HOST)
+      ctx = METRIC_CONTEXT_HOST;
+   else if (context == VHOSTMD_PLUGIN_VM)
+      ctx = METRIC_CONTEXT_VM;
+   else {
+      vu_log(VHOSTMD_WARN, "Plugin %s: collector '%s' has an invalid "
+             "context", loading->path, name);
+      return -1;
+   }
+
+   if (builtin_lookup(name, ctx, NULL) || collector_find(name, ctx)) {
+      vu_log(VHOSTMD_WARN, "Plugin %s: collector '%s' is already defined",
+             loading->path, name);
+      return -1;
+   }
+
+   if ((c = calloc(1, sizeof(plugin_collector))) == NULL)
+      return -1;
+   if ((c->name = strdup(name)) == NULL) {
+      free(c);
+      return -1;
+   }
+   c->ctx = ctx;
+   c->collect = collect;
+   c->data = data;
+   c->owner = loading;
+   c->next = collectors;
+   collectors = c;
+
+   vu_log(VHOSTMD_INFO, "Plugin %s: registered %s collector '%s'",
+          loading->path, ctx == METRIC_CONTEXT_HOST ? "host" : "vm", name);
+   return 0;
+}
+
+static int api_sink_printf(vhostmd_sink *sink, const char *fmt, ...)
+{
+   va_list args;
+   int ret;
+
+   va_start(args, fmt);
+   ret = metric_value_vprintf((metric *) sink, fmt, args);
+   va_end(args);
+
+   return ret;
+}
+
+static void api_log(int level, const char *fmt, ...)
+{
+   char msg[PLUGIN_LOG_SIZE];
+   va_list args;
+   int prio;
+
+   va_start(args, fmt);
+   vsnprintf(msg, sizeof(msg), fmt, args);
+   va_end(args);
+
+   switch (level) {
+      case VHOSTMD_PLUGIN_ERR:
+         prio = VHOSTMD_ERR;
+         break;
+      case VHOSTMD_PLUGIN_WARN:
+         prio = VHOSTMD_WARN;
+         break;
+      default:
+         prio = VHOSTMD_INFO;
+         break;
+   }
+   vu_log(prio, "%s", msg);
+}
+
+static const vhostmd_plugin_api plugin_api = {
+   .abi = VHOSTMD_PLUGIN_ABI,
+   .register_collector = api_register_collector,
+   .sink_printf = api_sink_printf,
+   .log = api_log,
+};
+
+/* Drop the collectors a plugin registered before its init failed */
+static void collectors_drop(plugin *p)
+{
+   plugin_collector **cp = &collectors;
+   plugin_collector *c;
+
+   while ((c = *cp) != NULL) {
+      if (c->owner == p) {
+         *cp = c->next;
+         free(c->name);
+         free(c);
+      }
+      else
+         cp = &c->next;
+   }
+}
+
+static void plugin_open(const char *path)
+{
+   const unsigned int *abi;
+   int (*init)(const vhostmd_plugin_api *);
+   plugin *p;
+
+   if ((p = calloc(1, sizeof(plugin))) == NULL ||
+       (p->path = strdup(path)) == NULL) {
+      free(p);
+      return;
+   }
+
+   if ((p->handle = dlopen(path, RTLD_NOW | RTLD_LOCAL)) == NULL) {
+      vu_log(VHOSTMD_WARN, "Unable to load plugin %s: %s", path, dlerror());
+      goto error;
+   }
+
+   abi = dlsym(p->handle, "vhostmd_plugin_abi");
+   *(void **) (&init) = dlsym(p->handle, "vhostmd_plugin_init");
+   if (abi == NULL || init == NULL) {
+      vu_log(VHOSTMD_WARN, "Plugin %s is not a vhostmd plugin", path);
+      goto error;
+   }
+   if (*abi != VHOSTMD_PLUGIN_ABI) {
+      vu_log(VHOSTMD_WARN, "Plugin %s has ABI version %u, vhostmd %u",
+             path, *abi, VHOSTMD_PLUGIN_ABI);
+      goto error;
+   }
+   *(void **) (&p->fini) = dlsym(p->handle, "vhostmd_plugin_fini");
+
+   loading = p;
+   if (init(&plugin_api)) {
+      loading = NULL;
+      vu_log(VHOSTMD_WARN, "Plugin %s failed to initialize", path);
+      collectors_drop(p);
+      goto error;
+   }
+   loading = NULL;
+
+   p->next = plugins;
+   plugins = p;
+   vu_log(VHOSTMD_INFO, "Loaded plugin %s", path);
+   return;
+
+ error:
+   if (p->handle)
+      dlclose(p->handle);
+   free(p->path);
+   free(p);
+}
+
+static int plugin_file(const struct dirent *d)
+{
+   size_t len = strlen(d->d_name);
+
+   return d->d_name[0] != '.' && len > 3 &&
+          strcmp(&d->d_name[len - 3], ".so") == 0;
+}
+
+int plugin_load(const char *dir)
+{
+   struct dirent **names;
+   char path[PATH_MAX];
+   int i, n;
+
+   if (plugin_dir) {
+      if (strcmp(plugin_dir, dir))
+         vu_log(VHOSTMD_WARN, "Plugin directory changed to %s, plugins "
+                "are loaded from %s until restart", dir, plugin_dir);
+      return 0;
+   }
+
+   if ((n = scandir(dir, &names, plugin_file, alphasort)) < 0) {
+      vu_log(VHOSTMD_ERR, "Unable to read plugin directory %s: %s", dir,
+             strerror(errno));
+      return -1;
+   }
+
+   for (i = 0; i < n; i++) {
+      if (snprintf(path, sizeof(path), "%s/%s", dir,
+                   names[i]->d_name) < (int) sizeof(path))
+         plugin_open(path);
+      free(names[i]);
+   }
+   free(names);
+
+   plugin_dir = strdup(dir);
+   return 0;
+}
+
+void plugin_fini(void)
+{
+   plugin *p;
+   plugin_collector *c;
+
+   while ((c = collectors) != NULL) {
+      collectors = c->next;
+      free(c->name);
+      free(c);
+   }
+
+   while ((p = plugins) != NULL) {
+      plugins = p->next;
+      if (p->fini)
+         p->fini();
+      dlclose(p->handle);
+      free(p->path);
+      free(p);
+   }
+
+   free(plugin_dir);
+   plugin_dir = NULL;
+}
+
+static int plugin_collect(void *arg)
+{
+   metric *m = arg;
+   plugin_collector *c = m->pf_data;
+   vhostmd_plugin_vm vm;
+
+   if (m->vm == NULL)
+      return c->collect(c->data, NULL, (vhostmd_sink *) m) ? -1 : 0;
+
+   vm.id = m->vm->id;
+   vm.name = m->vm->name;
+   vm.uuid = m->vm->uuid;
+   return c->collect(c->data, &vm, (vhostmd_sink *) m) ? -1 : 0;
+}
+
+metric_func plugin_lookup(const char *name, metric_context ctx, void **data)
+{
+   plugin_collector *c;
+
+   if ((c = collector_find(name, ctx)) == NULL)
+      return NULL;
+
+   *data = c;
+   return plugin_collect;
+}
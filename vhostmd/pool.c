@@ -0,0 +1,257 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "util.h"
+#include "pool.h"
+
+/*
+ * A fixed set of worker threads executing batches of independent
+ * tasks.  The thread calling pool_run() takes part in the batch, so
+ * a pool of size N starts N - 1 threads.
+ *
+ * The tasks of a batch are split into one contiguous range per thread.
+ * A thread takes tasks from the front of its own range and, once that
+ * is empty, steals from the back of the other threads' ranges, so a
+ * few slow tasks do not hold up the remaining ones.
+ */
+
+typedef struct _pool_queue {
+    pthread_mutex_t lock;
+    int head;
+    int tail;
+} pool_queue;
+
+static pthread_t *workers = NULL;
+static int num_workers = 0;
+static int pool_down = 0;
+
+/* one queue per thread, queues[0] belongs to the caller of pool_run() */
+static pool_queue *queues = NULL;
+static int num_queues = 0;
+
+static pthread_mutex_t pool_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+
+/* current batch, protected by pool_mtx */
+static pool_func task_func = NULL;
+static void **task_args = NULL;
+static unsigned long batch = 0;
+static int task_pending = 0;
+static int threads_active = 0;
+
+static int queue_pop(pool_queue *q)
+{
+    int i = -1;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->head < q->tail)
+        i = q->head++;
+    pthread_mutex_unlock(&q->lock);
+
+    return i;
+}
+
+static int queue_steal(pool_queue *q)
+{
+    int i = -1;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->head < q->tail)
+        i = --q->tail;
+    pthread_mutex_unlock(&q->lock);
+
+    return i;
+}
+
+/*
+ * Run tasks of the current batch until none is left, starting with
+ * the range of thread 'self'.
+ */
+static void pool_drain(int self)
+{
+    int i, v;
+
+    for (;;) {
+        i = queue_pop(&queues[self]);
+        for (v = 1; i == -1 && v <= num_workers; v++)
+            i = queue_steal(&queues[(self + v) % (num_workers + 1)]);
+        if (i == -1)
+            break;
+
+        task_func(task_args[i]);
+
+        pthread_mutex_lock(&pool_mtx);
+        if (--task_pending == 0)
+            pthread_cond_broadcast(&pool_done);
+        pthread_mutex_unlock(&pool_mtx);
+    }
+}
+
+static void *pool_worker(void *arg)
+{
+    int self = (int) (long) arg;
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&pool_mtx);
+    while (!pool_down) {
+        if (seen == batch || task_pending == 0) {
+            pthread_cond_wait(&pool_work, &pool_mtx);
+            continue;
+        }
+        seen = batch;
+        threads_active++;
+        pthread_mutex_unlock(&pool_mtx);
+
+        pool_drain(self);
+
+        pthread_mutex_lock(&pool_mtx);
+        if (--threads_active == 0)
+            pthread_cond_broadcast(&pool_done);
+    }
+    pthread_mutex_unlock(&pool_mtx);
+
+    return NULL;
+}
+
+/*
+ * Start the worker pool.
+ */
+int pool_init(int size)
+{
+    sigset_t all, old;
+    int i, rc;
+
+    if (size <= 1)
+        return 0;
+
+    workers = calloc((size_t) (size - 1), sizeof(pthread_t));
+    queues = calloc((size_t) size, sizeof(pool_queue));
+    if (workers == NULL || queues == NULL) {
+        vu_log(VHOSTMD_ERR, "Unable to allocate memory");
+        free(workers);
+        free(queues);
+        workers = NULL;
+        queues = NULL;
+        return -1;
+    }
+    for (i = 0; i < size; i++)
+        pthread_mutex_init(&queues[i].lock, NULL);
+    num_queues = size;
+
+    /* signals are handled by the main thread only */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    for (i = 0; i < size - 1; i++) {
+        rc = pthread_create(&workers[i], NULL, pool_worker,
+                            (void *) (long) (i + 1));
+        if (rc != 0) {
+            vu_log(VHOSTMD_ERR, "Failed to start worker thread '%s'",
+                   strerror(rc));
+            break;
+        }
+        num_workers++;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (num_workers != size - 1) {
+        pool_fini();
+        return -1;
+    }
+
+    vu_log(VHOSTMD_INFO, "Started %d worker threads", num_workers);
+    return 0;
+}
+
+/*
+ * Run a batch of tasks and wait for its completion.
+ */
+void pool_run(pool_func func, void **args, int n)
+{
+    int threads = num_workers + 1;
+    int i, start;
+
+    if (n <= 0)
+        return;
+
+    if (num_workers == 0 || n == 1) {
+        for (i = 0; i < n; i++)
+            func(args[i]);
+        return;
+    }
+
+    pthread_mutex_lock(&pool_mtx);
+    task_func = func;
+    task_args = args;
+    task_pending = n;
+    for (i = 0, start = 0; i < threads; i++) {
+        pthread_mutex_lock(&queues[i].lock);
+        queues[i].head = start;
+        start += n / threads + (i < n % threads ? 1 : 0);
+        queues[i].tail = start;
+        pthread_mutex_unlock(&queues[i].lock);
+    }
+    batch++;
+    pthread_cond_broadcast(&pool_work);
+    pthread_mutex_unlock(&pool_mtx);
+
+    pool_drain(0);
+
+    /* wait for the tasks and for all threads to leave the batch */
+    pthread_mutex_lock(&pool_mtx);
+    while (task_pending > 0 || threads_active > 0)
+        pthread_cond_wait(&pool_done, &pool_mtx);
+
+    task_func = NULL;
+    task_args = NULL;
+    pthread_mutex_unlock(&pool_mtx);
+}
+
+/*
+ * Stop the worker pool.
+ */
+void pool_fini(void)
+{
+    int i;
+
+    pthread_mutex_lock(&pool_mtx);
+    pool_down = 1;
+    pthread_cond_broadcast(&pool_work);
+    pthread_mutex_unlock(&pool_mtx);
+
+    for (i = 0; i < num_workers; i++)
+        pthread_join(workers[i], NULL);
+
+    free(workers);
+    workers = NULL;
+    num_workers = 0;
+    pool_down = 0;
+
+    for (i = 0; i < num_queues; i++)
+        pthread_mutex_destroy(&queues[i].lock);
+    free(queues);
+    queues = NULL;
+    num_queues = 0;
+}
@@ -167,22 +167,33 @@ int vu_buffer_delete(vu_buffer *buf)
    return 0;
 }
 
+/*
+ * Make room for len more bytes and the terminator, growing the buffer
+ * at least to twice its size so that appending is amortized constant.
+ */
+static int buffer_reserve(vu_buffer *buf, unsigned int len)
+{
+    unsigned int need = buf->use + len + 1;
+
+    if (need <= buf->size)
+        return 0;
+    if (need < buf->size * 2)
+        need = buf->size * 2;
+    return buffer_grow(buf, need - buf->use);
+}
+
 /*
  * Add str to buffer. 
  */
 void vu_buffer_add(vu_buffer *buf, const char *str, int len)
 {
-    unsigned int needSize;
-
     if ((str == NULL) || (buf == NULL) || (len == 0))
         return;
 
     if (len < 0)
         len = strlen(str);
 
-    needSize = buf->use + len + 2;
-    if (needSize > buf->size &&
-        buffer_grow(buf, needSize - buf->use) < 0)
+    if (buffer_reserve(buf, len) < 0)
         return;
 
     memcpy (&buf->content[buf->use], str, len);
@@ -190,6 +201,133 @@ void vu_buffer_add(vu_buffer *buf, const char *str, int len)
     buf->content[buf->use] = '\0';
 }
 
+/*
+ * Add str to buffer, escaped for XML.
+ */
+void vu_buffer_add_escaped(vu_buffer *buf, const char *str, int len)
+{
+    const char *end, *run;
+    const char *ent;
+
+    if ((str == NULL) || (buf == NULL) || (len == 0))
+        return;
+
+    if (len < 0)
+        len = strlen(str);
+
+    /* copy runs of plain characters, replace the others one by one */
+    end = str + len;
+    for (run = str; str < end; str++) {
+        switch (*str) {
+            case '&':
+                ent = "&amp;";
+                break;
+            case '<':
+                ent = "&lt;";
+                break;
+            case '>':
+                ent = "&gt;";
+                break;
+            case '\'':
+                ent = "&apos;";
+                break;
+            case '"':
+                ent = "&quot;";
+                break;
+            case '\t':
+            case '\n':
+            case '\r':
+                continue;
+            default:
+                /* control characters are not allowed in XML at all */
+                if ((unsigned char) *str >= 0x20)
+                    continue;
+                ent = "?";
+                break;
+        }
+        vu_buffer_add(buf, run, str - run);
+        vu_buffer_add(buf, ent, -1);
+        run = str + 1;
+    }
+    vu_buffer_add(buf, run, str - run);
+}
+
+/*
+ * Add str to buffer, escaped for a JSON string.
+ */
+void vu_buffer_add_json(vu_buffer *buf, const char *str, int len)
+{
+    static const char hex[] = "0123456789abcdef";
+    const char *end, *run;
+    char esc[7];
+
+    if ((str == NULL) || (buf == NULL) || (len == 0))
+        return;
+
+    if (len < 0)
+        len = strlen(str);
+
+    end = str + len;
+    for (run = str; str < end; str++) {
+        switch (*str) {
+            case '"':
+            case '\\':
+                esc[0] = '\\';
+                esc[1] = *str;
+                esc[2] = '\0';
+                break;
+            case '\n':
+                strcpy(esc, "\\n");
+                break;
+            case '\r':
+                strcpy(esc, "\\r");
+                break;
+            case '\t':
+                strcpy(esc, "\\t");
+                break;
+            default:
+                if ((unsigned char) *str >= 0x20)
+                    continue;
+                strcpy(esc, "\\u00");
+                esc[4] = hex[(*str >> 4) & 0xf];
+                esc[5] = hex[*str & 0xf];
+                esc[6] = '\0';
+                break;
+        }
+        vu_buffer_add(buf, run, str - run);
+        vu_buffer_add(buf, esc, -1);
+        run = str + 1;
+    }
+    vu_buffer_add(buf, run, str - run);
+}
+
+/*
+ * Add the decimal representation of val to buffer.
+ */
+void vu_buffer_add_uint(vu_buffer *buf, unsigned long long val)
+{
+    char digits[24];
+    char *p = &digits[sizeof(digits)];
+
+    do {
+        *--p = '0' + (char) (val % 10);
+        val /= 10;
+    } while (val);
+
+    vu_buffer_add(buf, p, &digits[sizeof(digits)] - p);
+}
+
+void vu_buffer_add_int(vu_buffer *buf, long long val)
+{
+    if (val < 0) {
+        vu_buffer_add(buf, "-", 1);
+        /* negate in unsigned arithmetic, -LLONG_MIN does not fit */
+        vu_buffer_add_uint(buf, 0ULL - (unsigned long long) val);
+    }
+    else
+        vu_buffer_add_uint(buf, (unsigned long long) val);
+}
+
 /*
  * Do a formatted print to buffer.
  */
@@ -213,7 +351,9 @@ void vu_buffer_vsprintf(vu_buffer *buf, const char *format, ...)
         buf->content[buf->use] = 0;
         va_end(locarg);
 
-        grow_size = (count > 1000) ? count : 1000;
+        /* room for count characters, the terminator and the slack
+           required by the loop condition */
+        grow_size = (count + 3 > 1000) ? count + 3 : 1000;
         if (buffer_grow(buf, grow_size) < 0) {
             va_end(argptr);
             return;
@@ -30,6 +30,7 @@
 #include <string.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <endian.h>
 #include <errno.h>
 #include <getopt.h>
 #include <signal.h>
@@ -46,7 +47,13 @@
 
 #include "util.h"
 #include "metric.h"
+#include "mdisk.h"
 #include "virtio.h"
+#include "pool.h"
+#include "builtin.h"
+#include "plugin.h"
+#include "derived.h"
+#include "coprocess.h"
 
 /*
  * vhostmd will periodically write metrics to a disk.  The metrics
@@ -60,12 +67,19 @@
  * - 4 byte content checksum, big endian
  * - 4 byte content length, big endian
  * - content
+ *
+ * The content is an XML document, or with <disk format="binary"> the
+ * index of typed records described in mdisk.h, which has its own
+ * signature.
  */
 
 #define MDISK_SIZE_MIN      1024
 #define MDISK_SIZE_MAX      (256 * 1024 * 1024)
 #define MDISK_SIGNATURE     0x6d766264  /* 'mvbd' */
 
+/* Shortest supported update period in milliseconds */
+#define UPDATE_PERIOD_MIN   10
+
 typedef struct _mdisk_header
 {
    uint32_t sig;
@@ -79,7 +93,7 @@ typedef struct _mdisk_header
 /* 
  * Macro for determining usable size of metrics disk
  */
-#define MDISK_SIZE          (mdisk_size - MDISK_HEADER_SIZE)
+#define MDISK_SIZE          (conf.mdisk_size - MDISK_HEADER_SIZE)
 
 /*
  * Transports
@@ -89,13 +103,101 @@ typedef struct _mdisk_header
 #define VIRTIO   (1 << 2)
 
 /* Global variables */
-static int down = 0;
-static int mdisk_size = MDISK_SIZE_MIN;
-static int update_period = 5;
+static volatile sig_atomic_t down = 0;
+static volatile sig_atomic_t reload = 0;
 static char *def_mdisk_path = "/dev/shm/vhostmd0";
-static char *mdisk_path = NULL;
 static char *pid_file = "/var/run/vhostmd.pid";
-static metric *metrics = NULL;
+
+/*
+ * Metric registry.  Host and vm metrics are kept in separate arrays, in
+ * configuration order, so an update walks only the metrics of the
+ * context it collects.
+ */
+typedef struct _metric_registry {
+   metric *host;
+   int num_host;
+   metric *vm;
+   int num_vm;
+   unsigned int vm_stats;   /* VU_STATS_* read by VM builtins */
+   struct _metric_ref *refs;
+   int num_refs;
+   struct _metric_index *host_order;   /* vars sorted for the binary disk */
+   struct _metric_index *vm_order;
+   int num_host_order;
+   int num_vm_order;
+} metric_registry;
+
+/* A metric used in the expression of a derived metric */
+typedef struct _metric_ref {
+   metric_context ctx;
+   int index;         /* in the registry array of ctx */
+   int var;
+   int sum;           /* the sum over all VMs */
+   double total;      /* that sum in the current update */
+} metric_ref;
+
+/* A variable in the order of the binary disk index */
+typedef struct _metric_index {
+   const metric_var *def;
+   int index;         /* in the registry array of its context */
+   int var;
+   uint32_t name;     /* string offsets in the current update */
+   uint32_t unit;
+} metric_index;
+
+/* Formats of the metrics disk content */
+typedef enum _mdisk_format {
+   MDISK_FORMAT_XML,
+   MDISK_FORMAT_BINARY,
+   MDISK_FORMAT_JSON,
+   MDISK_FORMAT_XML2
+} mdisk_format;
+
+/*
+ * Settings and metrics read from the configuration file.  On SIGHUP
+ * the file is read into a new configuration, which replaces the
+ * current one between two updates.
+ */
+typedef struct _vhostmd_config {
+   char *mdisk_path;
+   int mdisk_size;
+   mdisk_format mdisk_format;
+   int update_period;         /* milliseconds */
+   int num_workers;
+   int action_timeout;
+   char *search_path;
+   char *plugin_dir;
+   int transports;
+   metric_format xenstore_format;
+   unsigned int virtio_formats;   /* 1 << format, for each format served */
+   unsigned int doc_formats;      /* documents for the disk and xenstore */
+   unsigned int formats;          /* fragments written in each update */
+   char *virtio_channel_path;
+   int virtio_max_channels;
+   int virtio_expiration_time;
+   metric_registry metrics;
+} vhostmd_config;
+
+static const vhostmd_config config_defaults =
+         {
+            .mdisk_size = MDISK_SIZE_MIN,
+            .update_period = 5000,
+            .num_workers = 1,
+            .virtio_max_channels = 1024,
+            .virtio_expiration_time = 15,
+         };
+
+/* The serializer of a metrics disk that is not binary */
+static metric_format mdisk_metric_format(mdisk_format f)
+{
+   if (f == MDISK_FORMAT_JSON)
+      return METRIC_FORMAT_JSON;
+   if (f == MDISK_FORMAT_XML2)
+      return METRIC_FORMAT_XML2;
+   return METRIC_FORMAT_XML;
+}
+
+static vhostmd_config conf;
 static mdisk_header md_header =
          {
             .sig = 0,
@@ -103,11 +205,6 @@ static mdisk_header md_header =
             .sum = 0,
             .length = 0,
          };
-static char *search_path = NULL;
-static int transports = 0;
-static char *virtio_channel_path = NULL;
-static int virtio_max_channels = 1024;
-static int virtio_expiration_time = 15;
 
 
 /**********************************************************************
@@ -123,6 +220,9 @@ static void sig_handler(int sig, siginfo_t *siginfo ATTRIBUTE_UNUSED,
       case SIGQUIT:
          down = 1;
          break;
+      case SIGHUP:
+         reload = 1;
+         break;
       case SIGPIPE:
       default:
          break;
@@ -238,6 +338,68 @@ static int daemonize(void)
  * Config file parsing functions
  *********************************************************************/
 
+static void metric_vars_free(metric_var *vars, int cnt)
+{
+   int i;
+
+   if (vars == NULL)
+      return;
+   for (i = 0; i < cnt; i++) {
+      free(vars[i].name);
+      free(vars[i].type_str);
+      free(vars[i].unit);
+      free(vars[i].xml);
+      free(vars[i].json);
+      free(vars[i].xml2);
+   }
+   free(vars);
+}
+
+/*
+ * Free everything a metric definition owns.
+ */
+static void metric_clear(metric *m)
+{
+   metric_action_free(m);
+   derived_free(m->expr);
+   free(m->state);
+   free(m->value);
+   free(m->slots);
+   free(m->samples);
+   metric_fragments_free(m);
+   if (m->info) {
+      metric_vars_free(m->info->vars, m->cnt);
+      free(m->info->name);
+      free(m->info->action);
+      free(m->info->derived);
+      free(m->info);
+   }
+   m->expr = NULL;
+   m->state = NULL;
+   m->value = NULL;
+   m->slots = NULL;
+   m->samples = NULL;
+   m->info = NULL;
+}
+
+/*
+ * Append a copy of metric m to the array *arr of *num metrics.
+ */
+static int metric_append(metric **arr, int *num, const metric *m)
+{
+   metric *n;
+
+   if ((n = realloc(*arr, (*num + 1) * sizeof(metric))) == NULL) {
+      vu_log(VHOSTMD_ERR, "realloc: %m");
+      return -1;
+   }
+   n[*num] = *m;
+   *arr = n;
+   (*num)++;
+
+   return 0;
+}
+
 /* Parse a XML group metric node and return success indication */
 static int parse_group_metric(xmlDocPtr xml ATTRIBUTE_UNUSED,
                               xmlXPathContextPtr ctxt, xmlNodePtr node, metric *mdef)
@@ -246,14 +408,12 @@ static int parse_group_metric(xmlDocPtr xml ATTRIBUTE_UNUSED,
    xmlChar *path = NULL;
    char *cp = NULL;
    xmlChar *prop;
+   metric_var *vars;
    int ret = -1;
    int i;
 
-   free(mdef->name);
-   free(mdef->type_str);
-   mdef->name = NULL;
-   mdef->type_str = NULL;
-   mdef->cnt = 0;
+   free(mdef->info->name);
+   mdef->info->name = NULL;
 
    path = xmlGetNodePath(node);
    if (path == NULL) {
@@ -271,26 +431,42 @@ static int parse_group_metric(xmlDocPtr xml ATTRIBUTE_UNUSED,
 
    mdef->cnt = xmlXPathNodeSetGetLength(obj->nodesetval);
    vu_log(VHOSTMD_INFO, "parse_group_metric: number of variable nodes: %d", mdef->cnt);
+   if (mdef->cnt == 0) {
+      vu_log(VHOSTMD_WARN, "parse_group_metric: no variables");
+      goto error;
+   }
+   if ((vars = calloc(mdef->cnt, sizeof(metric_var))) == NULL)
+      goto error;
+   mdef->info->vars = vars;
+
    for (i = 0; i < mdef->cnt; i++) {
       xmlNode *n = obj->nodesetval->nodeTab[i];
       if ((prop = xmlGetProp(n, BAD_CAST "name")) == NULL) {
          vu_log(VHOSTMD_WARN, "parse_group_metric: metric name not specified");
          goto error;
       }
-      vu_append_string(&mdef->name, prop);
+      vu_append_string(&mdef->info->name, prop);
+      vars[i].name = strdup((char *)prop);
       free(prop);
 
       if ((prop = xmlGetProp(n, BAD_CAST "type")) == NULL) {
          vu_log(VHOSTMD_WARN, "parse_group_metric: metric type not specified");
          goto error;
       }
-      vu_append_string(&mdef->type_str, prop);
+      if (metric_type_from_str(prop, &vars[i].type)) {
+         vu_log(VHOSTMD_WARN, "Unsupported variable type %s", prop);
+         free(prop);
+         goto error;
+      }
+      vars[i].type_str = strdup((char *)prop);
       free(prop);
 
       if ((prop = xmlGetProp(n, BAD_CAST "unit"))) {
-          vu_append_string(&mdef->unit, prop);
+          vars[i].unit = strdup((char *)prop);
           free(prop);
       }
+      if (vars[i].name == NULL || vars[i].type_str == NULL)
+         goto error;
    }
    ret = 0;
 error:
@@ -302,19 +478,31 @@ error:
 }
 
 /* Parse a XML metric node and return a metric definition */
-static metric *parse_metric(xmlDocPtr xml, xmlXPathContextPtr ctxt, xmlNodePtr node)
+static metric *parse_metric(xmlDocPtr xml, xmlXPathContextPtr ctxt, xmlNodePtr node,
+                            vhostmd_config *cfg)
 {
    metric *mdef = NULL;
    xmlNodePtr cur;
    xmlChar *mtype = NULL;
    xmlChar *mcontext = NULL;
    xmlChar *munit = NULL;
+   xmlChar *minterval = NULL;
+   xmlChar *mtimeout = NULL;
+   xmlChar *fallback = NULL;
+   xmlChar *kind = NULL;
+   xmlChar *builtin = NULL;
+   xmlChar *mode = NULL;
+   xmlChar *ttl = NULL;
+   xmlChar *scope = NULL;
+   xmlChar *derived = NULL;
    xmlChar *str;
+   int i;
 
    mdef = calloc(1, sizeof(metric));
-   if (mdef == NULL) {
+   if (mdef == NULL || (mdef->info = calloc(1, sizeof(metric_info))) == NULL) {
       vu_log(VHOSTMD_WARN, "Unable to allocate memory for "
                   "metrics definition");
+      free(mdef);
       return NULL;
    }
    
@@ -328,7 +516,6 @@ static metric *parse_metric(xmlDocPtr xml, xmlXPathContextPtr ctxt, xmlNodePtr n
       vu_log(VHOSTMD_WARN, "Unsupported metric type %s", mtype);
       goto error;
    }
-   mdef->type_str = strdup((char *)mtype);
 
    /* Get the metric context attribute */
    if ((mcontext = xmlGetProp(node, BAD_CAST "context")) == NULL) {
@@ -346,8 +533,75 @@ static metric *parse_metric(xmlDocPtr xml, xmlXPathContextPtr ctxt, xmlNodePtr n
    }
 
    /* Get the metric unit attribute */
-   if ((munit = xmlGetProp(node, BAD_CAST "unit"))) {
-       mdef->unit = strdup((char *)munit);
+   munit = xmlGetProp(node, BAD_CAST "unit");
+
+   /* Get the metric interval attribute */
+   if ((minterval = xmlGetProp(node, BAD_CAST "interval"))) {
+      char *end;
+
+      if (xmlStrEqual(minterval, BAD_CAST "once"))
+         mdef->interval = METRIC_INTERVAL_ONCE;
+      else {
+         errno = 0;
+         mdef->interval = (int) strtol((char *)minterval, &end, 10);
+         if (errno || end == (char *)minterval || *end != '\0' ||
+             mdef->interval < 0) {
+            vu_log(VHOSTMD_WARN, "Invalid metric interval '%s'", minterval);
+            goto error;
+         }
+      }
+   }
+
+   /* Get the metric timeout attributes */
+   mdef->timeout = cfg->action_timeout;
+   if ((mtimeout = xmlGetProp(node, BAD_CAST "timeout"))) {
+      char *end;
+
+      errno = 0;
+      mdef->timeout = (int) strtol((char *)mtimeout, &end, 10);
+      if (errno || end == (char *)mtimeout || *end != '\0' ||
+          mdef->timeout < 0) {
+         vu_log(VHOSTMD_WARN, "Invalid metric timeout '%s'", mtimeout);
+         goto error;
+      }
+   }
+
+   if ((fallback = xmlGetProp(node, BAD_CAST "on_timeout"))) {
+      if (xmlStrEqual(fallback, BAD_CAST "omit"))
+         mdef->on_timeout = METRIC_FALLBACK_OMIT;
+      else if (xmlStrEqual(fallback, BAD_CAST "last"))
+         mdef->on_timeout = METRIC_FALLBACK_LAST;
+      else if (xmlStrEqual(fallback, BAD_CAST "stale"))
+         mdef->on_timeout = METRIC_FALLBACK_STALE;
+      else {
+         vu_log(VHOSTMD_WARN, "Unsupported metric on_timeout (%s) :"
+                "supported values (omit), (last) and (stale)", fallback);
+         goto error;
+      }
+   }
+
+   /* Get the metric kind attribute */
+   if ((kind = xmlGetProp(node, BAD_CAST "kind"))) {
+      if (xmlStrEqual(kind, BAD_CAST "gauge"))
+         mdef->kind = METRIC_KIND_GAUGE;
+      else if (xmlStrEqual(kind, BAD_CAST "counter"))
+         mdef->kind = METRIC_KIND_COUNTER;
+      else {
+         vu_log(VHOSTMD_WARN, "Unsupported metric kind (%s) :"
+                "supported kinds (gauge) and (counter)", kind);
+         goto error;
+      }
+   }
+
+   /* Get the expression of a derived metric */
+   if ((derived = xmlGetProp(node, BAD_CAST "derived"))) {
+      if (mdef->type == M_GROUP || mdef->type == M_STRING ||
+          mdef->type == M_XML || mdef->kind == METRIC_KIND_COUNTER) {
+         vu_log(VHOSTMD_WARN, "Derived metrics must be numeric gauges");
+         goto error;
+      }
+      if ((mdef->info->derived = strdup((char *)derived)) == NULL)
+         goto error;
    }
 
    /* Get the metric name and the action */
@@ -356,29 +610,115 @@ static metric *parse_metric(xmlDocPtr xml, xmlXPathContextPtr ctxt, xmlNodePtr n
    while(cur != NULL) {
       str = xmlNodeListGetString(xml, cur->xmlChildrenNode, 1);
       if (str && xmlStrEqual(cur->name, BAD_CAST "name")) {
-         mdef->name= strdup((char *)str);
+         mdef->info->name= strdup((char *)str);
       }
       if (str && xmlStrEqual(cur->name, BAD_CAST "action")) {
-         mdef->action = strdup((char *)str);
+         mdef->info->action = strdup((char *)str);
       }
+      if (builtin == NULL && xmlStrEqual(cur->name, BAD_CAST "action"))
+         builtin = xmlGetProp(cur, BAD_CAST "builtin");
+      if (mode == NULL && xmlStrEqual(cur->name, BAD_CAST "action"))
+         mode = xmlGetProp(cur, BAD_CAST "mode");
+      if (ttl == NULL && xmlStrEqual(cur->name, BAD_CAST "action"))
+         ttl = xmlGetProp(cur, BAD_CAST "ttl");
+      if (scope == NULL && xmlStrEqual(cur->name, BAD_CAST "action"))
+         scope = xmlGetProp(cur, BAD_CAST "scope");
       if (str)
          free(str);
       cur = cur->next;
    }
    
-   if (mdef->name == NULL) {
+   if (mdef->info->name == NULL) {
          vu_log(VHOSTMD_WARN, "Metric name not specified");
          goto error;
    }
-   if (mdef->action == NULL) {
+   if (ttl) {
+      char *end;
+
+      errno = 0;
+      mdef->ttl = (int) strtol((char *)ttl, &end, 10);
+      if (errno || end == (char *)ttl || *end != '\0' || mdef->ttl < 0) {
+         vu_log(VHOSTMD_WARN, "Invalid action ttl '%s'", ttl);
+         goto error;
+      }
+   }
+   if (scope) {
+      if (xmlStrEqual(scope, BAD_CAST "all-vms"))
+         mdef->all_vms = 1;
+      else if (!xmlStrEqual(scope, BAD_CAST "vm")) {
+         vu_log(VHOSTMD_WARN, "Unsupported action scope (%s) :"
+                "supported scopes (vm) and (all-vms)", scope);
+         goto error;
+      }
+      if (mdef->all_vms && (mdef->ctx != METRIC_CONTEXT_VM || builtin ||
+                            (mode && xmlStrEqual(mode, BAD_CAST "coprocess")))) {
+         vu_log(VHOSTMD_WARN, "Metric '%s': scope all-vms requires a vm "
+                "metric with a command action", mdef->info->name);
+         goto error;
+      }
+   }
+   if (derived) {
+      /* the expression is compiled once all metrics are known */
+      if (mdef->info->action || builtin) {
+         vu_log(VHOSTMD_WARN, "Derived metric '%s' can't have an action",
+                mdef->info->name);
+         goto error;
+      }
+   }
+   else if (builtin) {
+      unsigned int stats = 0;
+
+      mdef->pf = builtin_lookup((char *)builtin, mdef->ctx, &stats);
+      cfg->metrics.vm_stats |= stats;
+      if (mdef->pf == NULL)
+         mdef->pf = plugin_lookup((char *)builtin, mdef->ctx, &mdef->pf_data);
+      if (mdef->pf == NULL && mdef->info->action) {
+         /* the text of the action is run instead */
+         vu_log(VHOSTMD_INFO, "Metric '%s' uses its action instead of "
+                "builtin '%s'", mdef->info->name, builtin);
+         if (metric_action_prepare(mdef))
+            goto error;
+      }
+      else if (mdef->pf == NULL) {
+         vu_log(VHOSTMD_WARN, "Unknown builtin '%s' for %s metric '%s'",
+                builtin, mdef->ctx == METRIC_CONTEXT_HOST ? "host" : "vm",
+                mdef->info->name);
+         goto error;
+      }
+   }
+   else if (mdef->info->action == NULL) {
          vu_log(VHOSTMD_WARN, "Metric action not specified");
          goto error;
    }
+   else if (mode && xmlStrEqual(mode, BAD_CAST "coprocess")) {
+      if (metric_coprocess_create(mdef))
+         goto error;
+   }
+   else if (metric_action_prepare(mdef))
+      goto error;
 
    vu_log(VHOSTMD_INFO, "Adding %s metric '%s'",
                mdef->ctx == METRIC_CONTEXT_HOST ? "host" : "vm",
-               mdef->name);
-   vu_log(VHOSTMD_INFO, "\t action: %s", mdef->action);
+               mdef->info->name);
+   if (derived)
+      vu_log(VHOSTMD_INFO, "\t derived: %s", derived);
+   else if (mdef->pf)
+      vu_log(VHOSTMD_INFO, "\t builtin: %s", builtin);
+   else if (mdef->cp)
+      vu_log(VHOSTMD_INFO, "\t co-process: %s", mdef->info->action);
+   else if (mdef->argv)
+      vu_log(VHOSTMD_INFO, "\t action (no shell): %s", mdef->info->action);
+   else
+      vu_log(VHOSTMD_INFO, "\t action: %s", mdef->info->action);
+   if (mdef->all_vms)
+      vu_log(VHOSTMD_INFO, "\t scope: all-vms");
+   if (minterval)
+      vu_log(VHOSTMD_INFO, "\t interval: %s", minterval);
+   if (mdef->timeout)
+      vu_log(VHOSTMD_INFO, "\t timeout: %d s, on timeout: %s", mdef->timeout,
+             fallback ? (char *)fallback : "omit");
+   if (mdef->kind == METRIC_KIND_COUNTER)
+      vu_log(VHOSTMD_INFO, "\t kind: counter");
 
    mdef->cnt = 1;
    if (mdef->type == M_GROUP) {
@@ -386,35 +726,279 @@ static metric *parse_metric(xmlDocPtr xml, xmlXPathContextPtr ctxt, xmlNodePtr n
          goto error;
       }
    }
+   else {
+      metric_var *var = calloc(1, sizeof(metric_var));
+
+      if (var == NULL)
+         goto error;
+      mdef->info->vars = var;
+      var->name = strdup(mdef->info->name);
+      var->type_str = strdup((char *)mtype);
+      var->type = mdef->type;
+      if (munit)
+         var->unit = strdup((char *)munit);
+      if (var->name == NULL || var->type_str == NULL ||
+          (munit && var->unit == NULL))
+         goto error;
+   }
+
+   /* rates are numbers */
+   if (mdef->kind == METRIC_KIND_COUNTER) {
+      for (i = 0; i < mdef->cnt; i++) {
+         metric_var *var = &mdef->info->vars[i];
+
+         if (var->type == M_STRING || var->type == M_XML) {
+            vu_log(VHOSTMD_WARN, "Counter metric '%s' has type %s, "
+                   "a numeric type is required", mdef->info->name,
+                   var->type_str);
+            goto error;
+         }
+      }
+   }
+
+   if (metric_serializers_prepare(mdef))
+      goto error;
 
    free(mtype);
    free(mcontext);
    free(munit);
+   free(minterval);
+   free(mtimeout);
+   free(fallback);
+   free(kind);
+   free(builtin);
+   free(mode);
+   free(ttl);
+   free(scope);
+   free(derived);
 
    return mdef;
    
  error:
-   if (mdef) {
-      free(mdef->name);
-      free(mdef->action);
-      free(mdef->type_str);
-      free(mdef);
-   }
+   metric_clear(mdef);
+   free(mdef);
    free(mtype);
    free(mcontext);
    free(munit);
+   free(minterval);
+   free(mtimeout);
+   free(fallback);
+   free(kind);
+   free(builtin);
+   free(mode);
+   free(ttl);
+   free(scope);
+   free(derived);
    
    return NULL;
 }
 
+/* Metrics a derived metric's expression can use */
+typedef struct _derived_scope {
+   metric_registry *reg;
+   metric_context ctx;
+   int index;         /* of the derived metric in its array */
+   int check;         /* only check the names, don't add references */
+} derived_scope;
+
+/*
+ * Find a numeric variable called name in the first num metrics of arr.
+ * Derived metrics before index limit are included.
+ */
+static int metric_var_find(const metric *arr, int num, int limit,
+                           const char *name, int *index, int *var)
+{
+   const metric_var *v;
+   int i, k;
+
+   for (i = 0; i < num; i++) {
+      if (arr[i].info->derived && i >= limit)
+         continue;
+      for (k = 0; k < arr[i].cnt; k++) {
+         v = &arr[i].info->vars[k];
+         if (v->type == M_STRING || v->type == M_XML ||
+             strcmp(v->name, name) != 0)
+            continue;
+         *index = i;
+         *var = k;
+         return 0;
+      }
+   }
+
+   return -1;
+}
+
+/*
+ * Resolve a name in a derived metric's expression.  Names refer to
+ * metrics of the same context; vm metrics can also use host metrics.
+ * sum() adds up a vm metric over all VMs.  Derived metrics can be
+ * used by later derived metrics of the same context only, so their
+ * value is always computed first.
+ */
+static int derived_resolve_ref(const char *name, int sum, void *opaque)
+{
+   derived_scope *sc = (derived_scope *) opaque;
+   metric_registry *reg = sc->reg;
+   metric_ref ref, *refs;
+
+   memset(&ref, 0, sizeof(ref));
+   ref.sum = sum;
+
+   if (sum) {
+      ref.ctx = METRIC_CONTEXT_VM;
+      if (metric_var_find(reg->vm, reg->num_vm, 0, name,
+                          &ref.index, &ref.var))
+         return -1;
+   }
+   else if (sc->ctx == METRIC_CONTEXT_HOST)  {
+      ref.ctx = METRIC_CONTEXT_HOST;
+      if (metric_var_find(reg->host, reg->num_host, sc->index, name,
+                          &ref.index, &ref.var))
+         return -1;
+   }
+   else if (metric_var_find(reg->vm, reg->num_vm, sc->index, name,
+                            &ref.index, &ref.var) == 0)
+      ref.ctx = METRIC_CONTEXT_VM;
+   else if (metric_var_find(reg->host, reg->num_host, 0, name,
+                            &ref.index, &ref.var) == 0)
+      ref.ctx = METRIC_CONTEXT_HOST;
+   else
+      return -1;
+
+   if (sc->check)
+      return 0;
+
+   refs = realloc(reg->refs, (reg->num_refs + 1) * sizeof(metric_ref));
+   if (refs == NULL) {
+      vu_log(VHOSTMD_ERR, "realloc: %m");
+      return -1;
+   }
+   refs[reg->num_refs] = ref;
+   reg->refs = refs;
+
+   return reg->num_refs++;
+}
+
+/*
+ * Drop the derived metrics of context ctx whose expression is not
+ * valid.  This is done before any expression is compiled, since the
+ * references of compiled expressions are indexes into the arrays.
+ */
+static void derived_check(metric_registry *reg, metric_context ctx)
+{
+   metric **arr = ctx == METRIC_CONTEXT_HOST ? &reg->host : &reg->vm;
+   int *num = ctx == METRIC_CONTEXT_HOST ? &reg->num_host : &reg->num_vm;
+   derived_scope sc = { reg, ctx, 0, 1 };
+   derived_expr *e;
+   metric *m;
+   int i = 0;
+
+   while (i < *num) {
+      m = &(*arr)[i];
+      if (m->info->derived == NULL) {
+         i++;
+         continue;
+      }
+
+      sc.index = i;
+      if ((e = derived_compile(m->info->derived, derived_resolve_ref,
+                               &sc)) == NULL) {
+         vu_log(VHOSTMD_WARN, "Unable to compile derived metric '%s', "
+                "ignoring ...", m->info->name);
+         metric_clear(m);
+         memmove(m, m + 1, (size_t) (*num - i - 1) * sizeof(metric));
+         (*num)--;
+         continue;
+      }
+      derived_free(e);
+      i++;
+   }
+}
+
+/*
+ * Compile the expressions of the derived metrics of context ctx.
+ */
+static int derived_compile_all(metric_registry *reg, metric_context ctx)
+{
+   metric *arr = ctx == METRIC_CONTEXT_HOST ? reg->host : reg->vm;
+   int num = ctx == METRIC_CONTEXT_HOST ? reg->num_host : reg->num_vm;
+   derived_scope sc = { reg, ctx, 0, 0 };
+   int i;
+
+   for (i = 0; i < num; i++) {
+      if (arr[i].info->derived == NULL)
+         continue;
+
+      sc.index = i;
+      arr[i].expr = derived_compile(arr[i].info->derived,
+                                    derived_resolve_ref, &sc);
+      if (arr[i].expr == NULL)
+         return -1;
+   }
+
+   return 0;
+}
+
 /* Parse metrics nodes contained in XML doc */
+static int metric_index_cmp(const void *a, const void *b)
+{
+   const metric_index *x = a;
+   const metric_index *y = b;
+   int c = strcmp(x->def->name, y->def->name);
+
+   /* keep configuration order among equal names */
+   if (c == 0)
+      c = x->index != y->index ? x->index - y->index : x->var - y->var;
+   return c;
+}
+
+/*
+ * Sort the variables of the metrics in arr by name, the order of the
+ * binary disk index.  XML metrics have no place in it.
+ */
+static int metrics_index_build(const metric *arr, int num,
+                               metric_index **order, int *num_order)
+{
+   metric_index *x;
+   int i, j, n = 0;
+
+   for (i = 0; i < num; i++)
+      n += arr[i].type == M_XML ? 0 : arr[i].cnt;
+
+   *order = NULL;
+   *num_order = 0;
+   if (n == 0)
+      return 0;
+   if ((x = calloc(n, sizeof(metric_index))) == NULL)
+      return -1;
+
+   n = 0;
+   for (i = 0; i < num; i++) {
+      if (arr[i].type == M_XML)
+         continue;
+      for (j = 0; j < arr[i].cnt; j++) {
+         x[n].def = &arr[i].info->vars[j];
+         x[n].index = i;
+         x[n].var = j;
+         n++;
+      }
+   }
+   qsort(x, n, sizeof(metric_index), metric_index_cmp);
+
+   *order = x;
+   *num_order = n;
+   return 0;
+}
+
 static int parse_metrics(xmlDocPtr xml,
-                         xmlXPathContextPtr ctxt)
+                         xmlXPathContextPtr ctxt,
+                         vhostmd_config *cfg)
 {
    xmlXPathObjectPtr obj;
    xmlNodePtr relnode;
    metric *mdef;
    int num = 0;
+   int ret;
    int i;
    
    if (ctxt == NULL) {
@@ -434,29 +1018,56 @@ static int parse_metrics(xmlDocPtr xml,
    num = xmlXPathNodeSetGetLength(obj->nodesetval);
    vu_log(VHOSTMD_INFO, "Number of metrics nodes: %d", num);
    for (i = 0; i < num; i++) {
-      mdef = parse_metric(xml, ctxt, obj->nodesetval->nodeTab[i]);
-      if (mdef) {
-         mdef->next = metrics;
-         metrics = mdef;
-      }
-      else {
+      mdef = parse_metric(xml, ctxt, obj->nodesetval->nodeTab[i], cfg);
+      if (mdef == NULL) {
          vu_log(VHOSTMD_WARN, "Unable to parse metric node, ignoring ...");
          continue;
       }
+
+      if (mdef->ctx == METRIC_CONTEXT_HOST)
+         ret = metric_append(&cfg->metrics.host, &cfg->metrics.num_host, mdef);
+      else
+         ret = metric_append(&cfg->metrics.vm, &cfg->metrics.num_vm, mdef);
+      if (ret)
+         metric_clear(mdef);
+      free(mdef);
    }
 
    xmlXPathFreeObject(obj);
    ctxt->node = relnode;
+
+   /* derived metrics can use metrics defined after them */
+   derived_check(&cfg->metrics, METRIC_CONTEXT_HOST);
+   derived_check(&cfg->metrics, METRIC_CONTEXT_VM);
+   if (derived_compile_all(&cfg->metrics, METRIC_CONTEXT_HOST) ||
+       derived_compile_all(&cfg->metrics, METRIC_CONTEXT_VM)) {
+      vu_log(VHOSTMD_ERR, "Unable to compile derived metrics");
+      return -1;
+   }
+
+   if (metrics_index_build(cfg->metrics.host, cfg->metrics.num_host,
+                           &cfg->metrics.host_order,
+                           &cfg->metrics.num_host_order) ||
+       metrics_index_build(cfg->metrics.vm, cfg->metrics.num_vm,
+                           &cfg->metrics.vm_order,
+                           &cfg->metrics.num_vm_order)) {
+      vu_log(VHOSTMD_ERR, "Unable to allocate memory");
+      return -1;
+   }
+
    return 0;
 }
 
 static int parse_transports(xmlDocPtr xml,
-                         xmlXPathContextPtr ctxt)
+                         xmlXPathContextPtr ctxt,
+                         vhostmd_config *cfg)
 {
    xmlXPathObjectPtr obj;
    xmlNodePtr relnode;
    xmlNodePtr cur;
-   xmlChar *str;
+   xmlChar *str = NULL;
+   xmlChar *format = NULL;
+   metric_format f;
    int num = 0;
    int i;
    
@@ -478,30 +1089,67 @@ static int parse_transports(xmlDocPtr xml,
    for (i = 0; i < num; i++) {
       cur = obj->nodesetval->nodeTab[i]->xmlChildrenNode;
       str = xmlNodeListGetString(xml, cur, 1);
+      format = xmlGetProp(obj->nodesetval->nodeTab[i], BAD_CAST "format");
+      f = METRIC_FORMAT_XML;
+      if (format && metric_format_from_str((char *)format, &f)) {
+         vu_log(VHOSTMD_ERR, "Unsupported transport format (%s): "
+                "supported formats (xml), (xml2) and (json)", (char *)format);
+         goto error;
+      }
       if (str) {
-         if (strncasecmp((char *)str, "vbd", strlen("vbd")) == 0)
-             transports |= VBD;
+         if (strncasecmp((char *)str, "vbd", strlen("vbd")) == 0) {
+             if (format) {
+                vu_log(VHOSTMD_ERR, "The format of the vbd transport is "
+                       "set by the format attribute of disk");
+                goto error;
+             }
+             cfg->transports |= VBD;
+         }
          if (strncasecmp((char *)str, "xenstore", strlen("xenstore")) == 0) {
 #ifdef WITH_XENSTORE
-             transports |= XENSTORE;
+             cfg->transports |= XENSTORE;
+             cfg->xenstore_format = f;
 #else
 	     vu_log (VHOSTMD_ERR, "No support for xenstore transport in this vhostmd");
-         xmlXPathFreeObject(obj);
-	     return -1;
+             goto error;
 #endif
 	 }
-         if (strncasecmp((char *)str, "virtio", strlen("virtio")) == 0)
-             transports |= VIRTIO;
+         if (strncasecmp((char *)str, "virtio", strlen("virtio")) == 0) {
+             cfg->transports |= VIRTIO;
+             /* virtio serves xml and json, unless a format is chosen */
+             if (format)
+                cfg->virtio_formats = 1U << f;
+             else
+                cfg->virtio_formats = (1U << METRIC_FORMAT_XML) |
+                                      (1U << METRIC_FORMAT_JSON);
+         }
          free(str);
       }
+      free(format);
    }
    xmlXPathFreeObject(obj);
    ctxt->node = relnode;
    /* Should not happen */
-   if (transports == 0)
-       transports = VBD;
+   if (cfg->transports == 0)
+       cfg->transports = VBD;
+
+   /* the documents and fragments written in each update */
+   if ((cfg->transports & VBD) && cfg->mdisk_format != MDISK_FORMAT_BINARY)
+      cfg->doc_formats |= 1U << mdisk_metric_format(cfg->mdisk_format);
+   if (cfg->transports & XENSTORE)
+      cfg->doc_formats |= 1U << cfg->xenstore_format;
+   cfg->formats = cfg->doc_formats;
+   if (cfg->transports & VIRTIO)
+      cfg->formats |= cfg->virtio_formats;
 
    return 0;
+
+ error:
+   free(str);
+   free(format);
+   xmlXPathFreeObject(obj);
+   ctxt->node = relnode;
+   return -1;
 }
 
 static int validate_config_file(const char *filename)
@@ -549,14 +1197,15 @@ error:
 
 }
 
-/* Parse vhostmd configuration file */
-static int parse_config_file(const char *filename)
+/* Parse vhostmd configuration file into cfg */
+static int parse_config_file(const char *filename, vhostmd_config *cfg)
 {
    xmlParserCtxtPtr pctxt = NULL;
    xmlDocPtr xml = NULL;
    xmlXPathContextPtr ctxt = NULL;
    xmlNodePtr root;
    char *unit = NULL;
+   char *format = NULL;
    long l;
    int ret = -1;
 
@@ -593,53 +1242,89 @@ static int parse_config_file(const char *filename)
    ctxt->node = root;
 
    /* Get global settings */
-   mdisk_path = vu_xpath_string("string(./globals/disk/path[1])", ctxt);
-   if (mdisk_path == NULL)
-      mdisk_path = strdup(def_mdisk_path);
+   cfg->mdisk_path = vu_xpath_string("string(./globals/disk/path[1])", ctxt);
+   if (cfg->mdisk_path == NULL)
+      cfg->mdisk_path = strdup(def_mdisk_path);
+
+   format = vu_xpath_string("string(./globals/disk[1]/@format)", ctxt);
+   if (format == NULL || strcmp(format, "xml") == 0)
+      cfg->mdisk_format = MDISK_FORMAT_XML;
+   else if (strcmp(format, "binary") == 0)
+      cfg->mdisk_format = MDISK_FORMAT_BINARY;
+   else if (strcmp(format, "json") == 0)
+      cfg->mdisk_format = MDISK_FORMAT_JSON;
+   else if (strcmp(format, "xml2") == 0)
+      cfg->mdisk_format = MDISK_FORMAT_XML2;
+   else {
+      vu_log(VHOSTMD_ERR, "Unsupported metrics disk format (%s): "
+             "supported formats (xml), (xml2), (binary) and (json)", format);
+      goto out;
+   }
 
    unit = vu_xpath_string("string(./globals/disk/size[1]/@unit)", ctxt);
    if (vu_xpath_long("string(./globals/disk/size[1])", ctxt, &l) == 0) {
-      mdisk_size = vu_val_by_unit(unit, (int)l);
+      cfg->mdisk_size = vu_val_by_unit(unit, (int)l);
    }
    else {
       vu_log(VHOSTMD_ERR, "Unable to parse metrics disk size");
       goto out;
    }
 
+   free(unit);
+   unit = vu_xpath_string("string(./globals/update_period[1]/@unit)", ctxt);
    if (vu_xpath_long("string(./globals/update_period[1])", ctxt, &l) == 0) {
-      update_period = (int)l;
+      if (unit == NULL || strcmp(unit, "s") == 0)
+         cfg->update_period = (int)l * 1000;
+      else if (strcmp(unit, "ms") == 0)
+         cfg->update_period = (int)l;
+      else {
+         vu_log(VHOSTMD_ERR, "Unsupported update period unit (%s): "
+                "supported units (s) and (ms)", unit);
+         goto out;
+      }
    }
    else {
       vu_log(VHOSTMD_ERR, "Unable to parse update period");
       goto out;
    }
 
-   if ((search_path = vu_xpath_string("string(./globals/path[1])", ctxt)) != NULL) {
-      setenv("PATH", search_path, 1);
+   if (vu_xpath_long("string(./globals/workers[1])", ctxt, &l) == 0)
+      cfg->num_workers = (int)l;
+
+   if (vu_xpath_long("string(./globals/timeout[1])", ctxt, &l) == 0)
+      cfg->action_timeout = (int)l;
+
+   cfg->search_path = vu_xpath_string("string(./globals/path[1])", ctxt);
+
+   /* collectors of plugins must be known before the metrics are parsed */
+   cfg->plugin_dir = vu_xpath_string("string(./globals/plugin_dir[1])", ctxt);
+   if (cfg->plugin_dir && plugin_load(cfg->plugin_dir)) {
+      vu_log(VHOSTMD_ERR, "Unable to load plugins");
+      goto out;
    }
 
-   if (parse_transports(xml, ctxt) == -1) {
+   if (parse_transports(xml, ctxt, cfg) == -1) {
       vu_log(VHOSTMD_ERR, "Unable to parse transports");
       goto out;
    }
     
-   if (transports & VIRTIO) {
-       virtio_channel_path = vu_xpath_string("string(./globals/virtio/channel_path[1])", ctxt);
-       if (virtio_channel_path == NULL) {
-           virtio_channel_path = strdup("/var/lib/libvirt/qemu/channel/target");
-           if (virtio_channel_path == NULL)
+   if (cfg->transports & VIRTIO) {
+       cfg->virtio_channel_path = vu_xpath_string("string(./globals/virtio/channel_path[1])", ctxt);
+       if (cfg->virtio_channel_path == NULL) {
+           cfg->virtio_channel_path = strdup("/var/lib/libvirt/qemu/channel/target");
+           if (cfg->virtio_channel_path == NULL)
                goto out;
        }
 
        if (vu_xpath_long("string(./globals/virtio/max_channels[1])", ctxt, &l) == 0)
-         virtio_max_channels = (int)l;
+         cfg->virtio_max_channels = (int)l;
 
       if (vu_xpath_long("string(./globals/virtio/expiration_time[1])", ctxt, &l) == 0)
-         virtio_expiration_time = (int)l;
+         cfg->virtio_expiration_time = (int)l;
    }
 
    /* Parse requested metrics definitions */
-   if (parse_metrics(xml, ctxt)) {
+   if (parse_metrics(xml, ctxt, cfg)) {
       vu_log(VHOSTMD_ERR, "Unable to parse metrics definition "
                   "in vhostmd config file");
       goto out;
@@ -649,6 +1334,7 @@ static int parse_config_file(const char *filename)
 
  out:
    free(unit);
+   free(format);
    xmlXPathFreeContext(ctxt);
    xmlFreeDoc(xml);
    xmlFreeParserCtxt(pctxt);
@@ -660,34 +1346,65 @@ static int parse_config_file(const char *filename)
  *********************************************************************/
 
 /* Ensure valid config settings, returning non-zero of failure */
-static int check_config(void)
+static int check_config(vhostmd_config *cfg)
 {
    /* check valid disk path */
-   if (!mdisk_path) {
+   if (!cfg->mdisk_path) {
       vu_log(VHOSTMD_ERR, "Metrics disk path not specified");
       return -1;
    }
 
    /* check valid disk size */
-   if (mdisk_size < MDISK_SIZE_MIN || mdisk_size > MDISK_SIZE_MAX) {
+   if (cfg->mdisk_size < MDISK_SIZE_MIN || cfg->mdisk_size > MDISK_SIZE_MAX) {
       vu_log(VHOSTMD_ERR, "Specified metrics disk size "
                   "(%d) not within supported range: (%d - %d)",
-                  mdisk_size, MDISK_SIZE_MIN, MDISK_SIZE_MAX);
+                  cfg->mdisk_size, MDISK_SIZE_MIN, MDISK_SIZE_MAX);
       return -1;
    }
 
    /* check valid update period */
-   if (update_period < 1) {
-      vu_log(VHOSTMD_ERR, "Specified update period (%d) less "
+   if (cfg->update_period < UPDATE_PERIOD_MIN) {
+      vu_log(VHOSTMD_ERR, "Specified update period (%d ms) less "
+                  "than minimum supported (%d ms)",
+                  cfg->update_period, UPDATE_PERIOD_MIN);
+      return -1;
+   }
+
+   /* check valid number of workers */
+   if (cfg->num_workers < 1) {
+      vu_log(VHOSTMD_ERR, "Specified number of workers (%d) less "
                   "than minimum supported (1)",
-                  update_period);
+                  cfg->num_workers);
+      return -1;
+   }
+
+   /* check valid action timeout */
+   if (cfg->action_timeout < 0) {
+      vu_log(VHOSTMD_ERR, "Specified action timeout (%d) less "
+                  "than minimum supported (0)",
+                  cfg->action_timeout);
       return -1;
    }
 
-   vu_log(VHOSTMD_INFO, "Using metrics disk path %s", mdisk_path);
-   vu_log(VHOSTMD_INFO, "Using metrics disk size %d", mdisk_size);
-   vu_log(VHOSTMD_INFO, "Using update period of %d seconds",
-               update_period);
+   /* channels must outlive a few updates, in seconds rounded up */
+   if ((cfg->transports & VIRTIO) &&
+       cfg->virtio_expiration_time < (cfg->update_period * 3 + 999) / 1000)
+      cfg->virtio_expiration_time = (cfg->update_period * 3 + 999) / 1000;
+
+   vu_log(VHOSTMD_INFO, "Using metrics disk path %s", cfg->mdisk_path);
+   vu_log(VHOSTMD_INFO, "Using metrics disk size %d", cfg->mdisk_size);
+   if (cfg->mdisk_format == MDISK_FORMAT_BINARY)
+      vu_log(VHOSTMD_INFO, "Using binary metrics disk format");
+   else if (cfg->mdisk_format == MDISK_FORMAT_JSON)
+      vu_log(VHOSTMD_INFO, "Using json metrics disk format");
+   else if (cfg->mdisk_format == MDISK_FORMAT_XML2)
+      vu_log(VHOSTMD_INFO, "Using xml2 metrics disk format");
+   vu_log(VHOSTMD_INFO, "Using update period of %d ms",
+               cfg->update_period);
+   vu_log(VHOSTMD_INFO, "Using %d workers", cfg->num_workers);
+   if (cfg->action_timeout)
+      vu_log(VHOSTMD_INFO, "Using action timeout of %d seconds",
+             cfg->action_timeout);
 
    return 0;
 }
@@ -709,7 +1426,14 @@ static int metrics_disk_header_update(int fd, vu_buffer *buf)
 {
    uint32_t sum;
 
-   md_header.sig = htonl(MDISK_SIGNATURE);
+   if (conf.mdisk_format == MDISK_FORMAT_BINARY)
+      md_header.sig = htonl(MDISK_SIGNATURE_V2);
+   else if (conf.mdisk_format == MDISK_FORMAT_JSON)
+      md_header.sig = htonl(MDISK_SIGNATURE_JSON);
+   else if (conf.mdisk_format == MDISK_FORMAT_XML2)
+      md_header.sig = htonl(MDISK_SIGNATURE_XML2);
+   else
+      md_header.sig = htonl(MDISK_SIGNATURE);
    md_header.length = 0;
    sum = md_header.sum = 0;
    
@@ -771,51 +1495,50 @@ out:
    return ret;
 }
 
-static int metrics_free()
+static void metrics_free(metric_registry *reg)
 {
-   metric *m = metrics;
-   metric *m_old;
-
-   while (m) {
-      if (m->name)
-         free(m->name);
-      if (m->action)
-         free(m->action);
-      if (m->value)
-         free(m->value);
-      if (m->type_str)
-         free(m->type_str);
-      m_old = m;
-      m = m->next;
-      free(m_old);
-   }
-   return 0;
+   int i;
+
+   for (i = 0; i < reg->num_host; i++)
+      metric_clear(&reg->host[i]);
+   for (i = 0; i < reg->num_vm; i++)
+      metric_clear(&reg->vm[i]);
+   free(reg->host);
+   free(reg->vm);
+   free(reg->refs);
+   free(reg->host_order);
+   free(reg->vm_order);
+   memset(reg, 0, sizeof(*reg));
+}
+
+static void config_free(vhostmd_config *cfg)
+{
+   free(cfg->mdisk_path);
+   free(cfg->search_path);
+   free(cfg->plugin_dir);
+   free(cfg->virtio_channel_path);
+   metrics_free(&cfg->metrics);
+   *cfg = config_defaults;
 }
 
 static void metrics_disk_close(int fd)
 {
    if (fd != -1)
       close(fd);
-   if (mdisk_path) {
-      free(mdisk_path);
-   }
-   if (search_path)
-      free(search_path);
-   metrics_free();
 }
 
-static int metrics_disk_create(void)
+static int metrics_disk_create(const vhostmd_config *cfg)
 {
    char *dir = NULL;
    char *tmp;
    char *buf = NULL;
    int fd = -1;
    int i;
-   int size = mdisk_size - MDISK_HEADER_SIZE;
+   int size = cfg->mdisk_size - MDISK_HEADER_SIZE;
    
    /* create directory */
-   if ((tmp = strrchr(mdisk_path, '/'))) {
-      dir = strndup(mdisk_path, tmp - mdisk_path);
+   if ((tmp = strrchr(cfg->mdisk_path, '/'))) {
+      dir = strndup(cfg->mdisk_path, tmp - cfg->mdisk_path);
       if (dir == NULL) {
          vu_log(VHOSTMD_ERR, "Unable to allocate memory");
          return -1;
@@ -836,7 +1559,7 @@ static int metrics_disk_create(void)
    }
 
    /* create disk */
-   fd = open(mdisk_path, O_RDWR | O_CREAT | O_TRUNC,
+   fd = open(cfg->mdisk_path, O_RDWR | O_CREAT | O_TRUNC,
              (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH));
    if (fd < 0) {
       vu_log(VHOSTMD_ERR, "Failed to open metrics disk: %s",
@@ -852,7 +1575,7 @@ static int metrics_disk_create(void)
    }
 
    /* truncate to a possible new size */
-   if (ftruncate(fd, mdisk_size) == -1){
+   if (ftruncate(fd, cfg->mdisk_size) == -1){
       vu_log(VHOSTMD_ERR, "Failed to truncate metrics disk: %s",
              strerror(errno));
       goto error;
@@ -886,160 +1609,981 @@ static int metrics_disk_create(void)
    return -1;
 }
 
-static int metrics_host_get(vu_buffer *buf)
-{
-   metric *m = metrics;
-   unsigned start = buf->use;
+/*
+ * Copies of the vm context metrics for one VM.  Each VM gets its own
+ * copies and output buffer so all VMs can be updated at the same time.
+ * The copies are kept while the VM is running so metrics that are not
+ * due keep their last value.  The host entry has no VM and uses the
+ * host metric definitions directly.
+ */
+typedef struct _vm_metrics {
+   vu_vm *vm;
+   metric *insts;
+   int num;
+   vu_buffer *buf[METRIC_FORMAT_COUNT];   /* fragments, all or none */
+} vm_metrics;
+
+/* Running VMs found by the last update */
+static vm_metrics *vm_table = NULL;
+static int vm_table_num = 0;
+static vm_metrics host_entry;
 
-   while (m) {
-      if (m->ctx != METRIC_CONTEXT_HOST) {
-         m = m->next;
-         continue;
-      }
-      
-      if (metric_xml(m, buf))
-         vu_log(VHOSTMD_ERR, "Error retrieving metric %s", m->name);
-         
-      m = m->next;
-   }
+/*
+ * Timer wheel scheduling metrics with an interval.  Time is counted in
+ * updates; a timer expiring at tick t is kept in slot t % WHEEL_SLOTS.
+ * Metrics without an interval are not scheduled and always due.
+ */
+#define WHEEL_SLOTS 64
 
-   if (transports & VIRTIO)
-      virtio_metrics_update(&buf->content[start], (int) (buf->use - start),
-                            0, "Dom0");
+typedef struct _metric_timer {
+   metric *m;
+   unsigned long expires;
+   struct _metric_timer *next;
+} metric_timer;
 
-   return 0;
+static metric_timer *wheel[WHEEL_SLOTS];
+static unsigned long wheel_tick = 0;
+
+static void wheel_add(metric_timer *t)
+{
+   metric_timer **slot = &wheel[t->expires % WHEEL_SLOTS];
+
+   t->next = *slot;
+   *slot = t;
 }
 
-static int metrics_vm_get(vu_vm *vm, vu_buffer *buf)
+/*
+ * Schedule all metrics with an interval for the first update.
+ */
+static int wheel_schedule(metric *m)
 {
-   metric *m = metrics;
-   unsigned    start = buf->use;
+   metric_timer *t;
 
-   while (m) {
-      if (m->ctx != METRIC_CONTEXT_VM) {
-         m = m->next;
-         continue;
-      }
-      m->vm = vm;
-      if (metric_xml(m, buf))
-         vu_log(VHOSTMD_ERR, "Error retrieving metric %s", m->name);
-         
-      m = m->next;
+   if (m->interval == 0)
+      return 0;
+
+   if ((t = calloc(1, sizeof(metric_timer))) == NULL) {
+      vu_log(VHOSTMD_ERR, "calloc: %m");
+      return -1;
    }
+   t->m = m;
+   t->expires = wheel_tick;
+   wheel_add(t);
+
+   return 0;
+}
+
+static int wheel_init(void)
+{
+   int i;
 
-   if (transports & VIRTIO)
-      virtio_metrics_update(&buf->content[start], (int) (buf->use - start),
-                            vm->id, vm->name);
+   for (i = 0; i < conf.metrics.num_host; i++)
+      if (wheel_schedule(&conf.metrics.host[i]))
+         return -1;
+   for (i = 0; i < conf.metrics.num_vm; i++)
+      if (wheel_schedule(&conf.metrics.vm[i]))
+         return -1;
 
    return 0;
 }
 
-static int metrics_vms_get(vu_buffer *buf, int **ids)
+static void wheel_fini(void)
 {
-   int num_vms;
+   metric_timer *t;
    int i;
 
-   *ids = NULL;
-   
-   num_vms = vu_num_vms();
-   if (num_vms == -1)
-      return -1;
-   if (num_vms == 0)
+   for (i = 0; i < WHEEL_SLOTS; i++) {
+      while ((t = wheel[i])) {
+         wheel[i] = t->next;
+         free(t);
+      }
+   }
+}
+
+/*
+ * Advance the wheel by one update and flag the metrics that are due.
+ */
+static void wheel_advance(void)
+{
+   metric_timer **tp = &wheel[wheel_tick % WHEEL_SLOTS];
+   metric_timer *expired = NULL;
+   metric_timer *t;
+   int i;
+
+   for (i = 0; i < conf.metrics.num_host; i++)
+      conf.metrics.host[i].due = (conf.metrics.host[i].interval == 0);
+   for (i = 0; i < conf.metrics.num_vm; i++)
+      conf.metrics.vm[i].due = (conf.metrics.vm[i].interval == 0);
+
+   while ((t = *tp)) {
+      if (t->expires != wheel_tick) {
+         tp = &t->next;
+         continue;
+      }
+      *tp = t->next;
+      t->next = expired;
+      expired = t;
+   }
+
+   while ((t = expired)) {
+      expired = t->next;
+      t->m->due = 1;
+
+      if (t->m->interval == METRIC_INTERVAL_ONCE) {
+         free(t);
+         continue;
+      }
+      /* intervals are rounded up to whole update periods */
+      t->expires = wheel_tick +
+         ((unsigned long) t->m->interval * 1000 + conf.update_period - 1) /
+         (unsigned long) conf.update_period;
+      wheel_add(t);
+   }
+
+   wheel_tick++;
+}
+
+/*
+ * Whether metric m, a copy of def, is collected in this update.  Metrics
+ * without a valid value are collected until they have one.
+ */
+static int metric_needed(metric *def, metric *m)
+{
+   return def->due || m->value == NULL || m->status;
+}
+
+/*
+ * Collect one metric.  Runs on the worker pool.
+ */
+static void metric_collect_task(void *arg)
+{
+   metric_value_get((metric *) arg);
+}
+
+/*
+ * Add the metrics of the host, or of one VM, that are collected in this
+ * update to tasks.  Derived metrics are computed when formatting.
+ */
+static int metrics_collect_add(vm_metrics *vmm, void **tasks, int n)
+{
+   metric *m;
+   int j;
+
+   if (vmm->vm == NULL) {
+      for (j = 0; j < conf.metrics.num_host; j++) {
+         m = &conf.metrics.host[j];
+         if (m->expr == NULL && metric_needed(m, m))
+            tasks[n++] = m;
+      }
+      return n;
+   }
+
+   /* the copies are in the order of the vm metric definitions */
+   for (j = 0; j < vmm->num; j++) {
+      m = &vmm->insts[j];
+      if (m->expr == NULL && metric_needed(&conf.metrics.vm[j], m))
+         tasks[n++] = m;
+   }
+   return n;
+}
+
+/*
+ * Get the value of a metric used by a derived metric of the VM, or of
+ * the host, in opaque.
+ */
+static int derived_value(int ref, void *opaque, double *val)
+{
+   const vm_metrics *vmm = (const vm_metrics *) opaque;
+   const metric_ref *r = &conf.metrics.refs[ref];
+
+   if (r->sum) {
+      *val = r->total;
       return 0;
+   }
+   if (r->ctx == METRIC_CONTEXT_HOST)
+      return metric_value_real(&conf.metrics.host[r->index], r->var, val);
+   return metric_value_real(&vmm->insts[r->index], r->var, val);
+}
+
+/*
+ * Add up the values of all VMs for the sum() terms of derived metrics,
+ * once all VMs have been collected.  VMs without a value are left out.
+ */
+static void derived_sums_update(int num_vms)
+{
+   metric_ref *r;
+   double v;
+   int i, k;
+
+   for (k = 0; k < conf.metrics.num_refs; k++) {
+      r = &conf.metrics.refs[k];
+      if (!r->sum)
+         continue;
+
+      r->total = 0;
+      for (i = 0; i < num_vms; i++) {
+         if (r->index < vm_table[i].num &&
+             metric_value_real(&vm_table[i].insts[r->index], r->var, &v) == 0)
+            r->total += v;
+      }
+   }
+}
+
+static void metric_derive(metric *m, vm_metrics *vmm)
+{
+   double v;
+
+   if (m->state == NULL && (m->state = derived_state_new(m->expr)) == NULL) {
+      m->status = -1;
+      return;
+   }
+
+   if (derived_eval(m->expr, derived_value, vmm, m->state, &v))
+      m->status = METRIC_NO_VALUE;
+   else
+      metric_value_set(m, v);
+}
+
+/*
+ * Compute the derived metrics of one VM, or of the host, and join the
+ * output of all its metrics into the entry's buffers.  Runs on the
+ * worker pool after all entries have been collected, so derived
+ * metrics see the values of the current update.  A metric is only
+ * rendered again when its value changed.  Formats that group the
+ * metrics of a VM get the group around them, left out if it is empty.
+ */
+static void metrics_format_task(void *arg)
+{
+   vm_metrics *vmm = (vm_metrics *) arg;
+   const metric_serializer *s;
+   const vu_buffer *frag;
+   metric *insts;
+   uint64_t hash;
+   int n[METRIC_FORMAT_COUNT];
+   int num;
+   int failed;
+   int f, j;
+
+   if (vmm->vm == NULL) {
+      insts = conf.metrics.host;
+      num = conf.metrics.num_host;
+   }
+   else {
+      insts = vmm->insts;
+      num = vmm->num;
+   }
+
+   for (j = 0; j < num; j++) {
+      if (insts[j].expr)
+         metric_derive(&insts[j], vmm);
+   }
+
+   if (conf.formats == 0)
+      return;
+
+   for (f = 0; f < METRIC_FORMAT_COUNT; f++) {
+      n[f] = 0;
+      if (!(conf.formats & (1U << f)))
+         continue;
+      vu_buffer_erase(vmm->buf[f]);
+      s = metric_serializer_get(f);
+      if (vmm->vm && s->vm_head)
+         s->vm_head(vmm->buf[f], vmm->vm);
+   }
+
+   for (j = 0; j < num; j++) {
+      hash = metric_output_hash(&insts[j]);
+      failed = 0;
+
+      for (f = 0; f < METRIC_FORMAT_COUNT; f++) {
+         if (!(conf.formats & (1U << f)))
+            continue;
+         if (metric_fragment(&insts[j], f, hash, &frag))
+            failed = 1;
+         else
+            metric_fragment_add(metric_serializer_get(f), vmm->buf[f],
+                                frag, &n[f]);
+      }
+
+      if (failed)
+         vu_log(VHOSTMD_ERR, "Error retrieving metric %s",
+                insts[j].info->name);
+   }
+
+   for (f = 0; f < METRIC_FORMAT_COUNT; f++) {
+      s = metric_serializer_get(f);
+      if (!(conf.formats & (1U << f)) || vmm->vm == NULL || !s->vm_head)
+         continue;
+      if (n[f])
+         vu_buffer_add(vmm->buf[f], s->vm_tail, -1);
+      else
+         vu_buffer_erase(vmm->buf[f]);
+   }
+}
+
+static void vm_metrics_bufs_free(vm_metrics *vmm)
+{
+   int f;
+
+   for (f = 0; f < METRIC_FORMAT_COUNT; f++) {
+      if (vmm->buf[f])
+         vu_buffer_delete(vmm->buf[f]);
+      vmm->buf[f] = NULL;
+   }
+}
+
+/*
+ * Allocate a fragment buffer for each format.  On failure none is
+ * allocated.
+ */
+static int vm_metrics_bufs_create(vm_metrics *vmm)
+{
+   int f;
+
+   for (f = 0; f < METRIC_FORMAT_COUNT; f++) {
+      if (vu_buffer_create(&vmm->buf[f], 1024)) {
+         vmm->buf[f] = NULL;
+         vm_metrics_bufs_free(vmm);
+         return -1;
+      }
+   }
+   return 0;
+}
+
+static void vm_metrics_clear(vm_metrics *vmm)
+{
+   int j;
+
+   for (j = 0; j < vmm->num; j++) {
+      free(vmm->insts[j].value);
+      free(vmm->insts[j].slots);
+      free(vmm->insts[j].samples);
+      free(vmm->insts[j].state);
+      metric_fragments_free(&vmm->insts[j]);
+   }
+   free(vmm->insts);
+   vu_vm_free(vmm->vm);
+   vm_metrics_bufs_free(vmm);
+   vmm->insts = NULL;
+   vmm->vm = NULL;
+   vmm->num = 0;
+}
+
+static void vm_metrics_free(vm_metrics *vmms, int num_vms)
+{
+   int i;
+
+   if (vmms == NULL)
+      return;
+
+   for (i = 0; i < num_vms; i++)
+      vm_metrics_clear(&vmms[i]);
+   free(vmms);
+}
+
+/*
+ * Create the metric copies for a VM that was not running before.
+ */
+static void vm_metrics_init(vm_metrics *vmm, vu_vm *vm, int num_metrics)
+{
+   int k;
+
+   vmm->vm = vm;
+   if (vm_metrics_bufs_create(vmm)) {
+      vu_log (VHOSTMD_ERR, "Unable to allocate memory");
+      return;
+   }
+   if (num_metrics == 0)
+      return;
+
+   vmm->insts = calloc(num_metrics, sizeof(metric));
+   if (vmm->insts == NULL) {
+      vu_log (VHOSTMD_ERR, "calloc: %m");
+      return;
+   }
+
+   for (k = 0; k < num_metrics; k++) {
+      vmm->insts[k] = conf.metrics.vm[k];
+      vmm->insts[k].value = NULL;
+      vmm->insts[k].value_size = 0;
+      vmm->insts[k].slots = NULL;
+      vmm->insts[k].status = 0;
+      vmm->insts[k].samples = NULL;
+      vmm->insts[k].state = NULL;
+      vmm->insts[k].cache = NULL;
+      vmm->insts[k].vm = vm;
+   }
+   vmm->num = num_metrics;
+}
+
+/*
+ * Look up the running VMs and update the VM table.  VMs that were
+ * running before keep their metric copies, matched by UUID.  The VMs
+ * are listed together with the statistics needed by VM builtins.
+ * Returns the number of VMs or -1 on failure.
+ */
+static int vm_metrics_update(int **ids)
+{
+   vm_metrics *table;
+   vu_vm **vms;
+   int num_vms;
+   int num_metrics = conf.metrics.num_vm;
+   int i, j, k;
+
+   *ids = NULL;
+
+   num_vms = vu_list_vms(&vms, conf.metrics.vm_stats);
+   if (num_vms == -1)
+      goto error;
    
-   *ids = calloc(num_vms, sizeof(int));
-   if (*ids == NULL) {
+   *ids = calloc(num_vms + 1, sizeof(int));
+   table = calloc(num_vms + 1, sizeof(vm_metrics));
+   if (*ids == NULL || table == NULL) {
       vu_log (VHOSTMD_ERR, "calloc: %m");
-      return -1;
+      vu_vms_free(vms, num_vms);
+      free(*ids);
+      free(table);
+      *ids = NULL;
+      goto error;
    }
 
-   num_vms = vu_get_vms(*ids, num_vms);
+   /* both the VMs and the table are sorted by UUID */
+   j = 0;
    for (i = 0; i < num_vms; i++) {
-      vu_vm *vm;
-      
-      vm = vu_get_vm((*ids)[i]);
-      if (vm == NULL)
+      (*ids)[i] = vms[i]->id;
+
+      while (j < vm_table_num && (vm_table[j].vm == NULL ||
+             strcmp(vm_table[j].vm->uuid, vms[i]->uuid) < 0))
+         j++;
+      if (j == vm_table_num ||
+          strcmp(vm_table[j].vm->uuid, vms[i]->uuid) != 0) {
+         vm_metrics_init(&table[i], vms[i], num_metrics);
          continue;
-      
-      metrics_vm_get(vm, buf);
-      vu_vm_free(vm);
-   }
+      }
+
+      table[i] = vm_table[j];
+      table[i].vm = vms[i];
+      for (k = 0; k < table[i].num; k++)
+         table[i].insts[k].vm = vms[i];
+      vu_vm_free(vm_table[j].vm);
+      vm_table[j].vm = NULL;
+      vm_table[j].insts = NULL;
+      vm_table[j].num = 0;
+      memset(vm_table[j].buf, 0, sizeof(vm_table[j].buf));
+   }
+   /* the VMs are owned by the table now */
+   free(vms);
+
+   vm_metrics_free(vm_table, vm_table_num);
+   vm_table = table;
+   vm_table_num = num_vms;
    
    return num_vms;
+
+ error:
+   vm_metrics_free(vm_table, vm_table_num);
+   vm_table = NULL;
+   vm_table_num = 0;
+   return -1;
+}
+
+/*
+ * Join the fragments of format f of the host and all VMs into the
+ * document buf.
+ */
+static void metrics_document(vu_buffer *buf, metric_format f, int num_vms)
+{
+   const metric_serializer *s = metric_serializer_get(f);
+   int i, n = 0;
+
+   vu_buffer_erase(buf);
+   vu_buffer_add(buf, s->head, -1);
+   metric_fragment_add(s, buf, host_entry.buf[f], &n);
+   for (i = 0; i < num_vms; i++) {
+      if (vm_table[i].buf[f])
+         metric_fragment_add(s, buf, vm_table[i].buf[f], &n);
+   }
+   vu_buffer_add(buf, s->tail, -1);
+}
+
+/*
+ * Update the host and all VMs on the worker pool: every metric is
+ * collected as a task of its own, so an update takes as long as its
+ * slowest action, then the host and each VM are formatted as one task.
+ * Join their output in the documents of the disk and xenstore and pass
+ * it on to virtio.
+ */
+static void metrics_update(vu_buffer **docs, int num_vms)
+{
+   void **tasks, **entries;
+   int f, i, n = 0, num = 0;
+
+   tasks = calloc(conf.metrics.num_host +
+                  (size_t) num_vms * conf.metrics.num_vm + 1, sizeof(void *));
+   entries = calloc(num_vms + 2, sizeof(void *));
+   if (tasks == NULL || entries == NULL) {
+      vu_log (VHOSTMD_ERR, "calloc: %m");
+      free(tasks);
+      free(entries);
+      return;
+   }
+
+   entries[num++] = &host_entry;
+   for (i = 0; i < num_vms; i++)
+      if (vm_table[i].buf[0])
+         entries[num++] = &vm_table[i];
+
+   for (i = 0; i < num; i++)
+      n = metrics_collect_add(entries[i], tasks, n);
+
+   pool_run(metric_collect_task, tasks, n);
+   derived_sums_update(num_vms);
+   pool_run(metrics_format_task, entries, num);
+   free(tasks);
+   free(entries);
+
+   for (f = 0; f < METRIC_FORMAT_COUNT; f++) {
+      if (conf.doc_formats & (1U << f))
+         metrics_document(docs[f], f, num_vms);
+   }
+
+   if (!(conf.transports & VIRTIO))
+      return;
+
+   virtio_metrics_update(host_entry.buf, 0, "Dom0");
+   for (i = 0; i < num_vms; i++) {
+      vm_metrics *vmm = &vm_table[i];
+
+      if (vmm->buf[0])
+         virtio_metrics_update(vmm->buf, vmm->vm->id, vmm->vm->name);
+   }
+}
+
+/* Add a string to the binary disk's string table, returning its offset */
+static uint32_t mdisk2_string(vu_buffer *strings, const char *str, size_t len)
+{
+   uint32_t off = strings->use;
+
+   if (len == 0)
+      return 0;
+   vu_buffer_add(strings, str, (int) len);
+   vu_buffer_add(strings, "", 1);
+   return off;
 }
 
+/* Add a record for variable x->var of metric m, if it has a value */
+static void mdisk2_record_add(vu_buffer *out, vu_buffer *strings,
+                              const metric *m, const metric_index *x,
+                              uint32_t uuid)
+{
+   const metric_slot *s;
+   mdisk2_record r;
+   uint64_t v;
+   uint32_t off;
+   double d;
+
+   if (m->status || m->slots == NULL || !m->slots[x->var].valid)
+      return;
+   s = &m->slots[x->var];
+
+   switch (x->def->type) {
+      case M_INT32:
+         v = (uint64_t) (int64_t) s->v.i32;
+         break;
+      case M_UINT32:
+         v = s->v.u32;
+         break;
+      case M_INT64:
+         v = (uint64_t) s->v.i64;
+         break;
+      case M_UINT64:
+         v = s->v.u64;
+         break;
+      case M_REAL32:
+      case M_REAL64:
+         d = x->def->type == M_REAL32 ? (double) s->v.r32 : s->v.r64;
+         memcpy(&v, &d, sizeof(v));
+         break;
+      case M_STRING:
+         off = mdisk2_string(strings, m->value + s->v.str.off, s->v.str.len);
+         v = ((uint64_t) off << 32) | s->v.str.len;
+         break;
+      default:
+         return;
+   }
+
+   memset(&r, 0, sizeof(r));
+   r.context = m->ctx == METRIC_CONTEXT_HOST ? MDISK2_HOST : MDISK2_VM;
+   r.type = (uint8_t) x->def->type;
+   r.flags = m->stale ? MDISK2_STALE : 0;
+   r.vm_id = (int32_t) htonl(m->vm ? (uint32_t) m->vm->id : (uint32_t) -1);
+   r.uuid = htonl(uuid);
+   r.name = htonl(x->name);
+   r.unit = htonl(x->unit);
+   r.value = htobe64(v);
+   vu_buffer_add(out, (const char *) &r, MDISK2_RECORD_SIZE);
+}
+
+/* Set the string offsets of the names and units of the variables */
+static void mdisk2_names_add(vu_buffer *strings, metric_index *order, int num)
+{
+   int i;
+
+   for (i = 0; i < num; i++) {
+      order[i].name = mdisk2_string(strings, order[i].def->name,
+                                    strlen(order[i].def->name));
+      order[i].unit = order[i].def->unit ?
+         mdisk2_string(strings, order[i].def->unit,
+                       strlen(order[i].def->unit)) : 0;
+   }
+}
+
+/*
+ * Encode the values of the last update in the binary disk format.
+ * Variables are sorted by name at load time and the VMs are sorted by
+ * UUID, so the records are written in index order without sorting.
+ */
+static void metrics_binary(vu_buffer *out, vu_buffer *strings, int num_vms)
+{
+   const metric_registry *reg = &conf.metrics;
+   mdisk2_content hdr;
+   vm_metrics *vmm;
+   uint32_t uuid;
+   uint32_t count;
+   int i, j;
+
+   vu_buffer_erase(out);
+   vu_buffer_erase(strings);
+
+   /* the content header is filled in once the sizes are known */
+   memset(&hdr, 0, sizeof(hdr));
+   vu_buffer_add(out, (const char *) &hdr, sizeof(hdr));
+   vu_buffer_add(strings, "", 1);
+
+   mdisk2_names_add(strings, reg->host_order, reg->num_host_order);
+   mdisk2_names_add(strings, reg->vm_order, reg->num_vm_order);
+
+   for (j = 0; j < reg->num_host_order; j++)
+      mdisk2_record_add(out, strings, &reg->host[reg->host_order[j].index],
+                        &reg->host_order[j], 0);
+
+   for (i = 0; i < num_vms; i++) {
+      vmm = &vm_table[i];
+      if (vmm->vm == NULL || vmm->insts == NULL)
+         continue;
+
+      uuid = mdisk2_string(strings, vmm->vm->uuid, strlen(vmm->vm->uuid));
+      for (j = 0; j < reg->num_vm_order; j++) {
+         if (reg->vm_order[j].index < vmm->num)
+            mdisk2_record_add(out, strings,
+                              &vmm->insts[reg->vm_order[j].index],
+                              &reg->vm_order[j], uuid);
+      }
+   }
+
+   count = (out->use - sizeof(hdr)) / MDISK2_RECORD_SIZE;
+   hdr.count = htonl(count);
+   hdr.index = htonl(sizeof(hdr));
+   hdr.strings = htonl(out->use);
+   hdr.strings_len = htonl(strings->use);
+   if (out->content)
+      memcpy(out->content, &hdr, sizeof(hdr));
+
+   vu_buffer_add(out, strings->content, strings->use);
+}
+
+static void timespec_add_ms(struct timespec *ts, int ms)
+{
+   ts->tv_sec += ms / 1000;
+   ts->tv_nsec += (long) (ms % 1000) * 1000000;
+   if (ts->tv_nsec >= 1000000000) {
+      ts->tv_sec++;
+      ts->tv_nsec -= 1000000000;
+   }
+}
+
+static int timespec_cmp(const struct timespec *a, const struct timespec *b)
+{
+   if (a->tv_sec != b->tv_sec)
+      return a->tv_sec < b->tv_sec ? -1 : 1;
+   if (a->tv_nsec != b->tv_nsec)
+      return a->tv_nsec < b->tv_nsec ? -1 : 1;
+   return 0;
+}
+
+static long timespec_diff_ms(const struct timespec *a, const struct timespec *b)
+{
+   return (a->tv_sec - b->tv_sec) * 1000 +
+          (a->tv_nsec - b->tv_nsec) / 1000000;
+}
+
+/*
+ * Start the virtio transport of the current configuration.
+ */
+static int virtio_start(pthread_t *tid)
+{
+   int rc;
+
+   if (virtio_init(conf.virtio_channel_path, conf.virtio_max_channels,
+                   conf.virtio_expiration_time, conf.virtio_formats))
+      return -1;
+
+   rc = pthread_create(tid, NULL, virtio_run, NULL);
+   if (rc != 0) {
+      vu_log(VHOSTMD_ERR, "Failed to start virtio thread '%s'\n",
+             strerror(rc));
+      return -1;
+   }
+
+   return 0;
+}
+
+/*
+ * Whether the virtio transport must be restarted for configuration b
+ * to replace a.
+ */
+static int virtio_changed(const vhostmd_config *a, const vhostmd_config *b)
+{
+   if ((a->transports & VIRTIO) != (b->transports & VIRTIO))
+      return 1;
+   if (!(b->transports & VIRTIO))
+      return 0;
+
+   return strcmp(a->virtio_channel_path, b->virtio_channel_path) ||
+          a->virtio_formats != b->virtio_formats ||
+          a->virtio_max_channels != b->virtio_max_channels ||
+          a->virtio_expiration_time != b->virtio_expiration_time;
+}
+
+/*
+ * Read the configuration file again and swap the new metrics in
+ * between two updates.  The metrics disk, worker pool and virtio
+ * transport are kept unless their settings changed.  If the file is
+ * not valid the current configuration stays in use.
+ */
+static int vhostmd_reload(const char *cfile, int *diskfd, pthread_t *virtio_tid)
+{
+   vhostmd_config cfg = config_defaults;
+   int start_virtio = 0;
+   char *path;
+   int fd;
+
+   vu_log(VHOSTMD_INFO, "Reloading configuration file %s", cfile);
+
+   if (validate_config_file(cfile) || parse_config_file(cfile, &cfg) ||
+       check_config(&cfg)) {
+      vu_log(VHOSTMD_ERR, "Configuration file %s is not valid, keeping "
+             "the current configuration", cfile);
+      config_free(&cfg);
+      return -1;
+   }
+
+   /* a new disk is the only step that can fail, so it comes first */
+   if (strcmp(cfg.mdisk_path, conf.mdisk_path) ||
+       cfg.mdisk_size != conf.mdisk_size) {
+      if ((fd = metrics_disk_create(&cfg)) < 0) {
+         vu_log(VHOSTMD_ERR, "Failed to create metrics disk %s, keeping "
+                "the current configuration", cfg.mdisk_path);
+         config_free(&cfg);
+         return -1;
+      }
+      metrics_disk_close(*diskfd);
+      *diskfd = fd;
+   }
+
+   if (cfg.num_workers != conf.num_workers) {
+      pool_fini();
+      if (pool_init(cfg.num_workers)) {
+         vu_log(VHOSTMD_ERR, "Failed to start worker pool, updating "
+                "in the main thread");
+         cfg.num_workers = 1;
+      }
+   }
+
+   if (virtio_changed(&conf, &cfg)) {
+      if (conf.transports & VIRTIO) {
+         virtio_stop();
+         pthread_join(*virtio_tid, NULL);
+      }
+      start_virtio = (cfg.transports & VIRTIO) != 0;
+   }
+   else if (cfg.transports & VIRTIO) {
+      /* the running transport keeps the channel path it was given */
+      path = cfg.virtio_channel_path;
+      cfg.virtio_channel_path = conf.virtio_channel_path;
+      conf.virtio_channel_path = path;
+   }
+
+   /* drop everything that refers to the current metrics, then swap */
+   vm_metrics_free(vm_table, vm_table_num);
+   vm_table = NULL;
+   vm_table_num = 0;
+   wheel_fini();
+   metric_results_free();
+   config_free(&conf);
+   conf = cfg;
+
+   if (conf.search_path)
+      setenv("PATH", conf.search_path, 1);
+
+   if (wheel_init())
+      vu_log(VHOSTMD_ERR, "Failed to schedule metrics with an interval");
+
+   if (start_virtio && virtio_start(virtio_tid)) {
+      vu_log(VHOSTMD_ERR, "Failed to restart virtio transport");
+      conf.transports &= ~VIRTIO;
+   }
+
+   vu_log(VHOSTMD_INFO, "Reloaded configuration with %d host and %d vm "
+          "metrics", conf.metrics.num_host, conf.metrics.num_vm);
+   return 0;
+}
 
 /* Main run loop for vhostmd */
-static int vhostmd_run(int diskfd)
+static int vhostmd_run(const char *cfile, int *diskfd)
 {
    int *ids = NULL;
    int num_vms = 0;
-   vu_buffer *buf = NULL;
+   vu_buffer *docs[METRIC_FORMAT_COUNT] = { NULL };
+   vu_buffer *bin = NULL;
+   vu_buffer *strings = NULL;
    pthread_t virtio_tid;
+   struct timespec next, now;
+   unsigned long overruns = 0;
+   int f;
    
-   if (vu_buffer_create(&buf, MDISK_SIZE_MIN - MDISK_HEADER_SIZE)) {
-      vu_log(VHOSTMD_ERR, "Unable to allocate memory");
-      return -1;
+   for (f = 0; f < METRIC_FORMAT_COUNT; f++) {
+      if (vu_buffer_create(&docs[f], MDISK_SIZE_MIN - MDISK_HEADER_SIZE)) {
+         docs[f] = NULL;
+         vu_log(VHOSTMD_ERR, "Unable to allocate memory");
+         goto error;
+      }
    }
 
-   if (transports & VIRTIO) {
-      int rc;
+   if (vu_buffer_create(&bin, MDISK_SIZE_MIN - MDISK_HEADER_SIZE) ||
+       vu_buffer_create(&strings, 1024)) {
+      vu_log(VHOSTMD_ERR, "Unable to allocate memory");
+      goto error;
+   }
 
-      if (virtio_expiration_time < (update_period * 3))
-         virtio_expiration_time = update_period * 3;
+   if (vm_metrics_bufs_create(&host_entry)) {
+      vu_log(VHOSTMD_ERR, "Unable to allocate memory");
+      goto error;
+   }
 
-      if (virtio_init(virtio_channel_path, virtio_max_channels, virtio_expiration_time)) {
-         vu_buffer_delete(buf);
-         return -1;
-      }
+   if (wheel_init()) {
+      wheel_fini();
+      vm_metrics_clear(&host_entry);
+      goto error;
+   }
 
-      rc = pthread_create(&virtio_tid, NULL, virtio_run, NULL);
+   if ((conf.transports & VIRTIO) && virtio_start(&virtio_tid)) {
+      wheel_fini();
+      vm_metrics_clear(&host_entry);
+      goto error;
+   }
 
-      if (rc != 0) {
-         vu_log(VHOSTMD_ERR, "Failed to start virtio thread '%s'\n",
-                strerror(rc));
-         vu_buffer_delete(buf);
-         return -1;
+   if (pool_init(conf.num_workers)) {
+      vu_log(VHOSTMD_ERR, "Failed to start worker pool");
+      if (conf.transports & VIRTIO) {
+         virtio_stop();
+         pthread_join(virtio_tid, NULL);
       }
+      wheel_fini();
+      vm_metrics_clear(&host_entry);
+      goto error;
    }
    
+   /* updates start at absolute multiples of the period, so they don't drift */
+   clock_gettime(CLOCK_MONOTONIC, &next);
+
    while (!down) {
-      time_t run_time,
-             start_time = time(NULL);
+      struct timespec start;
 
-      vu_buffer_add(buf, "<metrics>\n", -1);
-      if (metrics_host_get(buf))
-         vu_log(VHOSTMD_ERR, "Failed to collect host metrics "
-                     "during update");
+      if (reload) {
+         reload = 0;
+         vhostmd_reload(cfile, diskfd, &virtio_tid);
+         /* the period may have changed, start a new schedule */
+         clock_gettime(CLOCK_MONOTONIC, &next);
+      }
+
+      clock_gettime(CLOCK_MONOTONIC, &start);
 
-      if ((num_vms = metrics_vms_get(buf, &ids)) == -1)
+      if ((num_vms = vm_metrics_update(&ids)) == -1)
          vu_log(VHOSTMD_ERR, "Failed to collect vm metrics "
                      "during update");
 
-      vu_buffer_add(buf, "</metrics>\n", -1);
-      if (transports & VBD)
-         metrics_disk_update(diskfd, buf);
+      wheel_advance();
+      metric_results_expire();
+      metrics_update(docs, num_vms);
+
+      if ((conf.transports & VBD) &&
+          conf.mdisk_format == MDISK_FORMAT_BINARY) {
+         metrics_binary(bin, strings, num_vms);
+         metrics_disk_update(*diskfd, bin);
+      }
+      else if (conf.transports & VBD)
+         metrics_disk_update(*diskfd,
+                             docs[mdisk_metric_format(conf.mdisk_format)]);
 #ifdef WITH_XENSTORE
-      if (transports & XENSTORE)
-         metrics_xenstore_update(buf->content, ids, num_vms);
+      if (conf.transports & XENSTORE)
+         metrics_xenstore_update(docs[conf.xenstore_format]->content, ids,
+                                 num_vms);
 #endif
       if (ids)
           free(ids);
 
-      run_time = time(NULL) - start_time;
-      if ((run_time > 0) && (run_time < update_period))
-         sleep((unsigned int) (update_period - run_time));
+      timespec_add_ms(&next, conf.update_period);
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      if (timespec_cmp(&now, &next) >= 0) {
+         /* skip the periods missed and stay on the original schedule */
+         long missed = 0;
 
-      vu_buffer_erase(buf);
-   }
-   vu_buffer_delete(buf);
+         while (timespec_cmp(&now, &next) >= 0) {
+            timespec_add_ms(&next, conf.update_period);
+            missed++;
+         }
+         overruns++;
+         vu_log(VHOSTMD_WARN, "Update took %ld ms, overrunning the update "
+                "period of %d ms; skipping %ld period(s), %lu overrun(s) "
+                "so far", timespec_diff_ms(&now, &start), conf.update_period,
+                missed, overruns);
+      }
 
-   if (transports & VIRTIO) {
+      while (!down && !reload &&
+             clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next,
+                             NULL) == EINTR)
+         ;
+   }
+   for (f = 0; f < METRIC_FORMAT_COUNT; f++)
+      vu_buffer_delete(docs[f]);
+   vu_buffer_delete(bin);
+   vu_buffer_delete(strings);
+   pool_fini();
+   wheel_fini();
+   metric_results_free();
+   vm_metrics_free(vm_table, vm_table_num);
+   vm_table = NULL;
+   vm_table_num = 0;
+   vm_metrics_clear(&host_entry);
+
+   if (conf.transports & VIRTIO) {
       virtio_stop();
       pthread_join(virtio_tid, NULL);
    }
 
    return 0;
+
+ error:
+   for (f = 0; f < METRIC_FORMAT_COUNT; f++) {
+      if (docs[f])
+         vu_buffer_delete(docs[f]);
+   }
+   if (bin)
+      vu_buffer_delete(bin);
+   if (strings)
+      vu_buffer_delete(strings);
+   return -1;
 }
 
 static void usage(const char *argv0)
@@ -1159,28 +2703,30 @@ int main(int argc, char *argv[])
    xmlInitParser();
 
    if (validate_config_file(cfile)) {
-      xmlCleanupParser();
       vu_log(VHOSTMD_ERR, "Config file: %s, fails DTD validation ", cfile);
       goto out;
    }
 
-   if (parse_config_file(cfile)) {
-      xmlCleanupParser();
+   conf = config_defaults;
+   if (parse_config_file(cfile, &conf)) {
       vu_log(VHOSTMD_ERR, "Please ensure configuration file "
                   "%s exists and is valid", cfile);
       goto out;
    }
 
-   xmlCleanupParser();
-
-   if (check_config()) {
+   if (check_config(&conf)) {
       vu_log(VHOSTMD_ERR, "Configuration file %s contains invalid "
                   "setting(s)", cfile);
       goto out;
    }
 
-   if ((mdisk_fd = metrics_disk_create()) < 0) {
-      vu_log(VHOSTMD_ERR, "Failed to create metrics disk %s", mdisk_path);
+   if (conf.search_path)
+      setenv("PATH", conf.search_path, 1);
+
+   builtin_init();
+
+   if ((mdisk_fd = metrics_disk_create(&conf)) < 0) {
+      vu_log(VHOSTMD_ERR, "Failed to create metrics disk %s", conf.mdisk_path);
       goto out;
    }
 
@@ -1222,13 +2768,19 @@ int main(int argc, char *argv[])
 	       pw->pw_uid, pw->pw_gid);
    }
 
-   ret = vhostmd_run(mdisk_fd);
+   ret = vhostmd_run(cfile, &mdisk_fd);
 
  out:
    metrics_disk_close(mdisk_fd);
+   config_free(&conf);
+   coprocess_fini();
+   plugin_fini();
+   builtin_fini();
    if (pfile)
       unlink(pfile);
 
+   /* metric XML is validated during updates, keep the parser until exit */
+   xmlCleanupParser();
    vu_log_close();
    vu_vm_connect_close();
 
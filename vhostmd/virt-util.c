@@ -23,6 +23,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include <libvirt/libvirt.h>
 
 #include "util.h"
@@ -36,6 +37,37 @@ static virConnectPtr conn = NULL;
 
 const char *libvirt_uri = NULL;
 
+/*
+ * Running domains, sorted by UUID.  The table is filled by listing the
+ * domains once per connection and then kept up to date from lifecycle
+ * events, which the event loop thread delivers as domains start and
+ * stop.  vu_list_vms() takes the VMs from the table without asking
+ * libvirt for the list of domains.  Without events the domains are
+ * listed on every call.
+ */
+typedef struct _vm_entry {
+   virDomainPtr dom;
+   vu_vm *vm;
+} vm_entry;
+
+static vm_entry *vm_table = NULL;
+static int vm_table_num = 0;
+static int vm_table_size = 0;
+static int vm_table_valid = 0;
+static pthread_mutex_t vm_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int event_callback = -1;
+static int event_loop_started = 0;
+static volatile int event_loop_running = 0;
+static volatile int event_loop_quit = 0;
+static int event_thread_joinable = 0;
+static pthread_t event_thread;
+
+static int domain_event(virConnectPtr c, virDomainPtr dom, int event,
+                        int detail, void *opaque);
+static void vm_table_clear(void);
+static void event_loop_start(void);
+
 void
 conn_close_cb(virConnectPtr c,
               int reason ATTRIBUTE_UNUSED,
@@ -51,8 +83,16 @@ do_connect(void)
     if (connection == ESTABLISHED)
         return 0;
 
-    if (conn != NULL)
+    if (conn != NULL) {
+        if (event_callback != -1)
+            virConnectDomainEventDeregisterAny(conn, event_callback);
+        event_callback = -1;
         virConnectClose(conn);
+    }
+
+    /* the event loop must be set up before the connection is opened */
+    if (!event_loop_started)
+        event_loop_start();
 
     conn = virConnectOpenReadOnly(libvirt_uri);
     if (conn == NULL) {
@@ -68,43 +108,63 @@ do_connect(void)
         return -1;
     }
 
+    /* domains are listed again for the new connection */
+    pthread_mutex_lock(&vm_table_lock);
+    vm_table_clear();
+    pthread_mutex_unlock(&vm_table_lock);
+
+    if (event_loop_running) {
+        virConnectSetKeepAlive(conn, 5, 3);
+        /* cast via void (*)(void), which -Wcast-function-type accepts */
+        event_callback = virConnectDomainEventRegisterAny(conn, NULL,
+                                 VIR_DOMAIN_EVENT_ID_LIFECYCLE,
+                                 VIR_CONNECT_DOMAIN_EVENT_CALLBACK(
+                                     (void (*)(void)) domain_event),
+                                 NULL, NULL);
+        if (event_callback == -1)
+            vu_log(VHOSTMD_WARN, "Unable to register for domain events, "
+                   "listing domains on every update");
+    }
+
     connection = ESTABLISHED;
     return 0;
 }
 
-int vu_num_vms(void)
-{
-   if (do_connect () == -1) return -1;
-   return virConnectNumOfDomains(conn);
-}
+/*
+ * Statistics records of the last vu_list_vms() call.  The stats member
+ * of the returned VMs point into these records.
+ */
+static virDomainStatsRecordPtr *vm_stats = NULL;
 
-int vu_get_vms(int *ids, int max_ids)
+static unsigned int stats_to_virt(unsigned int stats)
 {
-   if (do_connect () == -1) return -1;
-   
-   return (virConnectListDomains(conn, ids, max_ids));
+   unsigned int virt_stats = 0;
+
+   if (stats & VU_STATS_CPU)
+      virt_stats |= VIR_DOMAIN_STATS_CPU_TOTAL;
+   if (stats & VU_STATS_BALLOON)
+      virt_stats |= VIR_DOMAIN_STATS_BALLOON;
+   if (stats & VU_STATS_VCPU)
+      virt_stats |= VIR_DOMAIN_STATS_VCPU;
+   if (stats & VU_STATS_INTERFACE)
+      virt_stats |= VIR_DOMAIN_STATS_INTERFACE;
+   if (stats & VU_STATS_BLOCK)
+      virt_stats |= VIR_DOMAIN_STATS_BLOCK;
+
+   return virt_stats;
 }
 
-vu_vm *vu_get_vm(int id)
+static vu_vm *vm_from_domain(virDomainPtr dom)
 {
    vu_vm *vm;
    const char *name;
-   virDomainPtr dom = NULL;
    char uuid[VIR_UUID_STRING_BUFLEN];
-   
-   if (do_connect () == -1) return NULL;
 
    vm = calloc(1, sizeof(vu_vm));
    if (vm == NULL)
       return NULL;
    
-   vm->id = id;
-   
-   dom = virDomainLookupByID(conn, id);
-   if (dom == NULL) {
-       vu_log(VHOSTMD_ERR, "Failed to lookup domain for id %d", id);
-       goto error;
-   }
+   vm->id = (int) virDomainGetID(dom);
 
    uuid[0] = '\0';
    virDomainGetUUIDString(dom, uuid);
@@ -114,15 +174,473 @@ vu_vm *vu_get_vm(int id)
    if (name)
        vm->name = strdup(name);
 
-   virDomainFree(dom);
+   if (vm->uuid == NULL || (name && vm->name == NULL)) {
+      vu_vm_free(vm);
+      return NULL;
+   }
+
    return vm;
+}
+
+static vu_vm *vm_dup(const vu_vm *src)
+{
+   vu_vm *vm;
+
+   if ((vm = calloc(1, sizeof(vu_vm))) == NULL)
+      return NULL;
+
+   vm->id = src->id;
+   vm->uuid = strdup(src->uuid);
+   if (src->name)
+      vm->name = strdup(src->name);
+
+   if (vm->uuid == NULL || (src->name && vm->name == NULL)) {
+      vu_vm_free(vm);
+      return NULL;
+   }
+
+   return vm;
+}
+
+static int vm_uuid_cmp(const void *a, const void *b)
+{
+   return strcmp((*(vu_vm * const *) a)->uuid, (*(vu_vm * const *) b)->uuid);
+}
+
+/*
+ * Find the table entry of the domain with UUID uuid.  Returns its index,
+ * or -1 with the index it would be inserted at in pos.  Called with
+ * vm_table_lock held, as are the other vm_table functions.
+ */
+static int vm_table_find(const char *uuid, int *pos)
+{
+   int lo = 0, hi = vm_table_num, mid, c;
+
+   while (lo < hi) {
+      mid = (lo + hi) / 2;
+      c = strcmp(vm_table[mid].vm->uuid, uuid);
+      if (c == 0)
+         return mid;
+      if (c < 0)
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+
+   if (pos)
+      *pos = lo;
+   return -1;
+}
+
+static void vm_entry_free(vm_entry *e)
+{
+   virDomainFree(e->dom);
+   vu_vm_free(e->vm);
+}
+
+static int vm_table_add(virDomainPtr dom)
+{
+   vm_entry *table;
+   vu_vm *vm;
+   int i, pos;
+
+   if ((vm = vm_from_domain(dom)) == NULL)
+      return -1;
+
+   /* a domain that was restarted gets a new id */
+   if ((i = vm_table_find(vm->uuid, &pos)) != -1) {
+      vm_entry_free(&vm_table[i]);
+      pos = i;
+   }
+   else {
+      if (vm_table_num == vm_table_size) {
+         int size = vm_table_size ? vm_table_size * 2 : 64;
+
+         table = realloc(vm_table, size * sizeof(vm_entry));
+         if (table == NULL) {
+            vu_vm_free(vm);
+            return -1;
+         }
+         vm_table = table;
+         vm_table_size = size;
+      }
+      memmove(&vm_table[pos + 1], &vm_table[pos],
+              (vm_table_num - pos) * sizeof(vm_entry));
+      vm_table_num++;
+   }
+
+   virDomainRef(dom);
+   vm_table[pos].dom = dom;
+   vm_table[pos].vm = vm;
+   return 0;
+}
+
+static void vm_table_remove(virDomainPtr dom)
+{
+   char uuid[VIR_UUID_STRING_BUFLEN];
+   int i;
+
+   if (virDomainGetUUIDString(dom, uuid) ||
+       (i = vm_table_find(uuid, NULL)) == -1)
+      return;
+
+   vm_entry_free(&vm_table[i]);
+   memmove(&vm_table[i], &vm_table[i + 1],
+           (vm_table_num - i - 1) * sizeof(vm_entry));
+   vm_table_num--;
+}
+
+static void vm_table_clear(void)
+{
+   int i;
+
+   for (i = 0; i < vm_table_num; i++)
+      vm_entry_free(&vm_table[i]);
+   vm_table_num = 0;
+   vm_table_valid = 0;
+}
+
+/*
+ * Fill the table with the running domains.  Events are registered
+ * before, so domains starting or stopping while the table is filled
+ * are applied after it, once the lock is released.
+ */
+static int vm_table_fill(void)
+{
+   virDomainPtr *doms = NULL;
+   int num, i;
+
+   vm_table_clear();
+
+   num = virConnectListAllDomains(conn, &doms, VIR_CONNECT_LIST_DOMAINS_ACTIVE);
+   if (num < 0) {
+      vu_log(VHOSTMD_ERR, "Failed to list domains");
+      return -1;
+   }
+
+   for (i = 0; i < num; i++) {
+      if (vm_table_add(doms[i]))
+         vu_log(VHOSTMD_ERR, "Failed to get domain information");
+      virDomainFree(doms[i]);
+   }
+   free(doms);
+
+   vm_table_valid = 1;
+   return 0;
+}
+
+/*
+ * Lifecycle event callback, run on the event loop thread.  Only started
+ * and stopped domains change the set of running domains.
+ */
+static int domain_event(virConnectPtr c, virDomainPtr dom, int event,
+                        int detail ATTRIBUTE_UNUSED,
+                        void *opaque ATTRIBUTE_UNUSED)
+{
+   if (c != conn)
+      return 0;
+
+   pthread_mutex_lock(&vm_table_lock);
+   if (vm_table_valid) {
+      if (event == VIR_DOMAIN_EVENT_STARTED) {
+         if (vm_table_add(dom))
+            vm_table_valid = 0;
+      }
+      else if (event == VIR_DOMAIN_EVENT_STOPPED)
+         vm_table_remove(dom);
+   }
+   pthread_mutex_unlock(&vm_table_lock);
 
- error:
-   virDomainFree(dom);
-   vu_vm_free(vm);
+   return 0;
+}
+
+static void *event_loop(void *arg ATTRIBUTE_UNUSED)
+{
+   while (!event_loop_quit) {
+      if (virEventRunDefaultImpl() < 0) {
+         vu_log(VHOSTMD_ERR, "Failed to run the libvirt event loop, "
+                "listing domains on every update");
+         break;
+      }
+   }
+
+   event_loop_running = 0;
    return NULL;
 }
 
+static void event_loop_start(void)
+{
+   event_loop_started = 1;
+
+   if (virEventRegisterDefaultImpl()) {
+      vu_log(VHOSTMD_WARN, "Unable to register the libvirt event loop");
+      return;
+   }
+
+   event_loop_running = 1;
+   if (pthread_create(&event_thread, NULL, event_loop, NULL)) {
+      vu_log(VHOSTMD_WARN, "Unable to start the libvirt event loop thread");
+      event_loop_running = 0;
+      return;
+   }
+   event_thread_joinable = 1;
+}
+
+static void event_loop_wakeup(int timer, void *opaque ATTRIBUTE_UNUSED)
+{
+   virEventRemoveTimeout(timer);
+}
+
+static void event_loop_stop(void)
+{
+   if (!event_thread_joinable)
+      return;
+
+   /* a timeout firing at once makes the loop check event_loop_quit */
+   event_loop_quit = 1;
+   if (event_loop_running)
+      virEventAddTimeout(0, event_loop_wakeup, NULL, NULL);
+   pthread_join(event_thread, NULL);
+   event_thread_joinable = 0;
+}
+
+/*
+ * Take the VMs from the domain table, with their statistics fetched by
+ * a single virDomainListGetStats() call if stats is set.  The list is
+ * allocated in *vms.  Returns the number of VMs, -1 on failure and -2
+ * if the domains must be listed.
+ */
+static int list_vms_table(vu_vm ***vms, unsigned int stats)
+{
+   virDomainStatsRecordPtr *records = NULL;
+   virDomainPtr *doms;
+   vu_vm **list;
+   int num, i, j = 0;
+
+   if (!vm_table_valid && vm_table_fill())
+      return -1;
+
+   /* the table may have grown while being filled */
+   if ((list = calloc(vm_table_num + 1, sizeof(vu_vm *))) == NULL) {
+      vu_log(VHOSTMD_ERR, "calloc: %m");
+      return -1;
+   }
+   *vms = list;
+
+   if (stats == 0) {
+      for (i = 0; i < vm_table_num; i++) {
+         if ((list[j] = vm_dup(vm_table[i].vm)) == NULL) {
+            vu_log(VHOSTMD_ERR, "Failed to get domain information");
+            continue;
+         }
+         j++;
+      }
+      return j;
+   }
+
+   if ((doms = calloc(vm_table_num + 1, sizeof(virDomainPtr))) == NULL)
+      return -1;
+   for (i = 0; i < vm_table_num; i++)
+      doms[i] = vm_table[i].dom;
+
+   num = virDomainListGetStats(doms, stats_to_virt(stats), &records, 0);
+   free(doms);
+   if (num < 0) {
+      /* a domain may have gone away unnoticed */
+      vm_table_clear();
+      return -2;
+   }
+
+   for (i = 0; i < num; i++) {
+      vu_vm *vm = vm_from_domain(records[i]->dom);
+
+      if (vm == NULL) {
+         vu_log(VHOSTMD_ERR, "Failed to get domain information");
+         continue;
+      }
+      vm->stats = records[i];
+      list[j++] = vm;
+   }
+   vm_stats = records;
+
+   return j;
+}
+
+/*
+ * List the running VMs, sorted by UUID.  They are taken from the domain
+ * table if it is kept up to date by events.  Otherwise, with stats set,
+ * a single virConnectGetAllDomainStats() call fetches the VMs together
+ * with their statistics, or else a single virConnectListAllDomains()
+ * call is made.
+ */
+int vu_list_vms(vu_vm ***vms, unsigned int stats)
+{
+   virDomainPtr *doms = NULL;
+   virDomainStatsRecordPtr *records = NULL;
+   vu_vm **list;
+   int num;
+   int i, j = 0;
+
+   *vms = NULL;
+
+   if (do_connect () == -1) return -1;
+
+   if (vm_stats) {
+      virDomainStatsRecordListFree(vm_stats);
+      vm_stats = NULL;
+   }
+
+   if (event_callback != -1 && event_loop_running) {
+      list = NULL;
+      pthread_mutex_lock(&vm_table_lock);
+      j = list_vms_table(&list, stats);
+      pthread_mutex_unlock(&vm_table_lock);
+
+      if (j >= 0) {
+         *vms = list;
+         /* the table is sorted, but the records may not be */
+         if (stats)
+            qsort(list, j, sizeof(vu_vm *), vm_uuid_cmp);
+         return j;
+      }
+      free(list);
+      if (j == -1)
+         return -1;
+      j = 0;
+   }
+
+   if (stats)
+      num = virConnectGetAllDomainStats(conn, stats_to_virt(stats), &records,
+                                        VIR_CONNECT_GET_ALL_DOMAINS_STATS_ACTIVE);
+   else
+      num = virConnectListAllDomains(conn, &doms,
+                                     VIR_CONNECT_LIST_DOMAINS_ACTIVE);
+   if (num < 0) {
+      vu_log(VHOSTMD_ERR, "Failed to list domains");
+      return -1;
+   }
+
+   list = calloc(num + 1, sizeof(vu_vm *));
+   if (list == NULL) {
+      vu_log(VHOSTMD_ERR, "calloc: %m");
+      j = -1;
+      goto out;
+   }
+
+   for (i = 0; i < num; i++) {
+      vu_vm *vm;
+
+      vm = vm_from_domain(records ? records[i]->dom : doms[i]);
+      if (vm == NULL) {
+         vu_log(VHOSTMD_ERR, "Failed to get domain information");
+         continue;
+      }
+      vm->stats = records ? records[i] : NULL;
+      list[j++] = vm;
+   }
+   qsort(list, j, sizeof(vu_vm *), vm_uuid_cmp);
+   *vms = list;
+
+ out:
+   if (doms) {
+      for (i = 0; i < num; i++)
+         virDomainFree(doms[i]);
+      free(doms);
+   }
+   if (j < 0 && records)
+      virDomainStatsRecordListFree(records);
+   else
+      vm_stats = records;
+
+   return j;
+}
+
+void vu_vms_free(vu_vm **vms, int num)
+{
+   int i;
+
+   if (vms == NULL)
+      return;
+
+   for (i = 0; i < num; i++)
+      vu_vm_free(vms[i]);
+   free(vms);
+}
+
+static int param_to_ull(virTypedParameterPtr param, unsigned long long *val)
+{
+   switch (param->type) {
+      case VIR_TYPED_PARAM_INT:
+         *val = (unsigned long long) param->value.i;
+         break;
+      case VIR_TYPED_PARAM_UINT:
+         *val = param->value.ui;
+         break;
+      case VIR_TYPED_PARAM_LLONG:
+         *val = (unsigned long long) param->value.l;
+         break;
+      case VIR_TYPED_PARAM_ULLONG:
+         *val = param->value.ul;
+         break;
+      case VIR_TYPED_PARAM_DOUBLE:
+         *val = (unsigned long long) param->value.d;
+         break;
+      case VIR_TYPED_PARAM_BOOLEAN:
+         *val = param->value.b ? 1 : 0;
+         break;
+      default:
+         return -1;
+   }
+
+   return 0;
+}
+
+/*
+ * Get the statistics value 'field' of a VM listed by vu_list_vms().
+ * Returns 0 on success, -1 if the VM has no such value.
+ */
+int vu_vm_stat(vu_vm *vm, const char *field, unsigned long long *val)
+{
+   virDomainStatsRecordPtr record = vm->stats;
+   int i;
+
+   if (record == NULL)
+      return -1;
+
+   for (i = 0; i < record->nparams; i++) {
+      if (strcmp(record->params[i].field, field) == 0)
+         return param_to_ull(&record->params[i], val);
+   }
+
+   return -1;
+}
+
+/*
+ * Sum up the statistics values 'group.<n>.field' of all devices of
+ * a group, e.g. the read bytes "block.<n>.rd.bytes" of all disks.
+ * Returns 0 on success, -1 if the VM has no statistics for group.
+ */
+int vu_vm_stat_sum(vu_vm *vm, const char *group, const char *field,
+                   unsigned long long *val)
+{
+   char name[128];
+   unsigned long long count, v;
+   unsigned long long i;
+
+   snprintf(name, sizeof(name), "%s.count", group);
+   if (vu_vm_stat(vm, name, &count))
+      return -1;
+
+   *val = 0;
+   for (i = 0; i < count; i++) {
+      snprintf(name, sizeof(name), "%s.%llu.%s", group, i, field);
+      if (vu_vm_stat(vm, name, &v) == 0)
+         *val += v;
+   }
+
+   return 0;
+}
+
 void vu_vm_free(vu_vm *vm)
 {
    if (vm) {
@@ -136,6 +654,22 @@ void vu_vm_free(vu_vm *vm)
 
 void vu_vm_connect_close()
 {
+   if (conn && event_callback != -1)
+      virConnectDomainEventDeregisterAny(conn, event_callback);
+   event_callback = -1;
+   event_loop_stop();
+
+   pthread_mutex_lock(&vm_table_lock);
+   vm_table_clear();
+   free(vm_table);
+   vm_table = NULL;
+   vm_table_size = 0;
+   pthread_mutex_unlock(&vm_table_lock);
+
+   if (vm_stats) {
+      virDomainStatsRecordListFree(vm_stats);
+      vm_stats = NULL;
+   }
    if (conn) {
       virConnectUnregisterCloseCallback(conn, conn_close_cb);
       virConnectClose(conn);
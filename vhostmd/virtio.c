@@ -34,6 +34,7 @@
 #include <libvirt/libvirt.h>
 
 #include "util.h"
+#include "metric.h"
 #include "virtio.h"
 
 
@@ -48,7 +49,7 @@ typedef struct {
     time_t update_ts;    /* timestamp of last metrics update */
     char *name;          /* domain name */
     char *uds_name;      /* full UDS name */
-    vu_buffer *metrics;  /* metrics buffer */
+    vu_buffer *metrics[METRIC_FORMAT_COUNT]; /* metrics buffer per format */
     vu_buffer *request;  /* virtio request buffer */
     vu_buffer *response; /* virtio response buffer */
 } channel_t;
@@ -61,7 +62,7 @@ typedef struct {
 typedef enum {
     REQ_INCOMPLETE,
     REQ_INVALID,
-    REQ_GET_XML
+    REQ_GET_METRICS
 } REQUEST_T;
 
 static channel_t *channel = NULL;
@@ -71,6 +72,7 @@ static time_t exp_period = 0;
 static const char *channel_path = NULL;
 static const char *channel_name = "org.github.vhostmd.1";
 static int channel_max = 0;
+static unsigned int channel_formats = 0;  /* 1 << metric_format served */
 static volatile int channel_count = 0;
 static volatile int connection_count = 0;
 
@@ -94,49 +96,49 @@ static channel_t *vio_channel_find(int id, const char * name, int insert);
 static void vio_channel_free(channel_t * c);
 static int vio_channel_open(channel_t * c);
 static void vio_channel_close(channel_t * c);
-static int vio_channel_update(channel_t * c);
+static int vio_channel_update(channel_t * c, metric_format format);
 static int vio_readdir(const char * path);
 static void vio_recv(channel_t * c);
 static void vio_send(channel_t * c, uint32_t ep_event);
 static void vio_expire(void);
-static REQUEST_T vio_check_request(channel_t * c);
+static REQUEST_T vio_check_request(channel_t * c, metric_format * format);
 static void vio_handle_io(unsigned epoll_wait_ms);
 
 /*
  * Update response buffer of a channel.
- * Concat host and VM buffer into the response buffer.
+ * Concat host and VM buffer of the format into the response buffer,
+ * which ends with an empty line.
  */
-static int vio_channel_update(channel_t * c)
+static int vio_channel_update(channel_t * c, metric_format format)
 {
-    static const char *metrics_start_str = "<metrics>\n";
-    static const char *metrics_end_str = "</metrics>\n\n";
-
+    const metric_serializer *s = metric_serializer_get(format);
     int rc = 0;
+    int n = 0;
 
     vu_buffer_erase(c->response);
-    vu_buffer_add(c->response, metrics_start_str, -1);
+    vu_buffer_add(c->response, s->head, -1);
 
     pthread_mutex_lock(&channel_mtx);
 
     /* Dom0/host */
-    if (channel[0].metrics->content && channel[0].metrics->use)
-        vu_buffer_add(c->response, channel[0].metrics->content, -1);
-    else
-        vu_buffer_add(c->response,
-                      "<!-- host metrics not available -->", -1);
+    if (channel[0].metrics[format]->use)
+        metric_fragment_add(s, c->response, channel[0].metrics[format], &n);
+    else if (s->comment)
+        s->comment(c->response, "host metrics not available");
 
     /* VM */
-    if (c->metrics->use)
-        vu_buffer_add(c->response, c->metrics->content, -1);
+    if (c->metrics[format]->use)
+        metric_fragment_add(s, c->response, c->metrics[format], &n);
     else {
-        vu_buffer_add(c->response,
-                      "<!-- VM metrics not available -->", -1);
+        if (s->comment)
+            s->comment(c->response, "VM metrics not available");
         rc = -1;
     }
 
     pthread_mutex_unlock(&channel_mtx);
 
-    vu_buffer_add(c->response, metrics_end_str, -1);
+    vu_buffer_add(c->response, s->tail, -1);
+    vu_buffer_add(c->response, "\n", 1);
 
 #ifdef ENABLE_DEBUG
     vu_log(VHOSTMD_DEBUG, "New response for '%d %s' (%u)\n>>>%s<<<\n",
@@ -151,6 +153,8 @@ static int vio_channel_update(channel_t * c)
  */
 static void vio_channel_free(channel_t * c)
 {
+    int i;
+
     if (c->fd != FREE) {
         struct epoll_event evt;
         epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, &evt);
@@ -165,9 +169,11 @@ static void vio_channel_free(channel_t * c)
         free(c->uds_name);
         c->uds_name = NULL;
     }
-    if (c->metrics) {
-        vu_buffer_delete(c->metrics);
-        c->metrics = NULL;
+    for (i = 0; i < METRIC_FORMAT_COUNT; i++) {
+        if (c->metrics[i]) {
+            vu_buffer_delete(c->metrics[i]);
+            c->metrics[i] = NULL;
+        }
     }
     if (c->request) {
         vu_buffer_delete(c->request);
@@ -333,7 +339,7 @@ static void vio_expire(void)
         channel_t *c = &channel[i];
 
         /* a channel expires when update_ts is older than exp_period */
-        if (c->metrics &&
+        if (c->request &&
             c->update_ts < ts) {
 
 #ifdef ENABLE_DEBUG
@@ -345,6 +351,24 @@ static void vio_expire(void)
     }
 }
 
+/*
+ * Allocate the metrics buffers of the formats served.
+ */
+static int vio_metrics_create(channel_t * c)
+{
+    int i;
+
+    for (i = 0; i < METRIC_FORMAT_COUNT; i++) {
+        if ((channel_formats & (1U << i)) &&
+            vu_buffer_create(&c->metrics[i], DEFAULT_VU_BUFFER_SIZE)) {
+            c->metrics[i] = NULL;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
 /*
  * Lookup/add channel and allocate buffers.
  */
@@ -398,7 +422,7 @@ static channel_t *vio_channel_find(int id, const char * name, int insert)
     c->name = strdup(name);
 
     if (c->name == NULL ||
-        vu_buffer_create(&c->metrics, DEFAULT_VU_BUFFER_SIZE) ||
+        vio_metrics_create(c) ||
         vu_buffer_create(&c->request, DEFAULT_VU_BUFFER_SIZE) ||
         vu_buffer_create(&c->response, DEFAULT_VU_BUFFER_SIZE))
         goto error;
@@ -436,18 +460,35 @@ static int vio_id_compare(const void * a, const void * b)
 /*
  * Check availbale request and return REQ_? status.
  * At the moment there is one request supported:
- * - reading host + VM metrics in XML format in a single buffer.
+ * - reading host + VM metrics in a single buffer, in the format
+ *   named by the request, e.g. "GET /metrics/XML" or "GET /metrics/JSON".
  */
-static REQUEST_T vio_check_request(channel_t * c)
+static REQUEST_T vio_check_request(channel_t * c, metric_format * format)
 {
-    if (strcmp(c->request->content, "GET /metrics/XML\n\n") == 0 ||
-        strcmp(c->request->content, "GET /metrics/XML\r\n\r\n") == 0) {
-        /* valid request */
-        vu_buffer_erase(c->request);
-        return REQ_GET_XML;
-    } else if (c->request->use >= (c->request->size - 1) ||
-               strstr(c->request->content, "\n\n") ||
-               strstr(c->request->content, "\r\n\r\n")) {
+    static const char *get_str = "GET /metrics/";
+    const char *name = c->request->content + strlen(get_str);
+    const char *end;
+    char fmt[16];
+    size_t len;
+
+    if (strncmp(c->request->content, get_str, strlen(get_str)) == 0 &&
+        ((end = strstr(name, "\r\n\r\n")) != NULL ||
+         (end = strstr(name, "\n\n")) != NULL) &&
+        end[end[0] == '\r' ? 4 : 2] == '\0' &&
+        (len = (size_t) (end - name)) < sizeof(fmt)) {
+        memcpy(fmt, name, len);
+        fmt[len] = '\0';
+        if (metric_format_from_str(fmt, format) == 0 &&
+            (channel_formats & (1U << *format))) {
+            /* valid request */
+            vu_buffer_erase(c->request);
+            return REQ_GET_METRICS;
+        }
+    }
+
+    if (c->request->use >= (c->request->size - 1) ||
+        strstr(c->request->content, "\n\n") ||
+        strstr(c->request->content, "\r\n\r\n")) {
         /* invalid request -> reset buffer */
         vu_buffer_erase(c->request);
 
@@ -471,6 +512,7 @@ static void vio_recv(channel_t * c)
 {
     ssize_t rc = 0;
     REQUEST_T req_type = REQ_INCOMPLETE;
+    metric_format format = METRIC_FORMAT_XML;
 
     do {
         char *buf = &c->request->content[c->request->use];
@@ -479,12 +521,12 @@ static void vio_recv(channel_t * c)
         rc = recv(c->fd, buf, len, 0);
 
         if (rc > 0) {
-            req_type = vio_check_request(c);
+            req_type = vio_check_request(c, &format);
         }
     } while (rc > 0 && req_type == REQ_INCOMPLETE);
 
-    if (req_type == REQ_GET_XML) {
-        vio_channel_update(c);
+    if (req_type == REQ_GET_METRICS) {
+        vio_channel_update(c, format);
         vio_send(c, EPOLLIN);
     } else if (req_type == REQ_INVALID)
         vio_send(c, EPOLLIN);
@@ -575,7 +617,8 @@ static void vio_handle_io(unsigned epoll_wait_ms)
  * Once the channel is added to epoll the vu_buffer can be accessed
  * by the epoll_event.data.ptr.
  */
-int virtio_init(char *_channel_path, int _max_channel, int _expiration_period)
+int virtio_init(char *_channel_path, int _max_channel, int _expiration_period,
+                unsigned int _formats)
 {
     int i;
 
@@ -584,6 +627,7 @@ int virtio_init(char *_channel_path, int _max_channel, int _expiration_period)
 
         channel_path = _channel_path;
         channel_max = _max_channel;
+        channel_formats = _formats;
         exp_period = _expiration_period;
         channel_count = 0;
         connection_count = 0;
@@ -594,7 +638,8 @@ int virtio_init(char *_channel_path, int _max_channel, int _expiration_period)
             goto error;
 
         channel[0].id = 0;      /* Dom0 */
-        vu_buffer_create(&channel[0].metrics, DEFAULT_VU_BUFFER_SIZE);
+        if (vio_metrics_create(&channel[0]))
+            goto error;
         for (i = 1; i <= channel_max; i++) {
             channel[i].id = FREE;
             channel[i].fd = -1;
@@ -625,6 +670,11 @@ int virtio_init(char *_channel_path, int _max_channel, int _expiration_period)
         vu_log(VHOSTMD_INFO,
                "Activating virtio, using max_channels %d, expiration_time %ld",
                channel_max, exp_period);
+        for (i = 0; i < METRIC_FORMAT_COUNT; i++) {
+            if (channel_formats & (1U << i))
+                vu_log(VHOSTMD_INFO, "Serving virtio requests for %s",
+                       metric_serializer_get(i)->name);
+        }
     }
 
     return 0;
@@ -716,37 +766,45 @@ void *virtio_run(void *arg ATTRIBUTE_UNUSED)
 /*
  * Update the metrics buffer of a VM/host.
  */
-int virtio_metrics_update(const char * buf,
-                          int len,
+int virtio_metrics_update(vu_buffer ** frags,
                           int id,
                           const char *name)
 {
     int rc = -1;
+    int i;
     channel_t *c = NULL;
 
-    if (buf == NULL || len <= 0 ||
-        name == NULL || id < 0 ||
+    if (frags == NULL || name == NULL || id < 0 ||
         virtio_status != VIRTIO_ACTIVE)
         return -1;
 
+    /* all formats hold the same metrics, either all or none are empty */
+    for (i = 0; i < METRIC_FORMAT_COUNT; i++) {
+        if ((channel_formats & (1U << i)) &&
+            (frags[i] == NULL || frags[i]->use == 0))
+            return -1;
+    }
+
     pthread_mutex_lock(&channel_mtx);
     if (id == 0) {
         /* Dom0 */
         c = &channel[0];
-        vu_buffer_erase(c->metrics);
-        vu_buffer_add(c->metrics, buf, len);
-        rc = 0;
     }
     else {
         /* VM */
         c = vio_channel_find(id, name, 1);
-        if (c) {
-            /* update timestamp + buffer */
-            vu_buffer_erase(c->metrics);
-            vu_buffer_add(c->metrics, buf, len);
+        if (c)
             c->update_ts = time(NULL);
-            rc = 0;
+    }
+    if (c) {
+        /* update buffers */
+        for (i = 0; i < METRIC_FORMAT_COUNT; i++) {
+            if (c->metrics[i] == NULL)
+                continue;
+            vu_buffer_erase(c->metrics[i]);
+            vu_buffer_add(c->metrics[i], frags[i]->content, frags[i]->use);
         }
+        rc = 0;
     }
     pthread_mutex_unlock(&channel_mtx);
 
@@ -35,7 +35,8 @@ static void usage(const char *argv0)
          "\t-x | --xenstore        Get metrics from xenstore.\n"
 #endif
          "\t-i | --virtio          Get metrics from virtio channel.\n"
-         "\t-b | --vbd             Get metrics from vbd.\n";
+         "\t-b | --vbd             Get metrics from vbd.\n"
+         "\t-j | --json            Dump metrics in JSON format.\n";
 
    fprintf (stderr, "\nUsage: %s [options]\n\n%s\n", argv0, options_str);
 }
@@ -48,7 +49,10 @@ int main(int argc, char *argv[])
    int xenstore = 0;
 #endif
    int virtio = 0;
+   int json = 0;
    const char *dfile = NULL;
+   int (*dump_vbd)(const char *) = dump_metrics;
+   int (*dump_virtio)(const char *) = dump_virtio_metrics;
 
    struct option opts[] = {
       { "verbose", no_argument, &verbose, 1},
@@ -57,6 +61,7 @@ int main(int argc, char *argv[])
       { "xenstore", no_argument, &xenstore, 1},
 #endif
       { "virtio", no_argument, &virtio, 1},
+      { "json", no_argument, &json, 1},
       { "help", no_argument, NULL, '?' },
       { "dest", optional_argument, NULL, 'd'},
       {0, 0, 0, 0}
@@ -67,9 +72,9 @@ int main(int argc, char *argv[])
       int c;
 
 #ifdef WITH_XENSTORE
-      c = getopt_long(argc, argv, "d:vbix", opts, &optidx);
+      c = getopt_long(argc, argv, "d:vbijx", opts, &optidx);
 #else
-      c = getopt_long(argc, argv, "d:vbi", opts, &optidx);
+      c = getopt_long(argc, argv, "d:vbij", opts, &optidx);
 #endif
 
       if (c == -1)
@@ -88,6 +93,9 @@ int main(int argc, char *argv[])
          case 'i':
             virtio = 1;
             break;
+         case 'j':
+            json = 1;
+            break;
 #ifdef WITH_XENSTORE
          case 'x':
             xenstore = 1;
@@ -105,6 +113,11 @@ int main(int argc, char *argv[])
       }
    }
 
+   if (json) {
+       dump_vbd = dump_metrics_json;
+       dump_virtio = dump_virtio_metrics_json;
+   }
+
 #ifdef WITH_XENSTORE
    if (xenstore) {
        if (dump_xenstore_metrics(dfile) == -1)
@@ -114,13 +127,13 @@ int main(int argc, char *argv[])
 #endif
 
    if (virtio) {
-       if (dump_virtio_metrics(dfile) == -1)
+       if (dump_virtio(dfile) == -1)
            exit(1);
        exit(0);
    }
 
    if (vbd) {
-       if (dump_metrics(dfile) == -1)
+       if (dump_vbd(dfile) == -1)
            exit(1);
        exit(0);
    }
@@ -129,8 +142,8 @@ int main(int argc, char *argv[])
     * If no metrics source is specfied, try default order
     * disk, virtio, xenstore
     */
-   if (dump_metrics(dfile) == -1) {
-       if (dump_virtio_metrics(dfile) == -1) {
+   if (dump_vbd(dfile) == -1) {
+       if (dump_virtio(dfile) == -1) {
 #ifdef WITH_XENSTORE
            if (dump_xenstore_metrics(dfile) == -1)
                exit(1);